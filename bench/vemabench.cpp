@@ -0,0 +1,478 @@
+// Benchmarks the lexer and parser on generated C-like input, parsed with the
+// vematest grammar. The input is the same for a given kind and size on every
+// run and platform.
+//
+//   vemabench [--full] [--sizes 1K,64K,1M] [--kinds flat,deep,strings,comments] [--ast-limit 256K] [--write dir]
+//
+// --full runs sizes from 1K to 500M; the AST of Nodes is only built for
+// inputs up to --ast-limit, the ast::Tree always. --write also saves each
+// input to dir.
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <stdint.h>
+#include <vemaparse/lexer.h>
+#include <vemaparse/parser.h>
+#include <vemaparse/ast.h>
+#include "../test/grammar.h"
+
+#if !defined(__linux__) && !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+static uint64_t allocations = 0;
+
+// Every form of new and delete is replaced, so each delete pairs with a
+// matching new. release is kept out of line so the compiler doesn't see
+// free() called on what it takes for operator new's memory and warn.
+#if defined(_MSC_VER)
+#define VEMABENCH_NOINLINE __declspec(noinline)
+#else
+#define VEMABENCH_NOINLINE __attribute__((noinline))
+#endif
+
+static void *allocate(std::size_t size)
+{
+    ++allocations;
+    return std::malloc(size ? size : 1);
+}
+
+static VEMABENCH_NOINLINE void release(void *p)
+{
+    std::free(p);
+}
+
+void *operator new(std::size_t size)
+{
+    if (void *ret = allocate(size))
+        return ret;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    if (void *ret = allocate(size))
+        return ret;
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    release(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    release(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    release(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    release(p);
+}
+
+// Used from C++14 on.
+void operator delete(void *p, std::size_t) noexcept
+{
+    release(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    release(p);
+}
+
+typedef std::chrono::steady_clock clock_type;
+
+double seconds_since(clock_type::time_point start)
+{
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+// Peak resident set size in bytes since the last reset_peak_rss(), where the
+// platform can reset it; otherwise since the start of the process.
+void reset_peak_rss()
+{
+#if defined(__linux__)
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+uint64_t peak_rss()
+{
+#if defined(__linux__)
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return std::strtoull(line.c_str() + 6, NULL, 10) * 1024;
+    return 0;
+#elif defined(_WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return uint64_t(usage.ru_maxrss);
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Small deterministic generator, so corpora don't depend on the standard
+// library's distributions.
+class Random
+{
+    uint64_t state;
+
+public:
+    Random(uint64_t seed) : state(seed) { }
+
+    uint32_t next()
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return uint32_t(state >> 33);
+    }
+
+    uint32_t below(uint32_t n)
+    {
+        return next() % n;
+    }
+};
+
+struct Corpus
+{
+    std::string kind;
+    std::string text;
+};
+
+void append_word(std::string &out, Random &random)
+{
+    static const char *words[] = {"alpha", "beta", "gamma", "delta", "value", "count", "index", "node", "tree", "x", "y"};
+    out += words[random.below(sizeof(words) / sizeof(words[0]))];
+    out += std::to_string(random.below(1000));
+}
+
+// An if statement nested depth deep, with nested parentheses at the bottom.
+void append_nested(std::string &out, Random &random, uint32_t level, uint32_t depth)
+{
+    const std::string indent(level * 4, ' ');
+    out += indent + "if ((";
+    append_word(out, random);
+    out += ")) {\n";
+    if (random.below(2) == 0) {
+        out += indent + "    ";
+        append_word(out, random);
+        out += ";\n";
+    }
+    if (level + 1 < depth) {
+        append_nested(out, random, level + 1, depth);
+    } else {
+        out += indent + "    " + std::string(8, '(');
+        append_word(out, random);
+        out += std::string(8, ')') + ";\n";
+    }
+    out += indent + "} else {\n" + indent + "    ";
+    append_word(out, random);
+    out += ";\n" + indent + "}\n";
+}
+
+// One top level item of the given kind.
+void append_item(std::string &out, const std::string &kind, Random &random)
+{
+    static const char *keywords[] = {"int", "float", "double"};
+    if (kind == "flat") {
+        switch (random.below(4)) {
+        case 0:
+            out += keywords[random.below(3)];
+            out += ' ';
+            append_word(out, random);
+            out += " = ";
+            append_word(out, random);
+            out += " + " + std::to_string(random.below(100000)) + ";\n";
+            break;
+        case 1:
+            append_word(out, random);
+            out += ";\n";
+            break;
+        case 2:
+            out += "(";
+            append_word(out, random);
+            out += ");\n";
+            break;
+        default:
+            out += "#include \"";
+            append_word(out, random);
+            out += ".h\"\n";
+            break;
+        }
+    } else if (kind == "deep") {
+        append_nested(out, random, 0, 8 + random.below(41));
+    } else if (kind == "strings") {
+        out += keywords[random.below(3)];
+        out += ' ';
+        append_word(out, random);
+        out += " = \"";
+        const uint32_t length = 256 + random.below(4096);
+        for (uint32_t i = 0; i < length; ++i)
+            out += random.below(6) == 0 ? ' ' : char('a' + random.below(26));
+        out += "\";\n";
+    } else {
+        if (random.below(2)) {
+            out += "// ";
+            for (uint32_t i = 0, n = 4 + random.below(12); i < n; ++i) {
+                append_word(out, random);
+                out += ' ';
+            }
+            out += "\n";
+        } else {
+            out += "/* ";
+            for (uint32_t i = 0, n = 8 + random.below(40); i < n; ++i) {
+                append_word(out, random);
+                out += i % 8 == 7 ? "\n   " : " ";
+            }
+            out += "*/\n";
+        }
+        if (random.below(4) == 0) {
+            append_word(out, random);
+            out += ";\n";
+        }
+    }
+}
+
+Corpus generate(const std::string &kind, std::size_t size)
+{
+    Corpus ret;
+    ret.kind = kind;
+    ret.text.reserve(size + 64 * 1024);
+    Random random(size * 31 + kind.size());
+    while (ret.text.size() < size)
+        append_item(ret.text, kind, random);
+    return ret;
+}
+
+std::size_t parse_size(const std::string &text)
+{
+    char *end = NULL;
+    std::size_t ret = std::strtoull(text.c_str(), &end, 10);
+    if (*end == 'K' || *end == 'k')
+        ret <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        ret <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        ret <<= 30;
+    return ret;
+}
+
+// value right aligned in width columns, or - if it is negative.
+std::string column(double value, int precision, int width)
+{
+    std::ostringstream ret;
+    ret << std::setw(width);
+    if (value < 0)
+        ret << "-";
+    else
+        ret << std::fixed << std::setprecision(precision) << value;
+    return ret.str();
+}
+
+std::vector<std::string> split(const std::string &text)
+{
+    std::vector<std::string> ret;
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+        if (!item.empty())
+            ret.push_back(item);
+    return ret;
+}
+
+// visit_match leaves parents and children pointing at each other.
+void release(Node &node)
+{
+    node.parent.reset();
+    for (auto iter = node.children.begin(); iter != node.children.end(); ++iter)
+        release(**iter);
+    node.children.clear();
+}
+
+double grammar_construction()
+{
+    const int iterations = 1000;
+    const clock_type::time_point start = clock_type::now();
+    for (int i = 0; i < iterations; ++i) {
+        auto rule = grammar();
+        Grammar compiled(rule);
+        rule->reset();
+    }
+    return seconds_since(start) / iterations;
+}
+
+// Lex repeatedly for at least a fifth of a second.
+void lex(const std::string &text, double &tokens_per_second, double &bytes_per_second)
+{
+    const clock_type::time_point start = clock_type::now();
+    uint64_t passes = 0, tokens = 0;
+    double elapsed = 0;
+    do {
+        Lexer lexer(text.data(), text.data() + text.size());
+        for (auto iter = lexer.begin(); iter != lexer.end(); ++iter)
+            ++tokens;
+        ++passes;
+        elapsed = seconds_since(start);
+    } while (elapsed < 0.2);
+    tokens_per_second = tokens / elapsed;
+    bytes_per_second = double(text.size()) * passes / elapsed;
+}
+
+bool run(const Corpus &corpus, std::size_t ast_limit)
+{
+    const std::string &text = corpus.text;
+    const double mb = double(text.size()) / (1 << 20);
+    double tokens_per_second, lex_bytes_per_second;
+    lex(text, tokens_per_second, lex_bytes_per_second);
+
+    reset_peak_rss();
+    uint64_t before = allocations;
+    clock_type::time_point start = clock_type::now();
+    Lexer lexer(text.data(), text.data() + text.size());
+    TokenStream tokens(lexer);
+    const double stream_time = seconds_since(start);
+
+    auto rule = grammar();
+    Grammar compiled(rule);
+    before = allocations;
+    start = clock_type::now();
+    bool ok;
+    double parse_time, ast_time = -1, tree_time = -1;
+    uint64_t parse_allocations, ast_allocations = 0, tree_allocations = 0;
+    {
+        ParseContext ctx(compiled);
+        Match *ret = rule->get_match(ctx, tokens.begin(), tokens.end());
+        parse_time = seconds_since(start);
+        parse_allocations = allocations - before;
+        ok = ret->matched && ret->end == tokens.end();
+
+        if (ok) {
+            before = allocations;
+            start = clock_type::now();
+            ast::Tree tree;
+            auto skip = [&compiled](ast::Tree &t, uint32_t id) {
+                if (!compiled.action(t[id].kind))
+                    t.skip(id);
+            };
+            for (auto iter = ret->children.begin(); iter != ret->children.end(); ++iter)
+                tree.append(tree.root(), **iter, skip);
+            tree_time = seconds_since(start);
+            tree_allocations = allocations - before;
+        }
+
+        // Building the AST is slower than linear (skip_node looks for each
+        // node in its parent's list), so it is only timed up to ast_limit.
+        if (ok && text.size() <= ast_limit) {
+            // The test grammar's regex actions print; keep that out of the way.
+            std::streambuf *out = std::cout.rdbuf(NULL);
+            before = allocations;
+            start = clock_type::now();
+            Node::node_ptr root = std::make_shared<Node>();
+            for (auto iter = ret->children.begin(); iter != ret->children.end(); ++iter)
+                visit_match(compiled, **iter, root);
+            ast_time = seconds_since(start);
+            ast_allocations = allocations - before;
+            std::cout.rdbuf(out);
+            release(*root);
+        }
+    }
+    const uint64_t rss = peak_rss();
+    rule->reset();
+
+    std::cout << std::left << std::setw(9) << corpus.kind << std::right
+              << column(mb, 3, 10) << std::setw(11) << tokens.size()
+              << column(tokens_per_second / 1e6, 2, 12) << column(lex_bytes_per_second / (1 << 20), 1, 10)
+              << column(mb / stream_time, 1, 13) << column(mb / parse_time, 1, 12)
+              << column(ast_time * 1000, 2, 9) << column(tree_time * 1000, 2, 9)
+              << column(double(rss) / (1 << 20), 1, 9)
+              << std::setw(14) << parse_allocations
+              << std::setw(12) << (ast_time >= 0 ? std::to_string(ast_allocations) : "-")
+              << std::setw(13) << (tree_time >= 0 ? std::to_string(tree_allocations) : "-")
+              << (ok ? "" : "  FAILED TO PARSE") << std::endl;
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> sizes = split("1K,64K,1M,16M");
+    std::vector<std::string> kinds = split("flat,deep,strings,comments");
+    std::size_t ast_limit = parse_size("256K");
+    std::string write_dir;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--full") {
+            sizes = split("1K,64K,1M,16M,128M,500M");
+        } else if (arg == "--sizes" && i + 1 < argc) {
+            sizes = split(argv[++i]);
+        } else if (arg == "--kinds" && i + 1 < argc) {
+            kinds = split(argv[++i]);
+        } else if (arg == "--ast-limit" && i + 1 < argc) {
+            ast_limit = parse_size(argv[++i]);
+        } else if (arg == "--write" && i + 1 < argc) {
+            write_dir = argv[++i];
+        } else {
+            std::cerr << "USAGE: " << argv[0] << " [--full] [--sizes 1K,64K,1M] [--kinds flat,deep,strings,comments] [--ast-limit 256K] [--write dir]\n";
+            return 1;
+        }
+    }
+
+    {
+        auto rule = grammar();
+        Grammar compiled(rule);
+        std::cout << "grammar: " << compiled.size() << " rules, built in " << std::fixed << std::setprecision(1)
+                  << grammar_construction() * 1e6 << " us\n\n";
+        rule->reset();
+    }
+    std::cout << std::left << std::setw(9) << "kind" << std::right << std::setw(10) << "MB" << std::setw(11) << "tokens"
+              << std::setw(12) << "lex Mtok/s" << std::setw(10) << "lex MB/s" << std::setw(13) << "stream MB/s"
+              << std::setw(12) << "parse MB/s" << std::setw(9) << "ast ms" << std::setw(9) << "tree ms"
+              << std::setw(9) << "peak MB" << std::setw(14) << "parse allocs" << std::setw(12) << "ast allocs"
+              << std::setw(13) << "tree allocs" << std::endl;
+
+    bool ok = true;
+    for (auto kind = kinds.begin(); kind != kinds.end(); ++kind) {
+        for (auto size = sizes.begin(); size != sizes.end(); ++size) {
+            const Corpus corpus = generate(*kind, parse_size(*size));
+            if (!write_dir.empty()) {
+                std::ofstream out((write_dir + "/" + *kind + "-" + *size + ".c").c_str(), std::ios::binary);
+                out << corpus.text;
+            }
+            try {
+                ok = run(corpus, ast_limit) && ok;
+            } catch (const vemalex::LexerError &error) {
+                std::cerr << "ERROR: " << error.what() << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -1,311 +1,730 @@
-
-#ifndef VEMAPARSE_AST_H_
-#define VEMAPARSE_AST_H_
-
-#include <iostream>
-#include <list>
-#include <deque>
-#include <tuple>
-#include <vector>
-#include <string>
-#include <functional>
-#include <memory>
-#include <sstream>
-#include <stdint.h>
-
-#include <regex>
-#define VEMA_RE_OBJ std::regex
-#define VEMA_RE_REPLACE std::regex_replace
-#define VEMA_RE_MATCH std::regex_match
-#define NEGATIVE_ASSERT "(?!"
-
-#include "lexer.h"
-#include "parser.h"
-
-namespace ast
-{
-
-template <typename Node>
-std::string default_debug(std::ostream &stream, const Node &node);
-
-template <typename Node>
-std::string to_string(typename Node::const_child_iterator_type begin, typename Node::const_child_iterator_type end)
-{
-    std::string ret;
-    std::for_each(begin, end, [&ret](typename Node::node_ptr n) {ret += n->text;});
-    return ret;
-}
-
-namespace detail
-{
-    template <typename Iterator>
-    void print_children(const std::string &name, Iterator begin, Iterator end)
-    {
-        std::cerr << name << " children : ";
-        for (auto i = begin; i != end; ++i)
-            std::cerr << " /-\\ " << (**i)->text;
-        std::cerr << "\n";
-    }
-    template <typename Node>
-    void print_children(Node &node)
-    {
-        std::cerr << node.name << " children : ";
-        for (auto i = node.children.begin(); i != node.children.end(); ++i)
-            std::cerr << " /-\\ " << (*i)->text;
-        std::cerr << "\n";
-    }
-}
-
-template <typename Node>
-std::string default_debug(std::ostream &stream, const Node &node)
-{
-    static uint64_t counter = 0;
-    std::string name = VEMA_RE_REPLACE(node.name, VEMA_RE_OBJ(" |-|>|\n|\r|\\\\|\\(|\\)"), std::string("_"));
-    {
-        std::ostringstream ss;
-        ss << name << counter++;
-        name = ss.str();
-    }
-
-    std::string label;
-    if (node.type == Node::VALUE) {
-        std::ostringstream ss;
-        ss << node.value;
-        label = ss.str();
-    } else if (!node.text.empty()) {
-        label = ast::to_string<Node>(node.children.begin(), node.children.end());
-    }
-    label = VEMA_RE_REPLACE(label, VEMA_RE_OBJ(NEGATIVE_ASSERT"\\\\)\""), std::string("\\\""));
-    label = VEMA_RE_REPLACE(label, VEMA_RE_OBJ("\n|\r"), std::string("_"));
-    stream << name << " [label=\"" << node.name << " - " << label << "\"];" << std::endl;
-
-    std::vector<std::string> names;
-    for (auto iter = node.children.cbegin(); iter != node.children.cend(); ++iter)
-        names.push_back((*iter)->debug(stream));
-    for (auto iter = names.begin(); iter != names.end(); ++iter)
-        stream << name << " -> " << (*iter) << ";" << std::endl;
-    return name;
-}
-
-template <typename Node>
-void remove_node(Node &node)
-{
-    typename Node::child_iterator_type iter;
-    for (iter = node.parent->children.begin(); iter != node.parent->children.end(); ++iter)
-        if (iter->get() == &node)
-            break;
-    assert(iter != node.parent->children.end());
-    node.parent->children.erase(iter);
-}
-
-template <typename Node>
-void skip_node(Node &node)
-{
-    // Insert node's children into parent.
-    typename Node::child_iterator_type iter;
-    for (iter = node.parent->children.begin(); iter != node.parent->children.end(); ++iter)
-        if (iter->get() == &node)
-            break;
-    // If this node was already skipped, and we're trying to skip it again,
-    // just ignore.
-    if (iter == node.parent->children.end()) {
-        assert(node.children.size() == 0);
-        return;
-    }
-    // If terminal (i.e. no children), do nothing.
-    if (node.children.size() == 0)
-        return;
-    node.parent->children.insert(iter, node.children.begin(), node.children.end());
-    node.children.clear();
-    node.parent->children.erase(iter);
-    #if 0
-    std::cerr << "Skipping " << node.name << ": " << node.text << std::endl;
-    std::cerr << " parent: ";
-    for (auto i = node.parent->children.begin(); i != node.parent->children.end(); ++i)
-        std::cerr << ", " << (*i)->text;
-    std::cerr << "\n";
-    #endif
-}
-
-template <typename Node>
-void use_middle(Node &node)
-{
-    assert(node.children.size() == 3);
-    typename Node::child_iterator_type iter;
-    for (iter = node.parent->children.begin(); iter != node.parent->children.end(); ++iter)
-        if (iter->get() == &node)
-            break;
-    assert(iter != node.parent->children.end());
-    iter = node.children.begin();
-    node.children.erase(iter++);
-    ++iter;
-    node.children.erase(iter);
-    skip_node(node);
-}
-
-template <typename Node>
-void remove_terminals(Node &node)
-{
-    typename Node::child_iterator_type iter;
-    iter = node.children.begin();
-    while (iter != node.children.end()) {
-        if ((*iter)->children.size() == 0) {
-            node.children.erase(iter++);
-        } else {
-            ++iter;
-        }
-    }
-}
-
-template <typename Node>
-void remove_terminals_match(Node &node, const std::string &regex_string)
-{
-    auto re = VEMA_RE_OBJ(regex_string);
-    typename Node::child_iterator_type iter;
-    iter = node.children.begin();
-    while (iter != node.children.end()) {
-        const bool matched = VEMA_RE_MATCH((*iter)->text, re);
-        if (matched) {
-            node.children.erase(iter++);
-        } else {
-            ++iter;
-        }
-    }
-}
-
-template <typename Node>
-std::tuple<std::vector<typename Node::child_iterator_type>, std::vector<typename Node::child_iterator_type>>
-split_match(Node &node, const std::string &regex_string)
-{
-    auto re = VEMA_RE_OBJ(regex_string);
-    std::vector<typename Node::child_iterator_type> l, r;
-    auto iter = node.children.begin();
-    while (iter != node.children.end()) {
-        const bool matched = VEMA_RE_MATCH((*iter)->text, re);
-        if (matched) {
-            ++iter;
-            break;
-        }
-        l.push_back(iter);
-        ++iter;
-    }
-    // Collect everything after the match
-    for (; iter != node.children.end(); ++iter)
-        r.push_back(iter);
-    return std::make_tuple(l, r);
-}
-
-template <typename T>
-inline bool to_number(const std::string &text, T &value)
-{
-    if (text.empty())
-        return 0;
-    std::istringstream ss(text);
-    if (text.size() < 3) {
-        uint64_t tmp;
-        ss >> std::dec >> tmp;
-        value = tmp;
-    } else {
-        if (text[0] == '0' && text[1] == 'x') {
-            ss.str(text.substr(2, text.size()));
-            uint64_t tmp;
-            ss >> std::hex >> tmp;
-            value = T(tmp);
-        } else if (text.find(".") != std::string::npos) {
-            double tmp;
-            ss >> tmp;
-            value = T(tmp);
-        } else {
-            uint64_t tmp;
-            ss >> std::dec >> tmp;
-            value = T(tmp);
-        }
-    }
-    char c;
-    if (ss.fail() || ss.get(c))
-        return false;
-    return true;
-}
-
-template <typename Node>
-static void literal(vemalex::Token token_type, Node &node)
-{
-    switch (token_type) {
-    case vemalex::IDENTIFIER:
-        node.value = decltype(node.value)(node.text);
-        node.name = "identifier";
-        break;
-
-    case vemalex::NUMBER_LITERAL:
-        node.name = "number";
-        ::ast::to_number(node.text, node.value);
-        break;
-
-    case vemalex::STRING_LITERAL:
-    {
-        node.name = "string";
-        std::string s = VEMA_RE_REPLACE(node.text, VEMA_RE_OBJ(NEGATIVE_ASSERT"\\\\)\""), std::string());
-        s = VEMA_RE_REPLACE(s, VEMA_RE_OBJ(NEGATIVE_ASSERT"\\\\)\\\\\""), std::string("\""));
-        s = VEMA_RE_REPLACE(s, VEMA_RE_OBJ(NEGATIVE_ASSERT"\\\\)\\\\n"), std::string("\n"));
-        s = VEMA_RE_REPLACE(s, VEMA_RE_OBJ(NEGATIVE_ASSERT"\\\\)\\\\r"), std::string("\r"));
-        node.value = decltype(node.value)(s);
-        node.children.clear();
-        break;
-    }
-
-    default:
-        std::cerr << "ERROR: unkown literal type\n";
-        ::exit(1);
-        break;
-    }
-    assert(!node.children.size());
-}
-
-inline std::string op_to_name(std::string op)
-{
-    if (op == "+")
-        return "plus";
-    else if (op == "-")
-        return "minus";
-    else if (op == "*")
-        return "mul";
-    else if (op == "/")
-        return "div";
-    else if (op == "&")
-        return "bin_and";
-    else if (op == "|")
-        return "bin_or";
-    else if (op == "%")
-        return "mod";
-    else if (op == ">>")
-        return "right shift";
-    else if (op == "<<")
-        return "left shift";
-    else if (op == "==")
-        return "equals";
-    else if (op == "!=")
-        return "not equals";
-    else if (op == "<")
-        return "less than";
-    else if (op == ">")
-        return "greater than";
-    else if (op == "<=")
-        return "lte";
-    else if (op == ">=")
-        return "gte";
-    else if (op == "&&")
-        return "logical_and";
-    else if (op == "||")
-        return "logical_or";
-    else if (op == "++")
-        return "unary_plus";
-    else if (op == "--")
-        return "unary_minus";
-    else if (op == "-")
-        return "minus";
-    return "I DONT KNOW " + op;
-}
-
-}
-
-#endif
+
+#ifndef VEMAPARSE_AST_H_
+#define VEMAPARSE_AST_H_
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <deque>
+#include <tuple>
+#include <vector>
+#include <string>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <regex>
+#define VEMA_RE_OBJ std::regex
+#define VEMA_RE_REPLACE std::regex_replace
+#define VEMA_RE_MATCH std::regex_match
+#define NEGATIVE_ASSERT "(?!"
+
+#include "lexer.h"
+#include "parser.h"
+
+namespace ast
+{
+
+template <typename Node>
+std::string default_debug(std::ostream &stream, const Node &node);
+
+template <typename Node>
+std::string to_string(typename Node::const_child_iterator_type begin, typename Node::const_child_iterator_type end)
+{
+    std::string ret;
+    std::for_each(begin, end, [&ret](typename Node::node_ptr n) {ret += n->text;});
+    return ret;
+}
+
+namespace detail
+{
+    template <typename Iterator>
+    void print_children(const std::string &name, Iterator begin, Iterator end)
+    {
+        std::cerr << name << " children : ";
+        for (auto i = begin; i != end; ++i)
+            std::cerr << " /-\\ " << (**i)->text;
+        std::cerr << "\n";
+    }
+    template <typename Node>
+    void print_children(Node &node)
+    {
+        std::cerr << node.name << " children : ";
+        for (auto i = node.children.begin(); i != node.children.end(); ++i)
+            std::cerr << " /-\\ " << (*i)->text;
+        std::cerr << "\n";
+    }
+}
+
+template <typename Node>
+std::string default_debug(std::ostream &stream, const Node &node)
+{
+    // Shared by every tree so names stay unique when graphs are combined.
+    static std::atomic<uint64_t> counter(0);
+    std::string name = node.name;
+    for (auto iter = name.begin(); iter != name.end(); ++iter)
+        if (!::isalnum(static_cast<unsigned char>(*iter)))
+            *iter = '_';
+    {
+        std::ostringstream ss;
+        ss << name << counter++;
+        name = ss.str();
+    }
+
+    std::string text;
+    if (node.type == Node::VALUE) {
+        std::ostringstream ss;
+        ss << node.value;
+        text = ss.str();
+    } else if (!node.text.empty()) {
+        text = ast::to_string<Node>(node.children.begin(), node.children.end());
+    }
+    std::string label;
+    label.reserve(text.size());
+    for (auto iter = text.begin(); iter != text.end(); ++iter) {
+        if (*iter == '"' || *iter == '\\')
+            label += '\\';
+        label += *iter == '\n' || *iter == '\r' ? '_' : *iter;
+    }
+    stream << name << " [label=\"" << node.name << " - " << label << "\"];\n";
+
+    std::vector<std::string> names;
+    for (auto iter = node.children.cbegin(); iter != node.children.cend(); ++iter)
+        names.push_back((*iter)->debug(stream));
+    for (auto iter = names.begin(); iter != names.end(); ++iter)
+        stream << name << " -> " << (*iter) << ";\n";
+    return name;
+}
+
+template <typename Node>
+void remove_node(Node &node)
+{
+    typename Node::child_iterator_type iter;
+    for (iter = node.parent->children.begin(); iter != node.parent->children.end(); ++iter)
+        if (iter->get() == &node)
+            break;
+    assert(iter != node.parent->children.end());
+    node.parent->children.erase(iter);
+}
+
+template <typename Node>
+void skip_node(Node &node)
+{
+    // Insert node's children into parent.
+    typename Node::child_iterator_type iter;
+    for (iter = node.parent->children.begin(); iter != node.parent->children.end(); ++iter)
+        if (iter->get() == &node)
+            break;
+    // If this node was already skipped, and we're trying to skip it again,
+    // just ignore.
+    if (iter == node.parent->children.end()) {
+        assert(node.children.size() == 0);
+        return;
+    }
+    // If terminal (i.e. no children), do nothing.
+    if (node.children.size() == 0)
+        return;
+    node.parent->children.insert(iter, node.children.begin(), node.children.end());
+    node.children.clear();
+    node.parent->children.erase(iter);
+    #if 0
+    std::cerr << "Skipping " << node.name << ": " << node.text << std::endl;
+    std::cerr << " parent: ";
+    for (auto i = node.parent->children.begin(); i != node.parent->children.end(); ++i)
+        std::cerr << ", " << (*i)->text;
+    std::cerr << "\n";
+    #endif
+}
+
+template <typename Node>
+void use_middle(Node &node)
+{
+    assert(node.children.size() == 3);
+    typename Node::child_iterator_type iter;
+    for (iter = node.parent->children.begin(); iter != node.parent->children.end(); ++iter)
+        if (iter->get() == &node)
+            break;
+    assert(iter != node.parent->children.end());
+    iter = node.children.begin();
+    node.children.erase(iter++);
+    ++iter;
+    node.children.erase(iter);
+    skip_node(node);
+}
+
+template <typename Node>
+void remove_terminals(Node &node)
+{
+    typename Node::child_iterator_type iter;
+    iter = node.children.begin();
+    while (iter != node.children.end()) {
+        if ((*iter)->children.size() == 0) {
+            node.children.erase(iter++);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+// A pattern for the helpers below, compiled once rather than on every
+// call. Plain strings and alternations of them, like ";" or ",|;", are
+// compared as strings; anything else goes through VEMA_RE_OBJ.
+class Matcher
+{
+    std::vector<std::string> literals;
+    std::shared_ptr<VEMA_RE_OBJ> re;
+
+public:
+    explicit Matcher(const std::string &pattern)
+    {
+        std::string text;
+        std::size_t begin = 0;
+        for (std::size_t i = 0; i <= pattern.size(); ++i) {
+            if (i < pattern.size() && pattern[i] == '\\' && i + 1 < pattern.size()) {
+                ++i;
+                continue;
+            }
+            if (i < pattern.size() && pattern[i] != '|')
+                continue;
+            if (!vemaparse::detail::regex_literal(pattern.substr(begin, i - begin), text)) {
+                literals.clear();
+                re = std::make_shared<VEMA_RE_OBJ>(pattern);
+                return;
+            }
+            literals.push_back(text);
+            begin = i + 1;
+        }
+    }
+
+    template <typename Text>
+    bool matches(const Text &text) const
+    {
+        if (re)
+            return VEMA_RE_MATCH(text.begin(), text.end(), *re);
+        for (auto iter = literals.begin(); iter != literals.end(); ++iter)
+            if (iter->size() == std::size_t(std::distance(text.begin(), text.end())) && std::equal(iter->begin(), iter->end(), text.begin()))
+                return true;
+        return false;
+    }
+};
+
+template <typename Node>
+void remove_terminals_match(Node &node, const Matcher &matcher)
+{
+    typename Node::child_iterator_type iter;
+    iter = node.children.begin();
+    while (iter != node.children.end()) {
+        if (matcher.matches((*iter)->text)) {
+            node.children.erase(iter++);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+template <typename Node>
+void remove_terminals_match(Node &node, const std::string &regex_string)
+{
+    remove_terminals_match(node, Matcher(regex_string));
+}
+
+template <typename Node>
+std::tuple<std::vector<typename Node::child_iterator_type>, std::vector<typename Node::child_iterator_type>>
+split_match(Node &node, const Matcher &matcher)
+{
+    std::vector<typename Node::child_iterator_type> l, r;
+    auto iter = node.children.begin();
+    while (iter != node.children.end()) {
+        if (matcher.matches((*iter)->text)) {
+            ++iter;
+            break;
+        }
+        l.push_back(iter);
+        ++iter;
+    }
+    // Collect everything after the match
+    for (; iter != node.children.end(); ++iter)
+        r.push_back(iter);
+    return std::make_tuple(l, r);
+}
+
+template <typename Node>
+std::tuple<std::vector<typename Node::child_iterator_type>, std::vector<typename Node::child_iterator_type>>
+split_match(Node &node, const std::string &regex_string)
+{
+    return split_match(node, Matcher(regex_string));
+}
+
+// An AST in one vector. Nodes refer to their parent, children and siblings
+// by index, so building it doesn't allocate per node, there are no
+// reference cycles, and unlinking, skipping or replacing a node doesn't
+// search its siblings. Node 0 is the root. Removed nodes stay in the
+// vector, unreachable, until compact(), which also lays the nodes out in
+// depth first order again.
+class Tree
+{
+public:
+    static const uint32_t none = ~uint32_t(0);
+
+    struct Node
+    {
+        // E.g. the rule id, with begin and end its token positions.
+        uint32_t kind;
+        uint32_t begin, end;
+        uint32_t parent;
+        uint32_t first_child, last_child;
+        uint32_t prev_sibling, next_sibling;
+    };
+
+private:
+    std::vector<Node> nodes;
+
+    void unlink(uint32_t id)
+    {
+        Node &node = nodes[id];
+        Node &parent = nodes[node.parent];
+        if (node.prev_sibling != none)
+            nodes[node.prev_sibling].next_sibling = node.next_sibling;
+        else
+            parent.first_child = node.next_sibling;
+        if (node.next_sibling != none)
+            nodes[node.next_sibling].prev_sibling = node.prev_sibling;
+        else
+            parent.last_child = node.prev_sibling;
+        node.parent = node.prev_sibling = node.next_sibling = none;
+    }
+
+    template <typename M, typename Leave>
+    void add_match(uint32_t parent, const M &m, Leave &leave, bool failed)
+    {
+        if (m.end == m.begin && !failed)
+            return;
+        const uint32_t id = add(parent, m.rule, uint32_t(m.begin.position()), uint32_t(m.end.position()));
+        for (auto iter = m.children.begin(); iter != m.children.end(); ++iter)
+            add_match(id, **iter, leave, failed);
+        leave(*this, id);
+    }
+
+public:
+    explicit Tree(uint32_t root_kind = none)
+    {
+        Node root = {root_kind, 0, 0, none, none, none, none, none};
+        nodes.push_back(root);
+    }
+
+    uint32_t root() const
+    {
+        return 0;
+    }
+
+    // Including removed nodes.
+    std::size_t size() const
+    {
+        return nodes.size();
+    }
+
+    const Node &operator [](uint32_t id) const
+    {
+        return nodes[id];
+    }
+
+    // New last child of parent.
+    uint32_t add(uint32_t parent, uint32_t kind, uint32_t begin, uint32_t end)
+    {
+        const uint32_t id = uint32_t(nodes.size());
+        Node node = {kind, begin, end, parent, none, none, nodes[parent].last_child, none};
+        nodes.push_back(node);
+        Node &p = nodes[parent];
+        if (p.last_child != none)
+            nodes[p.last_child].next_sibling = id;
+        else
+            p.first_child = id;
+        p.last_child = id;
+        return id;
+    }
+
+    // Add m's subtree under parent the way visit_match does, leaving out
+    // empty matches unless failed is set, and call leave(tree, id) for each
+    // node once its children are in place, e.g. to skip() it.
+    template <typename M, typename Leave>
+    void append(uint32_t parent, const M &m, Leave leave, bool failed = false)
+    {
+        add_match(parent, m, leave, failed);
+    }
+
+    std::size_t child_count(uint32_t id) const
+    {
+        std::size_t ret = 0;
+        for (uint32_t c = nodes[id].first_child; c != none; c = nodes[c].next_sibling)
+            ++ret;
+        return ret;
+    }
+
+    // Take id and its subtree out of the tree.
+    void remove(uint32_t id)
+    {
+        assert(id != root() && nodes[id].parent != none);
+        unlink(id);
+    }
+
+    // Put id's children where id is and take id out. Linear in the number
+    // of children, whose parent changes.
+    void skip(uint32_t id)
+    {
+        Node &node = nodes[id];
+        if (node.parent == none || node.first_child == none)
+            return;
+        for (uint32_t c = node.first_child; c != none; c = nodes[c].next_sibling)
+            nodes[c].parent = node.parent;
+        Node &parent = nodes[node.parent];
+        nodes[node.first_child].prev_sibling = node.prev_sibling;
+        if (node.prev_sibling != none)
+            nodes[node.prev_sibling].next_sibling = node.first_child;
+        else
+            parent.first_child = node.first_child;
+        nodes[node.last_child].next_sibling = node.next_sibling;
+        if (node.next_sibling != none)
+            nodes[node.next_sibling].prev_sibling = node.last_child;
+        else
+            parent.last_child = node.last_child;
+        node.parent = node.prev_sibling = node.next_sibling = none;
+        node.first_child = node.last_child = none;
+    }
+
+    // Keep only the middle one of id's three children, e.g. the expression
+    // in ( expression ), in place of id.
+    void use_middle(uint32_t id)
+    {
+        assert(child_count(id) == 3);
+        remove(nodes[id].first_child);
+        remove(nodes[id].last_child);
+        skip(id);
+    }
+
+    void remove_terminals(uint32_t id)
+    {
+        for (uint32_t c = nodes[id].first_child; c != none;) {
+            const uint32_t next = nodes[c].next_sibling;
+            if (nodes[c].first_child == none)
+                remove(c);
+            c = next;
+        }
+    }
+
+    // Call f(id, depth) for every node under from, parents before children.
+    template <typename F>
+    void preorder(F f, uint32_t from = 0) const
+    {
+        uint32_t id = from, depth = 0;
+        while (true) {
+            f(id, depth);
+            if (nodes[id].first_child != none) {
+                id = nodes[id].first_child;
+                ++depth;
+                continue;
+            }
+            while (id != from && nodes[id].next_sibling == none) {
+                id = nodes[id].parent;
+                --depth;
+            }
+            if (id == from)
+                return;
+            id = nodes[id].next_sibling;
+        }
+    }
+
+    // Drop the removed nodes and renumber the rest in depth first order.
+    void compact()
+    {
+        std::vector<Node> old;
+        old.swap(nodes);
+        std::vector<uint32_t> parents(1, uint32_t(none));
+        uint32_t id = 0;
+        while (true) {
+            const Node &node = old[id];
+            const uint32_t parent = parents.back();
+            uint32_t added;
+            if (parent == none) {
+                Node root = {node.kind, node.begin, node.end, none, none, none, none, none};
+                nodes.push_back(root);
+                added = 0;
+            } else {
+                added = add(parent, node.kind, node.begin, node.end);
+            }
+            if (node.first_child != none) {
+                parents.push_back(added);
+                id = node.first_child;
+                continue;
+            }
+            while (id != 0 && old[id].next_sibling == none) {
+                id = old[id].parent;
+                parents.pop_back();
+            }
+            if (id == 0)
+                return;
+            id = old[id].next_sibling;
+        }
+    }
+};
+
+// The symbol of the identifier that is all a node covers, from a stream
+// lexed with a vemalex::SymbolTable, or SymbolTable::none. Two nodes name
+// the same identifier when their symbols are equal and not none.
+template <typename Iterator>
+uint32_t symbol(const vemalex::TokenStream<Iterator> &tokens, const Tree::Node &node)
+{
+    typename vemalex::TokenStream<Iterator>::iterator iter(&tokens, node.begin, true);
+    if (iter.position() >= node.end)
+        return vemalex::SymbolTable::none;
+    const uint32_t ret = iter.symbol();
+    ++iter;
+    return iter.position() >= node.end ? ret : uint32_t(vemalex::SymbolTable::none);
+}
+
+// Builds a Tree from an event log (see vemaparse::replay), calling leave
+// like Tree::append does.
+template <typename Leave>
+struct TreeBuilder
+{
+    Tree &tree;
+    Leave on_leave;
+    std::vector<uint32_t> stack;
+
+    TreeBuilder(Tree &tree_, Leave on_leave_, uint32_t parent = 0) : tree(tree_), on_leave(on_leave_), stack(1, parent) { }
+
+    void enter(const vemaparse::Event &e)
+    {
+        stack.push_back(tree.add(stack.back(), e.rule, e.begin, e.end));
+    }
+
+    void leave(const vemaparse::Event &)
+    {
+        const uint32_t id = stack.back();
+        stack.pop_back();
+        on_leave(tree, id);
+    }
+
+    void token(const vemaparse::Event &e)
+    {
+        enter(e);
+        leave(e);
+    }
+};
+
+namespace detail
+{
+    // Decimal or hex digits without a sign or prefix. False if there are
+    // none, on any other character and on overflow.
+    template <typename InputIt>
+    bool parse_unsigned(InputIt begin, InputIt end, unsigned base, uint64_t &value)
+    {
+        if (begin == end)
+            return false;
+        uint64_t ret = 0;
+        for (; begin != end; ++begin) {
+            const char c = *begin;
+            unsigned digit;
+            if (c >= '0' && c <= '9')
+                digit = unsigned(c - '0');
+            else if (base == 16 && c >= 'a' && c <= 'f')
+                digit = unsigned(c - 'a' + 10);
+            else if (base == 16 && c >= 'A' && c <= 'F')
+                digit = unsigned(c - 'A' + 10);
+            else
+                return false;
+            if (ret > (~uint64_t(0) - digit) / base)
+                return false;
+            ret = ret * base + digit;
+        }
+        value = ret;
+        return true;
+    }
+
+    // strtod wants a terminated string; short numbers are copied to the
+    // stack instead of a std::string.
+    template <typename InputIt>
+    bool parse_double(InputIt begin, InputIt end, double &value)
+    {
+        char buffer[64];
+        std::string long_text;
+        const std::size_t n = std::size_t(std::distance(begin, end));
+        const char *text = buffer;
+        if (n < sizeof(buffer)) {
+            std::copy(begin, end, buffer);
+            buffer[n] = '\0';
+        } else {
+            long_text.assign(begin, end);
+            text = long_text.c_str();
+        }
+        char *stop;
+        value = std::strtod(text, &stop);
+        return n && stop == text + n;
+    }
+}
+
+// Numbers starting with 0x are hex, ones with a '.' floating point and the
+// rest decimal. False if text isn't entirely a number.
+template <typename InputIt, typename T>
+inline bool to_number(InputIt begin, InputIt end, T &value)
+{
+    if (begin == end)
+        return false;
+    InputIt second = begin;
+    ++second;
+    if (*begin == '0' && second != end && *second == 'x' && std::distance(second, end) > 1) {
+        uint64_t tmp;
+        if (!detail::parse_unsigned(++second, end, 16, tmp))
+            return false;
+        value = T(tmp);
+    } else if (std::find(begin, end, '.') != end) {
+        double tmp;
+        if (!detail::parse_double(begin, end, tmp))
+            return false;
+        value = T(tmp);
+    } else {
+        uint64_t tmp;
+        if (!detail::parse_unsigned(begin, end, 10, tmp))
+            return false;
+        value = T(tmp);
+    }
+    return true;
+}
+
+template <typename T>
+inline bool to_number(const std::string &text, T &value)
+{
+    return to_number(text.begin(), text.end(), value);
+}
+
+template <typename Iterator, typename T>
+inline bool to_number(const vemalex::TokenView<Iterator> &text, T &value)
+{
+    return to_number(text.begin(), text.end(), value);
+}
+
+// Decode the text of a string literal into out, reusing its storage.
+// Unescaped quotes are dropped and \" \' \\ \n \r \t and \0 are
+// decoded; other escapes are kept as they are.
+template <typename InputIt>
+void unescape(InputIt begin, InputIt end, std::string &out)
+{
+    out.clear();
+    for (; begin != end; ++begin) {
+        char c = *begin;
+        if (c == '"')
+            continue;
+        if (c == '\\') {
+            InputIt next = begin;
+            if (++next != end) {
+                begin = next;
+                c = *next;
+                switch (c) {
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case '0': c = '\0'; break;
+                case '"':
+                case '\'':
+                case '\\':
+                    break;
+                default:
+                    out += '\\';
+                    break;
+                }
+            }
+        }
+        out += c;
+    }
+}
+
+// buffer holds the decoded text of a string literal, so it can be reused
+// across calls.
+template <typename Node>
+static void literal(vemalex::Token token_type, Node &node, std::string &buffer)
+{
+    switch (token_type) {
+    case vemalex::IDENTIFIER:
+        node.value = decltype(node.value)(node.text);
+        node.name = "identifier";
+        break;
+
+    case vemalex::NUMBER_LITERAL:
+        node.name = "number";
+        ::ast::to_number(node.text, node.value);
+        break;
+
+    case vemalex::STRING_LITERAL:
+    {
+        node.name = "string";
+        unescape(node.text.begin(), node.text.end(), buffer);
+        node.value = decltype(node.value)(buffer);
+        node.children.clear();
+        break;
+    }
+
+    default:
+        std::cerr << "ERROR: unkown literal type\n";
+        ::exit(1);
+        break;
+    }
+    assert(!node.children.size());
+}
+
+template <typename Node>
+static void literal(vemalex::Token token_type, Node &node)
+{
+    std::string buffer;
+    literal(token_type, node, buffer);
+}
+
+// The name of a C operator, or NULL if op isn't one. The operators are at
+// most two characters, which hash to distinct slots of a table.
+template <typename Text>
+const char *op_name(const Text &op)
+{
+    struct Entry
+    {
+        const char *op, *name;
+    };
+    static const Entry table[35] = {
+        {NULL, NULL}, {"&&", "logical_and"}, {"%", "mod"}, {"&", "bin_and"},
+        {"!=", "not equals"}, {NULL, NULL}, {NULL, NULL}, {"*", "mul"},
+        {"+", "plus"}, {">>", "right shift"}, {"-", "minus"}, {NULL, NULL},
+        {"/", "div"}, {NULL, NULL}, {NULL, NULL}, {"--", "unary_minus"},
+        {NULL, NULL}, {NULL, NULL}, {"||", "logical_or"}, {"|", "bin_or"},
+        {"<<", "left shift"}, {NULL, NULL}, {NULL, NULL}, {NULL, NULL},
+        {NULL, NULL}, {"<", "less than"}, {"++", "unary_plus"}, {">", "greater than"},
+        {NULL, NULL}, {NULL, NULL}, {NULL, NULL}, {"<=", "lte"},
+        {"==", "equals"}, {">=", "gte"}, {NULL, NULL}
+    };
+    auto iter = op.begin();
+    const auto n = std::distance(iter, op.end());
+    if (n < 1 || n > 2)
+        return NULL;
+    const unsigned char c0 = static_cast<unsigned char>(*iter);
+    const unsigned char c1 = n == 2 ? static_cast<unsigned char>(*++iter) : 0;
+    const Entry &e = table[(c0 + 11u * c1) % 35];
+    if (!e.op || static_cast<unsigned char>(e.op[0]) != c0 || static_cast<unsigned char>(e.op[1]) != c1)
+        return NULL;
+    return e.name;
+}
+
+inline std::string op_to_name(const std::string &op)
+{
+    const char *name = op_name(op);
+    return name ? std::string(name) : "I DONT KNOW " + op;
+}
+
+template <typename Iterator>
+std::string op_to_name(const vemalex::TokenView<Iterator> &op)
+{
+    const char *name = op_name(op);
+    return name ? std::string(name) : "I DONT KNOW " + op.str();
+}
+
+}
+
+#endif
@@ -0,0 +1,177 @@
+
+#ifndef VEMAPARSE_BATCH_H_
+#define VEMAPARSE_BATCH_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "lexer.h"
+#include "source.h"
+#include "parser.h"
+
+namespace vemaparse
+{
+
+// How parsing one file of a batch went.
+struct BatchResult
+{
+    enum Status
+    {
+        PARSED,
+        FAILED,         // the start rule didn't match all of it
+        LEXER_ERROR,
+        READ_ERROR
+    };
+
+    std::string path;
+    Status status;
+    // The exception's message for the errors.
+    std::string error;
+    // For FAILED, where the parse got farthest (ParseContext::farthest_failure)
+    // and the token rules that failed there.
+    std::size_t line, column;
+    std::vector<uint32_t> expected;
+    std::size_t bytes;
+    uint32_t tokens;
+    double seconds;
+};
+
+// Parses many files on a pool of threads with one grammar, each thread
+// with a context of its own that is reset for every file. Threads take the
+// next file as soon as they are done with one, and the files are handed
+// out largest first, so a big file doesn't start last and hold up the
+// end of the batch.
+//
+//   vemaparse::BatchParser<Node> batch(grammar);
+//   batch.on_parse = [](const BatchResult &result, const TokenStream &tokens, const Match &tree) { ... };
+//   std::vector<vemaparse::BatchResult> results = batch.parse(paths);
+template <typename ActionType>
+class BatchParser
+{
+public:
+    typedef vemalex::Lexer<const char *> lexer_type;
+    typedef vemalex::TokenStream<const char *> stream_type;
+    typedef typename stream_type::iterator iterator;
+    typedef Grammar<iterator, ActionType> grammar_type;
+    typedef ParseContext<iterator, ActionType> context_type;
+    typedef Match<iterator, ActionType> match_type;
+
+private:
+    const grammar_type &grammar;
+    unsigned threads;
+    std::vector<std::unique_ptr<context_type>> contexts;
+
+    void parse_file(context_type &ctx, BatchResult &result) const
+    {
+        typedef std::chrono::steady_clock clock;
+        const clock::time_point begin = clock::now();
+        result.status = BatchResult::PARSED;
+        result.error.clear();
+        result.line = result.column = 0;
+        result.expected.clear();
+        result.bytes = 0;
+        result.tokens = 0;
+        try {
+            const vemalex::MappedSource input(result.path);
+            result.bytes = input.size();
+            const stream_type tokens((lexer_type(input.begin(), input.end())));
+            result.tokens = tokens.size();
+            ctx.reset(tokens.size() + 1);
+            const match_type &match = *grammar.start()->get_match(ctx, tokens.begin(), tokens.end());
+            if (!match.matched || match.end != tokens.end()) {
+                const std::size_t offset = ctx.farthest_failure < tokens.size()
+                                         ? tokens.offset(uint32_t(ctx.farthest_failure)) : input.size();
+                const vemalex::LineIndex<const char *> lines(input.begin(), input.end());
+                result.status = BatchResult::FAILED;
+                result.line = lines.line(offset);
+                result.column = lines.column(offset);
+                result.expected = ctx.expected;
+            }
+            if (on_parse)
+                on_parse(result, tokens, match);
+        } catch (const vemalex::SourceError &error) {
+            result.status = BatchResult::READ_ERROR;
+            result.error = error.what();
+        } catch (const vemalex::LexerError &error) {
+            result.status = BatchResult::LEXER_ERROR;
+            result.error = error.what();
+        }
+        result.seconds = std::chrono::duration<double>(clock::now() - begin).count();
+    }
+
+public:
+    // Called on the worker thread with every file that was lexed, whether
+    // it parsed or not, before the context is reset for the next one.
+    std::function<void(const BatchResult &, const stream_type &, const match_type &)> on_parse;
+    // Looking up the sizes to sort by costs a stat per file.
+    bool largest_first;
+
+    BatchParser(const grammar_type &grammar_, unsigned threads_ = 0)
+        : grammar(grammar_), threads(threads_ ? threads_ : std::max(std::thread::hardware_concurrency(), 1u)),
+          largest_first(true)
+    {
+        for (unsigned i = 0; i < threads; ++i)
+            contexts.push_back(std::unique_ptr<context_type>(new context_type(grammar)));
+    }
+
+    unsigned thread_count() const
+    {
+        return threads;
+    }
+
+    // One result per path, in the same order. Exceptions from on_parse
+    // stop the batch and are passed on.
+    std::vector<BatchResult> parse(const std::vector<std::string> &paths)
+    {
+        std::vector<BatchResult> results(paths.size());
+        std::vector<std::pair<std::size_t, std::size_t>> order;
+        for (std::size_t i = 0; i < paths.size(); ++i) {
+            results[i].path = paths[i];
+            std::size_t size = 0;
+            if (largest_first)
+                vemalex::file_size(paths[i], size);
+            order.push_back(std::make_pair(size, i));
+        }
+        if (largest_first)
+            std::stable_sort(order.begin(), order.end(),
+                             [](const std::pair<std::size_t, std::size_t> &a, const std::pair<std::size_t, std::size_t> &b) {
+                                 return a.first > b.first;
+                             });
+
+        std::vector<std::exception_ptr> errors(threads);
+        std::atomic<std::size_t> next(0);
+        auto work = [&](unsigned worker) {
+            context_type &ctx = *contexts[worker];
+            try {
+                for (std::size_t i = next++; i < order.size(); i = next++)
+                    parse_file(ctx, results[order[i].second]);
+            } catch (...) {
+                errors[worker] = std::current_exception();
+                next = order.size();
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads && i < order.size(); ++i)
+            pool.push_back(std::thread(work, i));
+        work(0);
+        for (auto iter = pool.begin(); iter != pool.end(); ++iter)
+            iter->join();
+        for (auto iter = errors.begin(); iter != errors.end(); ++iter)
+            if (*iter)
+                std::rethrow_exception(*iter);
+        return results;
+    }
+};
+
+}
+
+#endif
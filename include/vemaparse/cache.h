@@ -0,0 +1,349 @@
+
+#ifndef VEMAPARSE_CACHE_H_
+#define VEMAPARSE_CACHE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+
+#include "lexer.h"
+#include "source.h"
+#include "parser.h"
+#include "ast.h"
+#include "serialize.h"
+
+namespace vemaparse
+{
+
+// 64 bit MurmurHash2 (MurmurHash64A), 8 bytes at a time.
+inline uint64_t hash64(const void *data, std::size_t size, uint64_t seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t h = seed ^ (uint64_t(size) * m);
+    for (const unsigned char *end = p + (size & ~std::size_t(7)); p != end; p += 8) {
+        uint64_t k;
+        std::memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (size & 7) {
+        for (std::size_t i = size & 7; i-- > 0;)
+            h ^= uint64_t(p[i]) << (8 * i);
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// Hash of everything about the grammar's rules that matching and the
+// stored trees depend on: their kinds, names, tokens, literal and regex
+// text and how they are connected. Custom match functions and checks
+// can't be looked into, so bump salt when one of those changes.
+template <typename Iterator, typename ActionType>
+uint64_t fingerprint(const Grammar<Iterator, ActionType> &grammar, uint64_t salt = 0)
+{
+    std::string description;
+    for (uint32_t id = 0; id < grammar.size(); ++id) {
+        const Rule<Iterator, ActionType> &rule = *grammar.rule(id).operator ->();
+        uint32_t fields[] = {uint32_t(rule.kind), uint32_t(rule.must_consume_token), uint32_t(bool(rule.check)),
+                             uint32_t(rule.token), uint32_t(rule.name.size()), uint32_t(rule.text.size()),
+                             uint32_t(rule.children.size())};
+        description.append(reinterpret_cast<const char *>(fields), sizeof(fields));
+        description += rule.name;
+        description += rule.text;
+        for (auto iter = rule.children.begin(); iter != rule.children.end(); ++iter) {
+            const uint32_t child = (*iter)->id;
+            description.append(reinterpret_cast<const char *>(&child), sizeof(child));
+        }
+    }
+    return hash64(description.data(), description.size(), salt);
+}
+
+// A cache entry: a CacheHeader, the token kinds, offsets and lengths (each
+// array padded to 8 bytes), then the parse tree in the ast::write_binary
+// format: the start rule's match and everything under it that covers any
+// tokens, as Tree::append adds them, below a root without a kind.
+// Integers are in the writer's byte order.
+struct CacheHeader
+{
+    static const uint32_t current_version = 1;
+
+    char magic[4];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t lexer_options;
+    uint64_t input_size;
+    uint64_t input_hash[2];
+    uint64_t grammar;
+    uint32_t tokens;
+    // Token position where the start rule's match ended, and whether it
+    // matched.
+    uint32_t end;
+    uint32_t matched;
+    uint32_t padding;
+    uint64_t tree_size;
+};
+
+// The tokens and parse tree of one input, read from a ParseCache or made
+// by lexing and parsing it. On a hit the tree is read in place from the
+// mapped cache file.
+class CachedParse
+{
+    template <typename> friend class ParseCache;
+
+    vemalex::MappedSource file;
+    std::string buffer;
+    std::size_t tree_offset, tree_size;
+
+public:
+    typedef vemalex::TokenStream<const char *> stream_type;
+
+    stream_type tokens;
+    // Whether the cache had it.
+    bool hit;
+    // Whether the start rule matched, and the token position where its
+    // match ended.
+    bool matched;
+    uint32_t end;
+
+    CachedParse() : tree_offset(0), tree_size(0), hit(false), matched(false), end(0) { }
+
+    ast::BinaryTree tree() const
+    {
+        const char *data = (hit ? file.begin() : buffer.data()) + tree_offset;
+        return ast::BinaryTree(data, data + tree_size);
+    }
+};
+
+// Keeps the tokens and parse trees of inputs in files in directory, named
+// after a hash of the input, the grammar's fingerprint and the lexer
+// settings, so unchanged inputs aren't lexed and parsed again. All of the
+// key is checked again on loading, so an entry is only used for the input,
+// grammar and settings it was made for, and the tokens and tree are checked
+// against the input; anything else is a miss, and the new result is stored
+// over it. Entries are written to a temporary file
+// and renamed into place, so readers never see half an entry. The
+// directory must exist, and nothing is ever removed from it.
+//
+//   vemaparse::ParseCache<Node> cache(".vemacache", grammar);
+//   vemaparse::CachedParse parse;
+//   cache.parse(Lexer(source.begin(), source.end()), parse);
+//   ast::BinaryTree tree = parse.tree();
+template <typename ActionType>
+class ParseCache
+{
+public:
+    typedef vemalex::Lexer<const char *> lexer_type;
+    typedef vemalex::TokenStream<const char *> stream_type;
+    typedef Grammar<typename stream_type::iterator, ActionType> grammar_type;
+
+private:
+    std::string directory;
+    const grammar_type &grammar;
+    uint64_t grammar_hash;
+
+    static void pad(ast::Writer &out, uint64_t size)
+    {
+        for (; size % 8; ++size)
+            out.put('\0');
+    }
+
+    static uint64_t padded(uint64_t size)
+    {
+        return (size + 7) & ~uint64_t(7);
+    }
+
+    static std::string hex(uint64_t value)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string ret;
+        for (int shift = 60; shift >= 0; shift -= 4)
+            ret += digits[(value >> shift) & 0xf];
+        return ret;
+    }
+
+    std::string path(const CacheHeader &key) const
+    {
+        const uint64_t settings = hash64(&key.grammar, sizeof(key.grammar), key.lexer_options);
+        return directory + "/" + hex(key.input_hash[0]) + hex(settings) + ".vpc";
+    }
+
+    CacheHeader make_key(const lexer_type &lexer) const
+    {
+        const char *begin = lexer.input_begin();
+        const std::size_t size = std::size_t(lexer.input_end() - begin);
+        CacheHeader key;
+        std::memset(&key, 0, sizeof(key));
+        std::memcpy(key.magic, "VPC1", 4);
+        key.byte_order = 0x01020304;
+        key.version = CacheHeader::current_version;
+        key.lexer_options = lexer.options();
+        key.input_size = size;
+        key.input_hash[0] = hash64(begin, size, 0);
+        key.input_hash[1] = hash64(begin, size, 0x9e3779b97f4a7c15ull);
+        key.grammar = grammar_hash;
+        return key;
+    }
+
+    static bool load(const std::string &file_path, const CacheHeader &key, const lexer_type &lexer, CachedParse &out)
+    {
+        vemalex::MappedSource file;
+        try {
+            file = vemalex::MappedSource(file_path);
+        } catch (const vemalex::SourceError &) {
+            return false;
+        }
+        if (file.size() < sizeof(CacheHeader))
+            return false;
+        const CacheHeader &header = *reinterpret_cast<const CacheHeader *>(file.begin());
+        if (std::memcmp(header.magic, key.magic, 4) || header.byte_order != key.byte_order ||
+            header.version != key.version || header.lexer_options != key.lexer_options ||
+            header.input_size != key.input_size || header.input_hash[0] != key.input_hash[0] ||
+            header.input_hash[1] != key.input_hash[1] || header.grammar != key.grammar)
+            return false;
+        const uint64_t n = header.tokens;
+        const uint64_t tree_offset = sizeof(CacheHeader) + padded(n) + n * 8 + padded(n * 4);
+        if (tree_offset + header.tree_size != file.size())
+            return false;
+        if (header.end > n || header.matched > 1)
+            return false;
+
+        // The key only says which input the entry is for, so check that the
+        // tokens and tree fit that input before anything trusts them.
+        const char *p = file.begin() + sizeof(CacheHeader);
+        const uint8_t *kinds = reinterpret_cast<const uint8_t *>(p);
+        const uint64_t *offsets = reinterpret_cast<const uint64_t *>(p + padded(n));
+        const uint32_t *lengths = reinterpret_cast<const uint32_t *>(p + padded(n) + n * 8);
+        for (uint64_t i = 0, last = 0; i < n; last = offsets[i++])
+            if (kinds[i] >= vemalex::NUM_TOKENS || offsets[i] < last || offsets[i] > header.input_size ||
+                lengths[i] > header.input_size - offsets[i])
+                return false;
+        try {
+            ast::BinaryTree tree(file.begin() + tree_offset, file.end());
+            for (uint32_t id = 0; id < tree.size(); ++id)
+                if (tree[id].begin > tree[id].end || tree[id].end > n)
+                    return false;
+        } catch (const ast::FormatError &) {
+            return false;
+        }
+
+        out.tokens = stream_type(lexer, kinds, offsets, lengths, header.tokens);
+        out.hit = true;
+        out.matched = header.matched != 0;
+        out.end = header.end;
+        out.tree_offset = std::size_t(tree_offset);
+        out.tree_size = std::size_t(header.tree_size);
+        out.buffer.clear();
+        out.file = std::move(file);
+        return true;
+    }
+
+    static void store(const std::string &file_path, const CacheHeader &header, const stream_type &tokens,
+                      const std::string &tree)
+    {
+        static std::atomic<uint64_t> counter(0);
+        const uint64_t unique[] = {counter++, uint64_t(std::chrono::steady_clock::now().time_since_epoch().count()),
+                                   uint64_t(reinterpret_cast<uintptr_t>(&tokens))};
+        const std::string tmp = file_path + "." + hex(hash64(unique, sizeof(unique), 0)) + ".tmp";
+        {
+            std::ofstream ofs(tmp.c_str(), std::ios::binary | std::ios::trunc);
+            if (!ofs)
+                return;
+            ast::Writer out(ofs);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            for (uint32_t i = 0; i < tokens.size(); ++i)
+                out.put(char(tokens.kind(i)));
+            pad(out, tokens.size());
+            for (uint32_t i = 0; i < tokens.size(); ++i) {
+                const uint64_t offset = tokens.offset(i);
+                out.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+            }
+            for (uint32_t i = 0; i < tokens.size(); ++i) {
+                const uint32_t length = uint32_t(tokens.length(i));
+                out.write(reinterpret_cast<const char *>(&length), sizeof(length));
+            }
+            pad(out, uint64_t(tokens.size()) * 4);
+            out.write(tree);
+            out.flush();
+            if (!ofs.flush()) {
+                ofs.close();
+                std::remove(tmp.c_str());
+                return;
+            }
+        }
+        // std::rename won't replace an existing file on Windows. Replacing
+        // still fails there while a reader has the old entry mapped, which
+        // is then kept.
+#if defined(_WIN32)
+        if (!::MoveFileExA(tmp.c_str(), file_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+        if (std::rename(tmp.c_str(), file_path.c_str()))
+#endif
+            std::remove(tmp.c_str());
+    }
+
+public:
+    ParseCache(const std::string &directory_, const grammar_type &grammar_, uint64_t salt = 0)
+        : directory(directory_), grammar(grammar_), grammar_hash(fingerprint(grammar_, salt)) { }
+
+    // The file lexer's input is kept in.
+    std::string entry(const lexer_type &lexer) const
+    {
+        return path(make_key(lexer));
+    }
+
+    // Fill out with the tokens and parse tree of lexer's input: from the
+    // cache if it has them, otherwise by lexing the input and matching the
+    // grammar's start rule, and then storing the result. Lexer errors are
+    // passed on, and nothing is stored for them.
+    void parse(const lexer_type &lexer, CachedParse &out) const
+    {
+        const CacheHeader key = make_key(lexer);
+        const std::string file_path = path(key);
+        if (load(file_path, key, lexer, out))
+            return;
+
+        out.tokens = stream_type(lexer);
+        ParseContext<typename stream_type::iterator, ActionType> ctx(grammar, out.tokens.size() + 1);
+        const Match<typename stream_type::iterator, ActionType> &match =
+            *grammar.start()->get_match(ctx, out.tokens.begin(), out.tokens.end());
+        ast::Tree tree;
+        tree.append(tree.root(), match, [](ast::Tree &, uint32_t) { });
+        std::ostringstream ss;
+        {
+            ast::Writer writer(ss);
+            ast::write_binary(writer, tree, [this](uint32_t kind) -> const std::string & {return grammar.name(kind);});
+        }
+
+        CacheHeader header = key;
+        header.tokens = out.tokens.size();
+        header.end = uint32_t(match.end.position());
+        header.matched = match.matched;
+        out.buffer = ss.str();
+        header.tree_size = out.buffer.size();
+        store(file_path, header, out.tokens, out.buffer);
+
+        out.file = vemalex::MappedSource();
+        out.hit = false;
+        out.matched = match.matched;
+        out.end = header.end;
+        out.tree_offset = 0;
+        out.tree_size = out.buffer.size();
+    }
+};
+
+}
+
+#endif
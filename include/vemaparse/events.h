@@ -0,0 +1,158 @@
+
+#ifndef VEMAPARSE_EVENTS_H_
+#define VEMAPARSE_EVENTS_H_
+
+#include <vector>
+#include <stdint.h>
+
+namespace vemaparse
+{
+
+// One step of a walk over a parse tree. Every successful match that covers
+// at least one token is an ENTER and a LEAVE around the events of its
+// children, or a single TOKEN if it has none. begin and end are the
+// match's token positions (Iterator::position()) in all three.
+struct Event
+{
+    enum Type
+    {
+        ENTER,
+        LEAVE,
+        TOKEN
+    };
+
+    uint8_t type;
+    uint32_t rule;
+    uint32_t begin, end;
+};
+
+// A flat log of the events of parse trees, a few bytes per match instead
+// of a Match record and its child pointers. With ParseContext::events set,
+// get_match, Program and fixed::get_match log every match as they make it
+// and take the events back when it or a caller fails, so at the end the
+// log holds the tree of the start rule's match. Turn off
+// MatchArena::keep_children to not build that tree as well:
+//
+//   vemaparse::EventLog log;
+//   ctx.events = &log;
+//   ctx.arena.keep_children = false;
+//   start->get_match(ctx, tokens.begin(), tokens.end());
+//   vemaparse::replay(log, handler);
+//
+// Subtrees completed by a cut() are never taken back, and are released
+// from the arena as with on_commit.
+class EventLog
+{
+    std::vector<Event> events;
+
+    template <typename M>
+    void add(uint8_t type, const M &m)
+    {
+        Event e = {type, m.rule, uint32_t(m.begin.position()), uint32_t(m.end.position())};
+        events.push_back(e);
+    }
+
+public:
+    typedef std::vector<Event>::const_iterator const_iterator;
+
+    // Log m's successful matches, skipping failed alternatives and empty
+    // matches like visit_match does. This is what matching with events on
+    // logs for m.
+    template <typename M>
+    void append(const M &m)
+    {
+        if (!m.matched || m.end == m.begin)
+            return;
+        if (m.children.empty()) {
+            add(Event::TOKEN, m);
+            return;
+        }
+        add(Event::ENTER, m);
+        for (auto iter = m.children.begin(); iter != m.children.end(); ++iter)
+            append(**iter);
+        add(Event::LEAVE, m);
+    }
+
+    std::size_t mark() const
+    {
+        return events.size();
+    }
+
+    // An ENTER for a match of rule starting at begin, before its end is
+    // known. Returns where it is for close().
+    std::size_t open(uint32_t rule, uint32_t begin)
+    {
+        Event e = {Event::ENTER, rule, begin, begin};
+        events.push_back(e);
+        return events.size() - 1;
+    }
+
+    // End the match opened at: a TOKEN if nothing was logged since, else
+    // the ENTER and a LEAVE after its children.
+    void close(std::size_t at, uint32_t end)
+    {
+        Event &e = events[at];
+        e.end = end;
+        if (at + 1 == events.size()) {
+            e.type = Event::TOKEN;
+            return;
+        }
+        const Event leave = {Event::LEAVE, e.rule, e.begin, end};
+        events.push_back(leave);
+    }
+
+    // Log count events again, from first in this log.
+    void repeat(std::size_t first, std::size_t count)
+    {
+        events.reserve(events.size() + count);
+        for (std::size_t i = 0; i < count; ++i)
+            events.push_back(events[first + i]);
+    }
+
+    void append(const Event *first, const Event *last)
+    {
+        events.insert(events.end(), first, last);
+    }
+
+    // Drop everything appended since mark.
+    void truncate(std::size_t mark)
+    {
+        events.resize(mark);
+    }
+
+    void clear()
+    {
+        events.clear();
+    }
+
+    const_iterator begin() const {return events.begin();}
+    const_iterator end() const {return events.end();}
+    std::size_t size() const {return events.size();}
+    bool empty() const {return events.empty();}
+    const Event &operator [](std::size_t i) const {return events[i];}
+};
+
+// Hand the log to handler in order: handler.enter(e) and handler.leave(e)
+// around each match's children and handler.token(e) for a match without
+// any, so e.g. actions can run on leave() without a tree in memory.
+template <typename Handler>
+void replay(const EventLog &log, Handler &handler)
+{
+    for (auto iter = log.begin(); iter != log.end(); ++iter) {
+        switch (iter->type) {
+        case Event::ENTER:
+            handler.enter(*iter);
+            break;
+        case Event::LEAVE:
+            handler.leave(*iter);
+            break;
+        default:
+            handler.token(*iter);
+            break;
+        }
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,819 @@
+
+#ifndef VEMAPARSE_FIXED_H_
+#define VEMAPARSE_FIXED_H_
+
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "lexer.h"
+#include "parser.h"
+
+namespace vemaparse
+{
+
+// Grammars fixed at compile time. Every rule is a type, so a whole parser
+// inlines into plain function calls: no std::function, no shared_ptr and no
+// rule graph at run time. Matches come out exactly as the dynamic
+// combinators build them, each with the id of its rule, and are memoized in
+// an ordinary ParseContext:
+//
+//   using namespace vemaparse::fixed;
+//   struct expression;
+//   struct group : rule<group, seq<lit<'('>, seq<expression, lit<')'>>>> { };
+//   struct expression : rule<expression, decltype(group() | token<vemalex::IDENTIFIER>())>
+//   {
+//       static const char *name() {return "expression";}
+//       static void action(Node &node) { ... }
+//   };
+//
+//   vemaparse::fixed::Grammar<expression, TokenStream::iterator, Node> grammar;
+//   ParseContext ctx(grammar);
+//   Match *tree = grammar.match(ctx, tokens.begin(), tokens.end());
+//
+// >>, |, *, /, -, + and ! work as they do on RuleWrapper. Recursive rules
+// have to be named by deriving from rule<>, which can also give a name, an
+// action and a check. There is no newline or cut; predicate<> stands in for
+// regex.
+namespace fixed
+{
+
+// Base of every rule type, so the operators only apply to them.
+template <typename Self>
+struct expr
+{
+};
+
+// Each rule type R has, for a Grammar G:
+//   R::visit<G>(table)   visits the children with G::visit
+//   R::summarize<G>(s)   its RuleSummary, apart from must_consume_token
+//   R::rule_name<G>()    the name of its matches
+//   R::consumes<G>()     Rule::must_consume_token
+//   R::match<G>(...)     what Rule::match does
+template <typename G, typename R>
+typename G::rule_result get_match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos);
+
+namespace detail
+{
+    template <typename T>
+    struct void_type
+    {
+        typedef void type;
+    };
+
+    template <typename R, typename = void>
+    struct has_name : std::false_type { };
+    template <typename R>
+    struct has_name<R, typename void_type<decltype(R::name())>::type> : std::true_type { };
+
+    template <typename R, typename ActionType, typename = void>
+    struct has_action : std::false_type { };
+    template <typename R, typename ActionType>
+    struct has_action<R, ActionType, typename void_type<decltype(R::action(std::declval<ActionType &>()))>::type>
+        : std::true_type { };
+
+    template <typename R, typename M, typename = void>
+    struct has_check : std::false_type { };
+    template <typename R, typename M>
+    struct has_check<R, M, typename void_type<decltype(R::check(std::declval<const M &>()))>::type>
+        : std::true_type { };
+
+    template <typename R>
+    std::string name_of(const std::string &, std::true_type)
+    {
+        return R::name();
+    }
+
+    template <typename R>
+    std::string name_of(const std::string &fallback, std::false_type)
+    {
+        return fallback;
+    }
+
+    template <typename R, typename ActionType>
+    std::function<void(ActionType &)> action_of(std::true_type)
+    {
+        return &R::action;
+    }
+
+    template <typename R, typename ActionType>
+    std::function<void(ActionType &)> action_of(std::false_type)
+    {
+        return std::function<void(ActionType &)>();
+    }
+
+    template <typename R, typename M>
+    bool check(const M &m, std::true_type)
+    {
+        return R::check(m);
+    }
+
+    template <typename R, typename M>
+    bool check(const M &, std::false_type)
+    {
+        return true;
+    }
+
+    // A rule matching one token.
+    struct leaf
+    {
+        template <typename G>
+        static void visit(typename G::Table &)
+        {
+        }
+
+        template <typename G>
+        static bool consumes()
+        {
+            return true;
+        }
+    };
+}
+
+// Matches a token of kind Token.
+template <int Token>
+struct token : expr<token<Token>>, detail::leaf
+{
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "terminal";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::TERMINAL;
+        summary.token = Token;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator)
+    {
+        const bool matched = token_pos.token == Token;
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    }
+};
+
+// Matches a token whose text is exactly Text, e.g. lit<'i', 'f'>.
+template <char... Text>
+struct lit : expr<lit<Text...>>, detail::leaf
+{
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "literal";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        static const char text[] = {Text...};
+        summary.kind = RuleKind::LITERAL;
+        summary.text.assign(text, sizeof...(Text));
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator)
+    {
+        static const char text[] = {Text...};
+        const bool matched = (*token_pos).equals(text, sizeof...(Text));
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    }
+};
+
+// Matches a token for which Predicate()(text) is true, text being the
+// TokenView of the token.
+template <typename Predicate>
+struct predicate : expr<predicate<Predicate>>, detail::leaf
+{
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "predicate";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::CUSTOM;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator)
+    {
+        const bool matched = Predicate()(*token_pos);
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    }
+};
+
+// Ordering A >> B
+template <typename A, typename B>
+struct seq : expr<seq<A, B>>
+{
+    template <typename G>
+    static void visit(typename G::Table &table)
+    {
+        G::template visit<A>(table);
+        G::template visit<B>(table);
+    }
+
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "order";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::SEQUENCE;
+        summary.children.push_back(G::template slot<A>::id);
+        summary.children.push_back(G::template slot<B>::id);
+    }
+
+    template <typename G>
+    static bool consumes()
+    {
+        return G::template slot<A>::must_consume_token || G::template slot<B>::must_consume_token;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+    {
+        typename G::builder_type ret(ctx, eos);
+        typename G::rule_result tmp = get_match<G, A>(ctx, token_pos, eos);
+        propagate_child_info(ret, tmp);
+        if (tmp->matched) {
+            tmp = get_match<G, B>(ctx, tmp->end, eos);
+            propagate_child_info(ret, tmp);
+            if (!tmp->matched)
+                ret.end = token_pos;
+        }
+        return ret.finish();
+    }
+};
+
+// Select A | B
+template <typename A, typename B>
+struct choice : expr<choice<A, B>>
+{
+    template <typename G>
+    static void visit(typename G::Table &table)
+    {
+        G::template visit<A>(table);
+        G::template visit<B>(table);
+    }
+
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "or";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::CHOICE;
+        summary.children.push_back(G::template slot<A>::id);
+        summary.children.push_back(G::template slot<B>::id);
+    }
+
+    template <typename G>
+    static bool consumes()
+    {
+        return G::template slot<A>::must_consume_token || G::template slot<B>::must_consume_token;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+    {
+        typename G::builder_type ret(ctx, eos);
+        // Alternatives that can't start here aren't tried at all, but their
+        // tokens are still expected here.
+        const FirstSet &first = G::first_set(G::template slot<A>::id), &second = G::first_set(G::template slot<B>::id);
+        const bool try_first = first.may_start(token_pos, eos);
+        const bool try_second = second.may_start(token_pos, eos);
+        if (!try_first)
+            ctx.expect(first.rules, token_pos.position());
+        if (!try_second)
+            ctx.expect(second.rules, token_pos.position());
+        if (!try_first || !try_second) {
+            if (try_first)
+                propagate_child_info(ret, get_match<G, A>(ctx, token_pos, eos));
+            else if (try_second)
+                propagate_child_info(ret, get_match<G, B>(ctx, token_pos, eos));
+            else
+                ret.end = token_pos;
+            return ret.finish();
+        }
+        typename G::rule_result tmpl = get_match<G, A>(ctx, token_pos, eos);
+        if (tmpl->matched) {
+            propagate_child_info(ret, tmpl);
+            return ret.finish();
+        }
+        typename G::rule_result tmpr = get_match<G, B>(ctx, token_pos, eos);
+        if (tmpr->matched) {
+            propagate_child_info(ret, tmpr);
+            return ret.finish();
+        }
+        // Didn't match, see which match got further
+        if (right_most(*tmpl).end - token_pos < right_most(*tmpr).end - token_pos)
+            propagate_child_info(ret, tmpr);
+        else
+            propagate_child_info(ret, tmpl);
+        return ret.finish();
+    }
+};
+
+// Kleene Star
+template <typename A>
+struct star : expr<star<A>>
+{
+    template <typename G>
+    static void visit(typename G::Table &table)
+    {
+        G::template visit<A>(table);
+    }
+
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "kleene->" + G::name(G::template slot<A>::id);
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::STAR;
+        summary.children.push_back(G::template slot<A>::id);
+    }
+
+    template <typename G>
+    static bool consumes()
+    {
+        return false;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+    {
+        typename G::builder_type ret(ctx, eos);
+        ret.end = token_pos;
+        typename G::iterator tmp_pos = token_pos;
+        bool tmp_matched = true;
+        while (tmp_pos != eos && tmp_matched) {
+            typename G::rule_result tmp = get_match<G, A>(ctx, tmp_pos, eos);
+            propagate_child_info(ret, tmp);
+            tmp_pos = tmp->end;
+            tmp_matched = tmp->matched;
+        }
+        ret.matched = true;
+        return ret.finish();
+    }
+};
+
+// Non-greedy kleene star: A as often as needed for B to match.
+template <typename A, typename B>
+struct until : expr<until<A, B>>
+{
+    template <typename G>
+    static void visit(typename G::Table &table)
+    {
+        G::template visit<A>(table);
+        G::template visit<B>(table);
+    }
+
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "non-greedy kleene";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::NON_GREEDY;
+        summary.children.push_back(G::template slot<A>::id);
+        summary.children.push_back(G::template slot<B>::id);
+    }
+
+    template <typename G>
+    static bool consumes()
+    {
+        return G::template slot<A>::must_consume_token || G::template slot<B>::must_consume_token;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+    {
+        typename G::builder_type ret(ctx, eos);
+        ret.matched = true;
+        bool matched_right_side = false;
+        typename G::iterator tmp_pos = token_pos;
+        while (tmp_pos != eos) {
+            const typename G::iterator start_pos = tmp_pos;
+            typename G::rule_result tmp = get_match<G, B>(ctx, start_pos, eos);
+            if (tmp->matched) {
+                propagate_child_info(ret, tmp);
+                matched_right_side = true;
+                break;
+            }
+            tmp = get_match<G, A>(ctx, start_pos, eos);
+            tmp_pos = tmp->end;
+            propagate_child_info(ret, tmp);
+            // A matched nothing; trying again would loop forever.
+            if (!tmp->matched || tmp->end == start_pos)
+                break;
+        }
+        if (!matched_right_side) {
+            ret.matched = false;
+            ret.end = token_pos;
+        }
+        return ret.finish();
+    }
+};
+
+// Optional A?
+template <typename A>
+struct opt : expr<opt<A>>
+{
+    template <typename G>
+    static void visit(typename G::Table &table)
+    {
+        G::template visit<A>(table);
+    }
+
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "optional";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::OPTIONAL;
+        summary.children.push_back(G::template slot<A>::id);
+    }
+
+    template <typename G>
+    static bool consumes()
+    {
+        return false;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+    {
+        typename G::builder_type ret(ctx, eos);
+        if (token_pos == eos)
+            return ret.finish();
+        typename G::rule_result tmp = get_match<G, A>(ctx, token_pos, eos);
+        propagate_child_info(ret, tmp);
+        assert(ret.matched || tmp->end == token_pos);
+        ret.matched = true;
+        return ret.finish();
+    }
+};
+
+// Any one token where A doesn't match.
+template <typename A>
+struct not_ : expr<not_<A>>
+{
+    template <typename G>
+    static void visit(typename G::Table &table)
+    {
+        G::template visit<A>(table);
+    }
+
+    template <typename G>
+    static std::string rule_name()
+    {
+        return "not";
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        summary.kind = RuleKind::NOT;
+        summary.children.push_back(G::template slot<A>::id);
+    }
+
+    template <typename G>
+    static bool consumes()
+    {
+        return true;
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+    {
+        if (token_pos == eos)
+            return ctx.arena.make(false, eos);
+        const bool matched = !get_match<G, A>(ctx, token_pos, eos)->matched;
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    }
+};
+
+// 1 or more
+template <typename A>
+using plus = seq<A, star<A>>;
+
+// A named rule, matching Body. Self can define
+//   static const char *name();
+//   static void action(ActionType &);
+//   static bool check(const Match<Iterator, ActionType> &);
+// Like assigning to a RuleWrapper, Body's children become Self's.
+template <typename Self, typename Body>
+struct rule : expr<Self>
+{
+    template <typename G>
+    static void visit(typename G::Table &table)
+    {
+        Body::template visit<G>(table);
+    }
+
+    template <typename G>
+    static std::string rule_name()
+    {
+        return detail::name_of<Self>(Body::template rule_name<G>(), detail::has_name<Self>());
+    }
+
+    template <typename G>
+    static void summarize(RuleSummary &summary)
+    {
+        Body::template summarize<G>(summary);
+    }
+
+    template <typename G>
+    static bool consumes()
+    {
+        return Body::template consumes<G>();
+    }
+
+    template <typename G>
+    static typename G::rule_result match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+    {
+        return Body::template match<G>(ctx, token_pos, eos);
+    }
+};
+
+template <typename A, typename B>
+seq<A, B> operator >>(const expr<A> &, const expr<B> &)
+{
+    return seq<A, B>();
+}
+
+template <typename A, typename B>
+choice<A, B> operator |(const expr<A> &, const expr<B> &)
+{
+    return choice<A, B>();
+}
+
+template <typename A>
+star<A> operator *(const expr<A> &)
+{
+    return star<A>();
+}
+
+template <typename A, typename B>
+until<A, B> operator /(const expr<A> &, const expr<B> &)
+{
+    return until<A, B>();
+}
+
+template <typename A>
+opt<A> operator -(const expr<A> &)
+{
+    return opt<A>();
+}
+
+template <typename A>
+plus<A> operator +(const expr<A> &)
+{
+    return plus<A>();
+}
+
+template <typename A>
+not_<A> operator !(const expr<A> &)
+{
+    return not_<A>();
+}
+
+// The rules reachable from Start, with ids given in the same depth first
+// order as vemaparse::Grammar. The ids belong to the rule types, so they are
+// assigned once, when the first Grammar<Start, ...> is made, and one rule
+// type appearing in several places is one rule. As with MEMO_AUTO, single
+// token rules aren't memoized. Make a Grammar before matching anything with
+// it.
+template <typename Start, typename Iterator, typename ActionType>
+class Grammar
+{
+public:
+    typedef Iterator iterator;
+    typedef Match<Iterator, ActionType> match_type;
+    typedef match_type *rule_result;
+    typedef ParseContext<Iterator, ActionType> context_type;
+    typedef MatchBuilder<Iterator, ActionType> builder_type;
+
+    struct Table
+    {
+        std::vector<std::string> names;
+        std::vector<std::function<void(ActionType &)>> actions;
+        std::vector<RuleSummary> summaries;
+        std::vector<FirstSet> first_sets;
+    };
+
+    template <typename R>
+    struct slot
+    {
+        static uint32_t id;
+        static bool must_consume_token;
+        static bool memoized;
+        // No children, so its failures go to ParseContext::expect.
+        static bool leaf;
+    };
+
+    template <typename R>
+    static void visit(Table &table)
+    {
+        if (slot<R>::id != Rule<Iterator, ActionType>::no_id)
+            return;
+        const uint32_t id = uint32_t(table.names.size());
+        slot<R>::id = id;
+        table.names.push_back(std::string());
+        table.actions.push_back(detail::action_of<R, ActionType>(detail::has_action<R, ActionType>()));
+        table.summaries.push_back(RuleSummary());
+        R::template visit<Grammar>(table);
+        // Names and must_consume_token are taken from the children, as far
+        // as they are known; in a cycle they aren't yet.
+        slot<R>::must_consume_token = R::template consumes<Grammar>();
+        table.names[id] = R::template rule_name<Grammar>();
+        RuleSummary &summary = table.summaries[id];
+        summary.must_consume_token = slot<R>::must_consume_token;
+        R::template summarize<Grammar>(summary);
+        slot<R>::memoized = memoize_by_default(summary.kind);
+        slot<R>::leaf = summary.children.empty();
+    }
+
+private:
+    static Table &table()
+    {
+        static Table ret;
+        return ret;
+    }
+
+    static const Table &build()
+    {
+        static const bool built = (visit<Start>(table()), table().first_sets = vemaparse::first_sets(table().summaries), true);
+        (void)built;
+        return table();
+    }
+
+public:
+    Grammar()
+    {
+        build();
+    }
+
+    std::size_t size() const
+    {
+        return table().names.size();
+    }
+
+    template <typename R>
+    static uint32_t id()
+    {
+        return slot<R>::id;
+    }
+
+    static const FirstSet &first_set(uint32_t id)
+    {
+        return table().first_sets[id];
+    }
+
+    static const std::string &name(uint32_t id)
+    {
+        static const std::string none;
+        return id < table().names.size() ? table().names[id] : none;
+    }
+
+    const std::string &name(const match_type &m) const
+    {
+        return name(m.rule);
+    }
+
+    static const std::function<void(ActionType &)> &action(uint32_t id)
+    {
+        static const std::function<void(ActionType &)> none;
+        return id < table().actions.size() ? table().actions[id] : none;
+    }
+
+    const std::function<void(ActionType &)> &action(const match_type &m) const
+    {
+        return action(m.rule);
+    }
+
+    // Same as the start rule's get_match.
+    rule_result match(context_type &ctx, Iterator begin, Iterator end) const
+    {
+        return get_match<Grammar, Start>(ctx, begin, end);
+    }
+};
+
+template <typename Start, typename Iterator, typename ActionType>
+template <typename R>
+uint32_t Grammar<Start, Iterator, ActionType>::slot<R>::id = Rule<Iterator, ActionType>::no_id;
+
+template <typename Start, typename Iterator, typename ActionType>
+template <typename R>
+bool Grammar<Start, Iterator, ActionType>::slot<R>::must_consume_token = true;
+
+template <typename Start, typename Iterator, typename ActionType>
+template <typename R>
+bool Grammar<Start, Iterator, ActionType>::slot<R>::memoized = true;
+
+template <typename Start, typename Iterator, typename ActionType>
+template <typename R>
+bool Grammar<Start, Iterator, ActionType>::slot<R>::leaf = false;
+
+// Rule::get_match for rule type R in grammar G.
+template <typename G, typename R>
+typename G::rule_result get_match(typename G::context_type &ctx, typename G::iterator token_pos, typename G::iterator eos)
+{
+    typedef typename G::rule_result rule_result;
+    const uint32_t id = G::template slot<R>::id;
+    const std::size_t position = token_pos.position();
+    vemaparse::detail::ProfileCall profile(ctx, id);
+    if (G::template slot<R>::must_consume_token && token_pos == eos) {
+        rule_result ret = ctx.arena.make(false, eos);
+        ret->begin = token_pos;
+        ret->examined = position + 1;
+        ctx.examined = std::max(ctx.examined, ret->examined);
+        if (G::template slot<R>::leaf)
+            ctx.expect(id, position);
+        else
+            ctx.expect(G::first_set(id).rules, position);
+        profile.answer(*ret, false);
+        return ret;
+    }
+    const bool memoized = G::template slot<R>::memoized;
+    if (memoized) {
+        const rule_result *memo = ctx.memo_for(token_pos).find(id, position);
+        if (memo) {
+            if (ctx.memo_profile)
+                ++ctx.memo_profile->hits[id];
+            ctx.examined = std::max(ctx.examined, (*memo)->examined);
+            ctx.log_hit(**memo);
+            profile.answer(**memo, true);
+            return *memo;
+        }
+    }
+    const std::size_t examined = ctx.examined;
+    ctx.examined = position + 1;
+    profile.enter();
+    const std::size_t event = ctx.log_enter(id, position);
+    rule_result ret;
+    try {
+        ret = R::template match<G>(ctx, token_pos, eos);
+    } catch (const vemalex::LexerError &ex) {
+        ctx.lexer_error = ex.what();
+        ret = ctx.arena.make(false, token_pos);
+        ret->begin = token_pos;
+        ret->examined = ctx.examined;
+        ctx.examined = std::max(examined, ret->examined);
+        ctx.log_leave(event, ret);
+        profile.leave(*ret, memoized);
+        return ret;
+    }
+    assert(ret->matched || ret->end == token_pos);
+    ret->begin = token_pos;
+    ret->rule = id;
+    ret->examined = std::max(ctx.examined, ret->end.position() + 1);
+    ctx.examined = std::max(examined, ret->examined);
+    typedef detail::has_check<R, typename G::match_type> has_check;
+    if (has_check::value) {
+        ret->matched = detail::check<R>(*ret, has_check());
+        if (!ret->matched)
+            ret->end = token_pos;
+    }
+    if (!ret->matched && G::template slot<R>::leaf)
+        ctx.expect(id, position);
+    if (memoized) {
+        ctx.memo_for(token_pos).insert(id, position, ret);
+        ret->memoized = true;
+    }
+    if (ctx.memo_profile)
+        ++ctx.memo_profile->matches[id];
+    ctx.log_leave(event, ret);
+    profile.leave(*ret, memoized);
+    return ret;
+}
+
+}
+
+}
+
+#endif
@@ -8,12 +8,33 @@
 #include <set>
 #include <iterator>
 #include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <type_traits>
 #include <ctype.h>
+#include <stdint.h>
 
-#ifdef HAS_IN_SITU_STRING
-#include <roanoke/in-situ-string.h>
-#else
-#include <vector>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define VEMALEX_HAS_STRING_VIEW 1
+#endif
+
+// Define VEMALEX_NO_SIMD to lex with the scalar loops only.
+#if !defined(VEMALEX_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEMALEX_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VEMALEX_SSE2 1
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
 #endif
 
 #if defined(_MSC_VER)
@@ -50,6 +71,7 @@ enum Token
 };
 
 template <typename Iterator> class Lexer;
+template <typename Iterator> class TokenStream;
 
 struct LexerError : public std::exception
 {
@@ -81,8 +103,443 @@ namespace detail
     {
         typedef std::ptrdiff_t difference_type;
     };
+
+    // Character classes for the "C" locale, so lexing doesn't depend on the
+    // global locale or go through libc per byte.
+    enum CharClass
+    {
+        CC_SPACE = 0x01,
+        CC_IDENT_START = 0x02,  // alpha or _
+        CC_IDENT = 0x04,        // alnum or _
+        CC_DIGIT = 0x08,
+        CC_NUMBER = 0x10,       // xdigit, x or .
+        CC_PUNCT = 0x20,
+        CC_OPERATOR = 0x40      // punct that continues an operator
+    };
+
+    template <typename T = void>
+    struct CharClasses
+    {
+        static const uint8_t table[256];
+    };
+
+    template <typename T>
+    const uint8_t CharClasses<T>::table[256] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x01, 0x60, 0x20, 0x20, 0x60, 0x60, 0x60, 0x60, 0x20, 0x20, 0x60, 0x60, 0x60, 0x60, 0x70, 0x60,
+        0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60,
+        0x60, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+        0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x20, 0x60, 0x20, 0x60, 0x66,
+        0x60, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+        0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x16, 0x06, 0x06, 0x20, 0x60, 0x20, 0x60, 0x00,
+        // no classes for bytes >= 0x80
+    };
+
+    inline uint8_t char_class(char c)
+    {
+        return CharClasses<>::table[static_cast<unsigned char>(c)];
+    }
+
+    inline unsigned count_trailing_zeros(uint32_t mask)
+    {
+        assert(mask);
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return unsigned(index);
+#else
+        return unsigned(__builtin_ctz(mask));
+#endif
+    }
+
+#if defined(VEMALEX_AVX2)
+    struct Simd
+    {
+        typedef __m256i vec;
+        static const int width = 32;
+        static vec load(const char *p) {return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));}
+        static vec eq(vec v, char c) {return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));}
+        static vec any(vec a, vec b) {return _mm256_or_si256(a, b);}
+        static uint32_t mask(vec v) {return uint32_t(_mm256_movemask_epi8(v));}
+        // Unsigned lo <= v <= hi
+        static vec in_range(vec v, char lo, char hi)
+        {
+            return _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(lo)), v),
+                                    _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(hi)), v));
+        }
+    };
+#elif defined(VEMALEX_SSE2)
+    struct Simd
+    {
+        typedef __m128i vec;
+        static const int width = 16;
+        static vec load(const char *p) {return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));}
+        static vec eq(vec v, char c) {return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));}
+        static vec any(vec a, vec b) {return _mm_or_si128(a, b);}
+        // The unused high bits are set so that ~mask() only flags real lanes.
+        static uint32_t mask(vec v) {return uint32_t(_mm_movemask_epi8(v)) | 0xffff0000u;}
+        // Unsigned lo <= v <= hi
+        static vec in_range(vec v, char lo, char hi)
+        {
+            return _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(lo)), v),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(hi)), v));
+        }
+    };
+#endif
+
+    // Byte sets for the long runs. cls is the matching table class, if any,
+    // and match() the vector version of the same test.
+    struct SpaceChars
+    {
+        static bool test(char c) {return (char_class(c) & CC_SPACE) != 0;}
+#if defined(VEMALEX_AVX2) || defined(VEMALEX_SSE2)
+        static Simd::vec match(Simd::vec v) {return Simd::any(Simd::eq(v, ' '), Simd::in_range(v, '\t', '\r'));}
+#endif
+    };
+
+    struct IdentChars
+    {
+        static bool test(char c) {return (char_class(c) & CC_IDENT) != 0;}
+#if defined(VEMALEX_AVX2) || defined(VEMALEX_SSE2)
+        static Simd::vec match(Simd::vec v)
+        {
+            return Simd::any(Simd::any(Simd::in_range(v, 'a', 'z'), Simd::in_range(v, 'A', 'Z')),
+                             Simd::any(Simd::in_range(v, '0', '9'), Simd::eq(v, '_')));
+        }
+#endif
+    };
+
+    struct NumberChars
+    {
+        static bool test(char c) {return (char_class(c) & CC_NUMBER) != 0;}
+#if defined(VEMALEX_AVX2) || defined(VEMALEX_SSE2)
+        static Simd::vec match(Simd::vec v)
+        {
+            return Simd::any(Simd::any(Simd::in_range(v, '0', '9'), Simd::in_range(v, 'a', 'f')),
+                             Simd::any(Simd::in_range(v, 'A', 'F'), Simd::any(Simd::eq(v, 'x'), Simd::eq(v, '.'))));
+        }
+#endif
+    };
+
+    struct StringChars
+    {
+        static bool test(char c) {return c == '"' || c == '\\';}
+#if defined(VEMALEX_AVX2) || defined(VEMALEX_SSE2)
+        static Simd::vec match(Simd::vec v) {return Simd::any(Simd::eq(v, '"'), Simd::eq(v, '\\'));}
+#endif
+    };
+
+    // Most runs are a few bytes long, so the vector loops only start once
+    // a run has gone this far.
+    static const int scalar_prefix = 16;
+
+    // First position in [p, end) whose byte is not in Set.
+    template <typename Set>
+    inline const char *skip(const char *p, const char *end)
+    {
+#if defined(VEMALEX_AVX2) || defined(VEMALEX_SSE2)
+        const char *prefix_end = end - p > scalar_prefix ? p + scalar_prefix : end;
+        while (p != prefix_end && Set::test(*p))
+            ++p;
+        if (p != prefix_end)
+            return p;
+        while (end - p >= Simd::width) {
+            const uint32_t m = ~Simd::mask(Set::match(Simd::load(p)));
+            if (m)
+                return p + count_trailing_zeros(m);
+            p += Simd::width;
+        }
+#endif
+        while (p != end && Set::test(*p))
+            ++p;
+        return p;
+    }
+
+    // First position in [p, end) whose byte is in Set.
+    template <typename Set>
+    inline const char *find(const char *p, const char *end)
+    {
+#if defined(VEMALEX_AVX2) || defined(VEMALEX_SSE2)
+        const char *prefix_end = end - p > scalar_prefix ? p + scalar_prefix : end;
+        while (p != prefix_end && !Set::test(*p))
+            ++p;
+        if (p != prefix_end)
+            return p;
+        while (end - p >= Simd::width) {
+            const uint32_t m = Simd::mask(Set::match(Simd::load(p))) & (~uint32_t(0) >> (32 - Simd::width));
+            if (m)
+                return p + count_trailing_zeros(m);
+            p += Simd::width;
+        }
+#endif
+        while (p != end && !Set::test(*p))
+            ++p;
+        return p;
+    }
+
+    // Position of the closing quote of a string literal whose body starts
+    // at p, or end if it isn't closed. A backslash escapes the next byte.
+    inline const char *string_end(const char *p, const char *end)
+    {
+        for (;;) {
+            p = find<StringChars>(p, end);
+            if (p == end || *p == '"')
+                return p;
+            if (end - p <= 2)
+                return end;
+            p += 2;
+        }
+    }
+
+    // Iterators whose characters are laid out contiguously in memory.
+    template <typename T>
+    struct IsContiguous : std::integral_constant<bool,
+        std::is_same<T, char *>::value ||
+        std::is_same<T, const char *>::value ||
+        std::is_same<T, std::string::iterator>::value ||
+        std::is_same<T, std::string::const_iterator>::value ||
+        std::is_same<T, std::vector<char>::iterator>::value ||
+        std::is_same<T, std::vector<char>::const_iterator>::value>
+    {
+    };
+
+    // Run scanning for Lexer::next. Contiguous input goes through the
+    // pointer kernels above, anything else through the same table tests.
+    template <typename Iterator, bool = IsContiguous<Iterator>::value>
+    struct Scanner
+    {
+        template <typename Set>
+        static Iterator skip(Iterator cur, Iterator end)
+        {
+            while (cur != end && Set::test(*cur))
+                ++cur;
+            return cur;
+        }
+
+        static Iterator find_newline(Iterator cur, Iterator end)
+        {
+            while (cur != end && *cur != '\n')
+                ++cur;
+            return cur;
+        }
+
+        static Iterator string_end(Iterator cur, Iterator end)
+        {
+            bool open_slash = false;
+            while (cur != end) {
+                if (*cur == '"' && !open_slash)
+                    break;
+                if (*cur == '\\')
+                    open_slash = !open_slash;
+                else
+                    open_slash = false;
+                ++cur;
+            }
+            return cur;
+        }
+    };
+
+    template <typename Iterator>
+    struct Scanner<Iterator, true>
+    {
+        template <typename Set>
+        static Iterator skip(Iterator cur, Iterator end)
+        {
+            if (cur == end)
+                return cur;
+            const char *p = &*cur;
+            return cur + (detail::skip<Set>(p, p + (end - cur)) - p);
+        }
+
+        static Iterator find_newline(Iterator cur, Iterator end)
+        {
+            if (cur == end)
+                return cur;
+            const char *p = &*cur;
+            const void *nl = std::memchr(p, '\n', std::size_t(end - cur));
+            return nl ? cur + (static_cast<const char *>(nl) - p) : end;
+        }
+
+        static Iterator string_end(Iterator cur, Iterator end)
+        {
+            if (cur == end)
+                return cur;
+            const char *p = &*cur;
+            return cur + (detail::string_end(p, p + (end - cur)) - p);
+        }
+    };
 }
 
+// Non-owning view of a token's text in the input. Converts to std::string
+// on demand and, for contiguous input, to std::string_view.
+template <typename Iterator>
+struct TokenView
+{
+    Iterator first, last;
+
+    TokenView() : first(), last() { }
+    TokenView(Iterator first_, Iterator last_) : first(first_), last(last_) { }
+
+    Iterator begin() const {return first;}
+    Iterator end() const {return last;}
+    std::size_t size() const {return std::size_t(std::distance(first, last));}
+    bool empty() const {return first == last;}
+
+    std::string str() const
+    {
+        return std::string(first, last);
+    }
+
+    operator std::string() const
+    {
+        return str();
+    }
+
+#ifdef VEMALEX_HAS_STRING_VIEW
+    template <typename It = Iterator, typename = typename std::enable_if<detail::IsContiguous<It>::value>::type>
+    operator std::string_view() const
+    {
+        return empty() ? std::string_view() : std::string_view(&*first, size());
+    }
+#endif
+
+    bool equals(const char *s, std::size_t n) const
+    {
+        return size() == n && std::equal(first, last, s);
+    }
+
+    bool operator ==(const char *s) const
+    {
+        return equals(s, std::strlen(s));
+    }
+
+    bool operator ==(const std::string &s) const
+    {
+        return equals(s.data(), s.size());
+    }
+
+    bool operator ==(const TokenView &other) const
+    {
+        return size() == other.size() && std::equal(first, last, other.first);
+    }
+
+    template <typename T>
+    bool operator !=(const T &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+template <typename Iterator>
+std::ostream &operator <<(std::ostream &stream, const TokenView<Iterator> &view)
+{
+    std::copy(view.begin(), view.end(), std::ostream_iterator<char>(stream));
+    return stream;
+}
+
+// Interns identifier text to dense ids, numbered from 0 in the order they
+// were first seen, so identifiers can be compared and used as keys as
+// integers. The text of all symbols is kept in one block.
+class SymbolTable
+{
+    std::string chars;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> hashes;
+    // Open addressing, a power of two in size and never more than half full.
+    std::vector<uint32_t> slots;
+
+    template <typename InputIt>
+    static uint32_t hash(InputIt begin, InputIt end)
+    {
+        uint32_t h = 2166136261u;
+        for (; begin != end; ++begin)
+            h = (h ^ static_cast<unsigned char>(*begin)) * 16777619u;
+        return h;
+    }
+
+    template <typename InputIt>
+    bool same(uint32_t id, InputIt begin, InputIt end, std::size_t n) const
+    {
+        return offsets[id + 1] - offsets[id] == n && std::equal(begin, end, chars.begin() + offsets[id]);
+    }
+
+    void grow()
+    {
+        std::vector<uint32_t> tmp(slots.size() * 2, uint32_t(none));
+        const std::size_t mask = tmp.size() - 1;
+        for (uint32_t id = 0; id < hashes.size(); ++id) {
+            std::size_t i = hashes[id] & mask;
+            while (tmp[i] != none)
+                i = (i + 1) & mask;
+            tmp[i] = id;
+        }
+        slots.swap(tmp);
+    }
+
+public:
+    static const uint32_t none = ~uint32_t(0);
+
+    SymbolTable() : offsets(1, 0), slots(64, uint32_t(none)) { }
+
+    // The id of the symbol with the text [begin, end), added if it's new.
+    template <typename InputIt>
+    uint32_t intern(InputIt begin, InputIt end)
+    {
+        const std::size_t n = std::size_t(std::distance(begin, end));
+        const uint32_t h = hash(begin, end);
+        const std::size_t mask = slots.size() - 1;
+        std::size_t i = h & mask;
+        for (; slots[i] != none; i = (i + 1) & mask)
+            if (hashes[slots[i]] == h && same(slots[i], begin, end, n))
+                return slots[i];
+        const uint32_t id = uint32_t(hashes.size());
+        slots[i] = id;
+        hashes.push_back(h);
+        chars.append(begin, end);
+        assert(chars.size() < UINT32_MAX);
+        offsets.push_back(uint32_t(chars.size()));
+        if (hashes.size() * 2 > slots.size())
+            grow();
+        return id;
+    }
+
+    uint32_t intern(const std::string &s)
+    {
+        return intern(s.begin(), s.end());
+    }
+
+    // The id of the symbol with the text [begin, end), or none.
+    template <typename InputIt>
+    uint32_t find(InputIt begin, InputIt end) const
+    {
+        const std::size_t n = std::size_t(std::distance(begin, end));
+        const uint32_t h = hash(begin, end);
+        const std::size_t mask = slots.size() - 1;
+        for (std::size_t i = h & mask; slots[i] != none; i = (i + 1) & mask)
+            if (hashes[slots[i]] == h && same(slots[i], begin, end, n))
+                return slots[i];
+        return none;
+    }
+
+    uint32_t find(const std::string &s) const
+    {
+        return find(s.begin(), s.end());
+    }
+
+    std::size_t size() const
+    {
+        return hashes.size();
+    }
+
+    // Valid until the next new symbol is added.
+    TokenView<const char *> text(uint32_t id) const
+    {
+        const char *data = chars.data();
+        return TokenView<const char *>(data + offsets[id], data + offsets[id + 1]);
+    }
+};
+
 template <typename Iterator>
 struct LexerIterator : public std::iterator<std::forward_iterator_tag, Iterator>
 {
@@ -102,30 +559,15 @@ struct LexerIterator : public std::iterator<std::forward_iterator_tag, Iterator>
     LexerIterator &operator ++();
     LexerIterator operator ++(int);
 
-#ifdef HAS_IN_SITU_STRING
-    roanoke::IS_String operator *() const
-    {
-        if (is_end) {
-            assert(false && "dereferencing end iterator");
-            std::abort();
-        }
-        return roanoke::IS_String(begin, end);
-    }
-#else
-    std::string operator *() const
+    TokenView<Iterator> operator *() const
     {
         if (is_end) {
             assert(false && "dereferencing end iterator");
             std::abort();
         }
         assert(begin != end);
-        Iterator tmp = begin;
-        std::vector<char> buf;
-        while (tmp != end)
-            buf.push_back(*tmp++);
-        return std::string(buf.begin(), buf.end());
+        return TokenView<Iterator>(begin, end);
     }
-#endif
 
     bool operator ==(const LexerIterator &other) const
     {
@@ -157,55 +599,66 @@ struct LexerIterator : public std::iterator<std::forward_iterator_tag, Iterator>
         this->skip_nl = true;
     }
 
+    bool newline() const
+    {
+        return !this->skip_nl;
+    }
+
     bool operator <(const LexerIterator &other) const
     {
         return end < other.end;
     }
+
+    // Character offset of the token, used as a dense position key.
+    std::size_t position() const;
 };
 
 template <typename Iterator>
 class Lexer
 {
     template <typename> friend struct LexerIterator;
+    template <typename> friend class TokenStream;
     Iterator begin_pos, end_pos;
     bool skip_ws;
     bool return_unknown;
-    mutable bool skip_nl;
+    bool skip_nl;
 
     LexerIterator<Iterator> next(const LexerIterator<Iterator> &iter) const
     {
         if (iter.is_end)
             return iter;
-        return next(iter.end);
+        return next(iter.end, iter.skip_nl);
     }
 
-    bool is_special(char c) const
+    LexerIterator<Iterator> next(const Iterator &start) const
     {
-        static const char specials_[] = "{}()[]#";
-        for (const char *s = specials_; *s; ++s)
-            if (c == *s) 
-                return true;
-        return false;
+        return next(start, skip_nl);
     }
 
-    LexerIterator<Iterator> next(const Iterator &start) const
+    // The newline mode is the iterator's, so the lexer itself is never
+    // changed and can be shared.
+    LexerIterator<Iterator> next(const Iterator &start, bool skip_nl) const
     {
+        LexerIterator<Iterator> ret = scan(start, skip_nl);
+        ret.skip_nl = skip_nl;
+        return ret;
+    }
+
+    LexerIterator<Iterator> scan(const Iterator &start, bool skip_nl) const
+    {
+        typedef detail::Scanner<Iterator> scanner;
         Iterator cur = start, end_pos = this->end_pos;
         if (cur == end_pos) {
             return this->end();
         }
 
         // space
-        if (::isspace(*cur)) {
-            bool has_nl = (*cur == '\n');
-            Iterator begin_pos = cur++;
-            while ((cur != end_pos) && ::isspace(*cur)) {
-                has_nl = has_nl || (*cur == '\n');
-                ++cur;
-            }
+        if (detail::char_class(*cur) & detail::CC_SPACE) {
+            Iterator begin_pos = cur;
+            cur = scanner::template skip<detail::SpaceChars>(cur, end_pos);
             if (!skip_ws)
                 return LexerIterator<Iterator>(this, WHITESPACE, begin_pos, cur);
-            if (!skip_nl && has_nl) {
+            if (!skip_nl && std::find(begin_pos, cur, '\n') != cur) {
                 return LexerIterator<Iterator>(this, WHITESPACE, begin_pos, cur);
             }
         }
@@ -237,14 +690,10 @@ class Lexer
         // single line comments
         if (*cur == '/') {
             Iterator begin_pos = cur++;
-            if (*cur == '/') {
-                while (cur != end_pos && *cur != '\n')
-                    ++cur;
-                Iterator local_end_pos = cur;
-                // consume the newline, but don't include it in the token
-                if (cur != local_end_pos)
-                    ++cur;
-                return LexerIterator<Iterator>(this, COMMENT, begin_pos, local_end_pos);
+            if (cur != end_pos && *cur == '/') {
+                // the newline isn't part of the token
+                cur = scanner::find_newline(cur, end_pos);
+                return LexerIterator<Iterator>(this, COMMENT, begin_pos, cur);
             } else {
                 // Not a comment
                 cur = begin_pos;
@@ -253,17 +702,8 @@ class Lexer
 
         // quoted strings
         if (*cur == '"') {
-            bool open_slash = false;
             Iterator begin_pos = cur++;
-            while (cur != end_pos) {
-                if (*cur == '"' && !open_slash)
-                    break;
-                if (*cur == '\\')
-                    open_slash = !open_slash;
-                else
-                    open_slash = false;
-                ++cur;
-            }
+            cur = scanner::string_end(cur, end_pos);
             if (cur == end_pos) {
                 // std::cerr << "ERROR: string literal not close\n";
                 // std::abort();
@@ -272,26 +712,26 @@ class Lexer
             return LexerIterator<Iterator>(this, STRING_LITERAL, begin_pos, ++cur);
         }
 
+        const uint8_t cls = detail::char_class(*cur);
+
         // identifiers
-        if (::isalpha(*cur) || (*cur == '_')) {
+        if (cls & detail::CC_IDENT_START) {
             Iterator begin_pos = cur++;
-            while (cur != end_pos && (::isalnum(*cur) || (*cur == '_')))
-                ++cur;
+            cur = scanner::template skip<detail::IdentChars>(cur, end_pos);
             return LexerIterator<Iterator>(this, IDENTIFIER, begin_pos, cur);
         }
 
         // numbers - check for illegal numbers later
-        if (::isdigit(*cur)) {
+        if (cls & detail::CC_DIGIT) {
             Iterator begin_pos = cur++;
-            while ((cur != end_pos) && (isxdigit(*cur) || (*cur == 'x') || (*cur == '.')))
-                ++cur;
+            cur = scanner::template skip<detail::NumberChars>(cur, end_pos);
             return LexerIterator<Iterator>(this, NUMBER_LITERAL, begin_pos, cur);
         }
 
         // operators
-        if (::ispunct(*cur)) {
+        if (cls & detail::CC_PUNCT) {
             Iterator begin_pos = cur++;
-            while (cur != end_pos && (*cur != '"') && ::ispunct(*cur) && !is_special(*cur))
+            while (cur != end_pos && (detail::char_class(*cur) & detail::CC_OPERATOR))
                 ++cur;
             return LexerIterator<Iterator>(this, OPERATOR, begin_pos, cur);
         }
@@ -319,26 +759,366 @@ public:
     {
         return iterator(this, end_pos);
     }
+
+    Iterator input_begin() const
+    {
+        return begin_pos;
+    }
+
+    Iterator input_end() const
+    {
+        return end_pos;
+    }
+
+    // skip_ws, skip_nl and return_unknown as bits 0 to 2, e.g. to tell
+    // apart tokens lexed with different settings.
+    uint32_t options() const
+    {
+        return (skip_ws ? 1u : 0u) | (skip_nl ? 2u : 0u) | (return_unknown ? 4u : 0u);
+    }
 };
 
+// Position in a TokenStream. Comparisons and distances only look at the
+// token index, so copying and ordering positions (e.g. as memo keys) is cheap.
 template <typename Iterator>
-inline LexerIterator<Iterator> &LexerIterator<Iterator>::operator ++()
+struct TokenStreamIterator
+{
+    typedef std::forward_iterator_tag iterator_category;
+    typedef TokenView<Iterator> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef void pointer;
+    typedef TokenView<Iterator> reference;
+
+    const TokenStream<Iterator> *stream;
+    uint32_t index;
+    Token token;
+    bool skip_nl;
+
+    TokenStreamIterator() : stream(NULL), index(0), token(INVALID), skip_nl(true) { }
+    TokenStreamIterator(const TokenStream<Iterator> *stream_, uint32_t index_, bool skip_nl_)
+        : stream(stream_), index(index_), token(INVALID), skip_nl(skip_nl_)
+    {
+        skip();
+    }
+
+    TokenStreamIterator &operator ++()
+    {
+        ++index;
+        skip();
+        return *this;
+    }
+
+    TokenStreamIterator operator ++(int)
+    {
+        TokenStreamIterator tmp = *this;
+        ++*this;
+        return tmp;
+    }
+
+    TokenView<Iterator> operator *() const
+    {
+        if (token == INVALID) {
+            assert(false && "dereferencing end iterator");
+            std::abort();
+        }
+        return TokenView<Iterator>(source_begin(), source_end());
+    }
+
+    Iterator source_begin() const;
+    Iterator source_end() const;
+
+    bool operator ==(const TokenStreamIterator &other) const
+    {
+        assert(this->stream == other.stream || !this->stream || !other.stream);
+        return this->index == other.index;
+    }
+
+    bool operator !=(const TokenStreamIterator &other) const
+    {
+        return !(*this == other);
+    }
+
+    difference_type operator -(const TokenStreamIterator &other) const
+    {
+        return difference_type(index) - difference_type(other.index);
+    }
+
+    void start_newline()
+    {
+        this->skip_nl = false;
+    }
+
+    void stop_newline()
+    {
+        this->skip_nl = true;
+    }
+
+    bool newline() const
+    {
+        return !this->skip_nl;
+    }
+
+    bool operator <(const TokenStreamIterator &other) const
+    {
+        return index < other.index;
+    }
+
+    std::size_t position() const
+    {
+        return index;
+    }
+
+    uint32_t symbol() const
+    {
+        return stream->symbol(index);
+    }
+
+    // Follow the token after TokenStream::edit moved it by delta positions.
+    void shift(std::ptrdiff_t delta)
+    {
+        index = uint32_t(std::ptrdiff_t(index) + delta);
+    }
+
+private:
+    // Step over newline whitespace unless in newline mode, then cache the kind.
+    void skip();
+};
+
+// Tokens [first, first + removed) of a TokenStream were replaced by
+// [first, first + inserted); the ones after them moved by inserted - removed.
+struct TokenEdit
+{
+    uint32_t first;
+    uint32_t removed;
+    uint32_t inserted;
+};
+
+// Lexes the whole input once into flat arrays of token kind, source offset
+// and length. Iterator must be random access.
+template <typename Iterator>
+class TokenStream
 {
-    if (this->skip_nl != this->lexer->skip_nl) {
-        this->lexer->skip_nl = this->skip_nl;
+    Iterator source;
+    std::size_t source_size;
+    std::vector<uint8_t> kinds;
+    std::vector<std::size_t> offsets;
+    std::vector<uint32_t> lengths;
+    // The symbol of every IDENTIFIER token and SymbolTable::none for the
+    // others, when the stream was lexed with a table.
+    std::vector<uint32_t> symbols;
+    SymbolTable *table;
+    bool skip_nl;
+    // When the lexer skips whitespace, the only WHITESPACE tokens recorded are
+    // the ones containing a newline, and iterators hop over them unless they
+    // are in newline mode.
+    bool newline_tokens;
+
+    template <typename T>
+    static void replace(std::vector<T> &v, uint32_t first, uint32_t removed, const std::vector<T> &with)
+    {
+        const std::size_t common = std::min<std::size_t>(removed, with.size());
+        std::copy(with.begin(), with.begin() + common, v.begin() + first);
+        if (removed > common)
+            v.erase(v.begin() + first + common, v.begin() + first + removed);
+        else
+            v.insert(v.begin() + first + common, with.begin() + common, with.end());
     }
-    *this = lexer->next(this->end);
+
+public:
+    typedef TokenStreamIterator<Iterator> iterator;
+
+    TokenStream() : source_size(0), table(NULL), skip_nl(true), newline_tokens(false) { }
+    // With symbol_table, identifiers are interned into it as they are lexed
+    // and by edit. The table must outlive the stream.
+    explicit TokenStream(const Lexer<Iterator> &lexer, SymbolTable *symbol_table = NULL)
+        : source(lexer.begin_pos), source_size(std::size_t(lexer.end_pos - lexer.begin_pos)),
+          table(symbol_table), skip_nl(lexer.skip_nl), newline_tokens(lexer.skip_ws)
+    {
+        Lexer<Iterator> tmp = lexer;
+        tmp.skip_nl = false;
+        for (LexerIterator<Iterator> iter = tmp.begin(); !iter.is_end; iter = tmp.next(iter)) {
+            kinds.push_back(uint8_t(iter.token));
+            offsets.push_back(std::size_t(iter.begin - source));
+            lengths.push_back(uint32_t(iter.end - iter.begin));
+            if (table)
+                symbols.push_back(iter.token == IDENTIFIER ? table->intern(iter.begin, iter.end) : uint32_t(SymbolTable::none));
+        }
+        assert(kinds.size() < UINT32_MAX);
+    }
+
+    // The count tokens lexer produced for its input earlier, e.g. kept in a
+    // cache, without lexing again.
+    TokenStream(const Lexer<Iterator> &lexer, const uint8_t *kinds_, const uint64_t *offsets_, const uint32_t *lengths_,
+                uint32_t count)
+        : source(lexer.begin_pos), source_size(std::size_t(lexer.end_pos - lexer.begin_pos)),
+          kinds(kinds_, kinds_ + count), offsets(offsets_, offsets_ + count), lengths(lengths_, lengths_ + count),
+          table(NULL), skip_nl(lexer.skip_nl), newline_tokens(lexer.skip_ws)
+    { }
+
+    // Update the stream after removed bytes at offset were replaced by
+    // inserted ones. lexer must be over the whole new input and set up like
+    // the one the stream was made from. Lexing restarts after the last token
+    // that ended before the edit and stops once a token starts where an old
+    // one after the edit moved to; later tokens are only moved. If the lexer
+    // throws the stream is left as it was.
+    TokenEdit edit(const Lexer<Iterator> &lexer, std::size_t offset, std::size_t removed, std::size_t inserted)
+    {
+        assert(offset + removed <= source_size);
+        const Iterator new_source = lexer.begin_pos;
+        const std::ptrdiff_t delta = std::ptrdiff_t(inserted) - std::ptrdiff_t(removed);
+
+        // A token is decided by its own text and the character after it, so
+        // the ones ending before offset can't change.
+        uint32_t first = 0;
+        for (uint32_t count = size(); count; ) {
+            const uint32_t step = count / 2;
+            if (offsets[first + step] + lengths[first + step] < offset) {
+                first += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+
+        Lexer<Iterator> tmp = lexer;
+        tmp.skip_nl = false;
+        std::vector<uint8_t> new_kinds;
+        std::vector<std::size_t> new_offsets;
+        std::vector<uint32_t> new_lengths;
+        std::vector<uint32_t> new_symbols;
+        uint32_t old = first;
+        LexerIterator<Iterator> iter = tmp.next(new_source + (first ? offsets[first - 1] + lengths[first - 1] : 0));
+        for (; !iter.is_end; iter = tmp.next(iter)) {
+            const std::size_t begin = std::size_t(iter.begin - new_source);
+            if (begin >= offset + inserted) {
+                while (old < size() && std::ptrdiff_t(offsets[old]) + delta < std::ptrdiff_t(begin))
+                    ++old;
+                if (old < size() && std::ptrdiff_t(offsets[old]) + delta == std::ptrdiff_t(begin))
+                    break;
+            }
+            new_kinds.push_back(uint8_t(iter.token));
+            new_offsets.push_back(begin);
+            new_lengths.push_back(uint32_t(iter.end - iter.begin));
+            if (table)
+                new_symbols.push_back(iter.token == IDENTIFIER ? table->intern(iter.begin, iter.end) : uint32_t(SymbolTable::none));
+        }
+        if (iter.is_end)
+            old = size();
+
+        TokenEdit ret = {first, old - first, uint32_t(new_kinds.size())};
+        replace(kinds, first, ret.removed, new_kinds);
+        replace(offsets, first, ret.removed, new_offsets);
+        replace(lengths, first, ret.removed, new_lengths);
+        if (table)
+            replace(symbols, first, ret.removed, new_symbols);
+        for (std::size_t i = first + ret.inserted; i < offsets.size(); ++i)
+            offsets[i] = std::size_t(std::ptrdiff_t(offsets[i]) + delta);
+        source = new_source;
+        source_size = std::size_t(lexer.end_pos - lexer.begin_pos);
+        assert(kinds.size() < UINT32_MAX);
+        return ret;
+    }
+
+    iterator begin() const
+    {
+        return iterator(this, 0, skip_nl);
+    }
+
+    iterator end() const
+    {
+        return iterator(this, size(), skip_nl);
+    }
+
+    uint32_t size() const
+    {
+        return uint32_t(kinds.size());
+    }
+
+    Token kind(uint32_t index) const
+    {
+        return Token(kinds[index]);
+    }
+
+    std::size_t offset(uint32_t index) const
+    {
+        return offsets[index];
+    }
+
+    std::size_t length(uint32_t index) const
+    {
+        return lengths[index];
+    }
+
+    // SymbolTable::none unless the token is an IDENTIFIER and the stream
+    // has a table. Equal ids mean equal text.
+    uint32_t symbol(uint32_t index) const
+    {
+        return table && index < size() ? symbols[index] : uint32_t(SymbolTable::none);
+    }
+
+    const SymbolTable *symbol_table() const
+    {
+        return table;
+    }
+
+    bool skipped(uint32_t index, bool skip_nl_) const
+    {
+        return skip_nl_ && newline_tokens && kinds[index] == WHITESPACE;
+    }
+
+    // The end position maps to the end of the input.
+    Iterator token_begin(uint32_t index) const
+    {
+        return source + (index < size() ? offsets[index] : source_size);
+    }
+
+    Iterator token_end(uint32_t index) const
+    {
+        return source + (index < size() ? offsets[index] + lengths[index] : source_size);
+    }
+};
+
+template <typename Iterator>
+inline void TokenStreamIterator<Iterator>::skip()
+{
+    const uint32_t size = stream->size();
+    while (index < size && stream->skipped(index, skip_nl))
+        ++index;
+    token = index < size ? stream->kind(index) : INVALID;
+}
+
+template <typename Iterator>
+inline Iterator TokenStreamIterator<Iterator>::source_begin() const
+{
+    return stream->token_begin(index);
+}
+
+template <typename Iterator>
+inline Iterator TokenStreamIterator<Iterator>::source_end() const
+{
+    return stream->token_end(index);
+}
+
+template <typename Iterator>
+inline std::size_t LexerIterator<Iterator>::position() const
+{
+    if (!lexer)
+        return 0;
+    return std::size_t(std::distance(lexer->begin_pos, begin));
+}
+
+template <typename Iterator>
+inline LexerIterator<Iterator> &LexerIterator<Iterator>::operator ++()
+{
+    *this = lexer->next(this->end, this->skip_nl);
     return *this;
 }
 
 template <typename Iterator>
 inline LexerIterator<Iterator> LexerIterator<Iterator>::operator ++(int)
 {
-    if (this->skip_nl != this->lexer->skip_nl) {
-        this->lexer->skip_nl = this->skip_nl;
-    }
     LexerIterator tmp = *this;
-    *this = lexer->next(this->end);
+    *this = lexer->next(this->end, this->skip_nl);
     return tmp;
 }
 }
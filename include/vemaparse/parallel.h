@@ -0,0 +1,208 @@
+
+#ifndef VEMAPARSE_PARALLEL_H_
+#define VEMAPARSE_PARALLEL_H_
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "lexer.h"
+#include "parser.h"
+
+namespace vemaparse
+{
+
+// Parses a long run of independent top level items on several threads.
+// The input is split after ';' and '}' tokens that are outside any braces,
+// brackets and parentheses, and each chunk is parsed with the grammar's
+// start rule in a context of its own. The start rule has to be *x or
+// x >> *x (which +x is), and the chunks' items are joined into the match a
+// sequential parse would give: *x with all of them, or x >> *x with the
+// first one and a *x with the rest. Other start rules, and inputs where any
+// chunk doesn't parse on its own, are parsed on the calling thread.
+//
+//   vemaparse::ParallelParser<TokenStream::iterator, Node> parser(grammar);
+//   Match *tree = parser.parse(tokens.begin(), tokens.end());
+//
+// Matches stay valid until the next parse() or until the parser is gone.
+template <typename Iterator, typename ActionType>
+class ParallelParser
+{
+public:
+    typedef Match<Iterator, ActionType> match_type;
+    typedef ParseContext<Iterator, ActionType> context_type;
+
+private:
+    const Grammar<Iterator, ActionType> &grammar;
+    unsigned threads;
+    std::vector<std::unique_ptr<context_type>> contexts;
+    // Holds the root, or the whole tree after a fallback.
+    context_type root;
+    std::size_t chunks_;
+    bool fell_back_;
+
+    std::vector<Iterator> split(Iterator begin, Iterator end) const
+    {
+        std::size_t count = 0;
+        for (Iterator iter = begin; iter != end; ++iter)
+            ++count;
+        const std::size_t target = std::max<std::size_t>(count / (threads * chunks_per_thread), min_chunk);
+
+        std::vector<Iterator> ret(1, begin);
+        std::size_t since = 0;
+        int depth = 0;
+        for (Iterator iter = begin; iter != end; ) {
+            const vemalex::Token token = iter.token;
+            bool candidate = false;
+            if (token == vemalex::OPEN_BRACE || token == vemalex::OPEN_BRACKET || token == vemalex::OPEN_PAREN) {
+                ++depth;
+            } else if (token == vemalex::CLOSE_BRACE || token == vemalex::CLOSE_BRACKET || token == vemalex::CLOSE_PAREN) {
+                candidate = --depth == 0 && token == vemalex::CLOSE_BRACE;
+                depth = std::max(depth, 0);
+            } else if (token == vemalex::OPERATOR && depth == 0) {
+                candidate = *iter == ";";
+            }
+            ++iter;
+            ++since;
+            if (candidate && since >= target && iter != end && (!boundary || boundary(iter))) {
+                ret.push_back(iter);
+                since = 0;
+            }
+        }
+        ret.push_back(end);
+        return ret;
+    }
+
+    // Whether the start rule is *x or x >> *x.
+    bool joinable() const
+    {
+        const Rule<Iterator, ActionType> &start = *grammar.start().operator ->();
+        if (start.kind == RuleKind::STAR)
+            return true;
+        return start.kind == RuleKind::SEQUENCE && start.children[1]->kind == RuleKind::STAR &&
+               start.children[1]->children[0]->id == start.children[0]->id;
+    }
+
+    match_type *join(match_type *const *first, match_type *const *last, uint32_t rule, Iterator begin, Iterator end)
+    {
+        const std::size_t mark = root.arena.mark();
+        for (; first != last; ++first)
+            root.arena.push(*first);
+        match_type *ret = root.arena.make(true, end, mark);
+        ret->begin = begin;
+        ret->rule = rule;
+        ret->examined = end.position() + 1;
+        return ret;
+    }
+
+    match_type *parse_sequential(Iterator begin, Iterator end)
+    {
+        chunks_ = 1;
+        return grammar.start()->get_match(root, begin, end);
+    }
+
+public:
+    // Aim for this many chunks per thread, so a slow chunk doesn't hold up
+    // the rest, but no fewer than min_chunk tokens per chunk.
+    std::size_t chunks_per_thread;
+    std::size_t min_chunk;
+    // Optional veto on a split point, given the token the next chunk would
+    // start with (e.g. to keep an "else" with its "if").
+    std::function<bool(const Iterator &)> boundary;
+
+    ParallelParser(const Grammar<Iterator, ActionType> &grammar_, unsigned threads_ = 0)
+        : grammar(grammar_), threads(threads_ ? threads_ : std::max(std::thread::hardware_concurrency(), 1u)),
+          root(grammar_), chunks_(0), fell_back_(false), chunks_per_thread(4), min_chunk(1024)
+    {
+        for (unsigned i = 0; i < threads; ++i)
+            contexts.push_back(std::unique_ptr<context_type>(new context_type(grammar)));
+    }
+
+    match_type *parse(Iterator begin, Iterator end)
+    {
+        root.reset();
+        for (auto iter = contexts.begin(); iter != contexts.end(); ++iter)
+            (*iter)->reset();
+        fell_back_ = false;
+
+        const std::vector<Iterator> points = split(begin, end);
+        chunks_ = points.size() - 1;
+        if (threads < 2 || chunks_ < 2 || !joinable())
+            return parse_sequential(begin, end);
+
+        std::vector<match_type *> results(chunks_);
+        std::vector<std::exception_ptr> errors(threads);
+        std::atomic<std::size_t> next(0);
+        auto work = [&](unsigned worker) {
+            context_type &ctx = *contexts[worker];
+            try {
+                for (std::size_t i = next++; i < results.size(); i = next++) {
+                    // Memo entries depend on where the chunk ends.
+                    ctx.clear_memo();
+                    results[i] = grammar.start()->get_match(ctx, points[i], points[i + 1]);
+                }
+            } catch (...) {
+                errors[worker] = std::current_exception();
+                next = results.size();
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; ++i)
+            pool.push_back(std::thread(work, i));
+        work(0);
+        for (auto iter = pool.begin(); iter != pool.end(); ++iter)
+            iter->join();
+        for (auto iter = errors.begin(); iter != errors.end(); ++iter)
+            if (*iter)
+                std::rethrow_exception(*iter);
+
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            if (!results[i]->matched || results[i]->end != points[i + 1]) {
+                fell_back_ = true;
+                return parse_sequential(begin, end);
+            }
+        }
+
+        const Rule<Iterator, ActionType> &start = *grammar.start().operator ->();
+        const bool star = start.kind == RuleKind::STAR;
+        std::vector<match_type *> items;
+        for (auto chunk = results.begin(); chunk != results.end(); ++chunk) {
+            const match_type &m = **chunk;
+            // A committed first item is left out of the chunk's children,
+            // so the sequence can't be rebuilt.
+            if (!star && m.children.size() != 2) {
+                fell_back_ = true;
+                return parse_sequential(begin, end);
+            }
+            const match_type &rest = star ? m : *m.children[1];
+            if (!star)
+                items.push_back(m.children[0]);
+            for (auto child = rest.children.begin(); child != rest.children.end(); ++child)
+                items.push_back(*child);
+        }
+        if (star)
+            return join(&items[0], &items[0] + items.size(), start.id, begin, end);
+        match_type *seq[] = {items[0], join(&items[1], &items[0] + items.size(), start.children[1]->id, items[0]->end, end)};
+        return join(seq, seq + 2, start.id, begin, end);
+    }
+
+    // Chunks the last parse was split into; 1 if it ran sequentially.
+    std::size_t chunks() const
+    {
+        return chunks_;
+    }
+
+    // Whether a chunk of the last parse failed, so it was parsed again
+    // sequentially.
+    bool fell_back() const
+    {
+        return fell_back_;
+    }
+};
+
+}
+
+#endif
@@ -1,461 +1,1601 @@
-
-#ifndef VEMAPARSE_PARSER_H_
-#define VEMAPARSE_PARSER_H_
-
-#include <tuple>
-#include <functional>
-#include <vector>
-#include <list>
-#include <map>
-#include <deque>
-#include <iterator>
-#include <algorithm>
-#include <memory>
-
-#include <regex>
-
-namespace vemaparse
-{
-
-template <typename Iterator, typename ActionType>
-struct Match : std::enable_shared_from_this<Match<Iterator, ActionType>>
-{
-    typedef std::shared_ptr<Match> match_shared_ptr;
-    bool matched;
-    std::string name;
-    Iterator begin, end;
-    std::function<void(ActionType &)> action;
-    std::deque<match_shared_ptr> children;
-
-    Match(Iterator end_) : matched(false), end(end_) { }
-    Match(bool matched_, Iterator end_) : matched(matched_), end(end_) { }
-
-    match_shared_ptr get_shared_ptr() {return this->shared_from_this();}
-};
-
-template <typename Iterator, typename ActionType>
-std::string to_string(const Match<Iterator, ActionType> &m)
-{
-    std::string ret;
-    std::for_each(m.begin, m.end, [&ret](const std::string &s) {ret += s;});
-    return ret;
-}
-
-template <typename Iterator, typename ActionType> class RuleWrapper;
-
-template <typename Iterator, typename ActionType>
-struct Rule : std::enable_shared_from_this<Rule<Iterator, ActionType>>
-{
-    typedef Match<Iterator, ActionType> match_type;
-    typedef std::shared_ptr<match_type> rule_result;
-    typedef void action_type(ActionType &);
-    typedef bool check_type(const match_type &);
-    typedef Iterator iterator;
-    mutable std::map<Iterator, rule_result> cache;
-
-    std::string name;
-    std::function<action_type> action;
-    std::function<check_type> check;
-    std::function<rule_result(Iterator, Iterator)> match;
-    bool must_consume_token;
-    std::vector<RuleWrapper<Iterator, ActionType>> children;
-
-    Rule() : must_consume_token(true) { }
-    Rule(const std::string name_) : name(name_), must_consume_token(true) { }
-
-    // Use this to break shared_ptr cycles
-    void reset();
-
-    rule_result get_match(Iterator token_pos, Iterator eos) const
-    {
-        if (must_consume_token && token_pos == eos)
-            return std::make_shared<match_type>(eos);
-        if (cache.find(token_pos) != cache.end())
-            return cache[token_pos];
-        rule_result ret;
-        try {
-            // static int depth = 0;
-            // std::fill_n(std::ostream_iterator<char>(std::cout), depth, ' ');
-            // std::cout << depth++ << ":trying " << name << " on \"" << *token_pos << "\"" << std::endl;
-            ret = match(token_pos, eos);
-            // depth--;
-        } catch (const vemalex::LexerError &ex) {
-            std::cerr << "ERROR: " << ex.what() << std::endl;
-            // assert(0);
-            return std::make_shared<match_type>(false, token_pos);
-        }
-        assert(ret->matched || ret->end == token_pos);
-        ret->begin = token_pos;
-        ret->name = name;
-        ret->action = action;
-        if (check) {
-            ret->matched = check(*ret);
-            if (!ret->matched)
-                ret->end = token_pos;
-        }
-        cache[token_pos] = ret;
-        return ret;
-    }
-
-    Rule &operator [](std::function<action_type> callable)
-    {
-        action = callable;
-        return *this;
-    }
-
-    Rule &operator ()(std::function<check_type> callable)
-    {
-        check = callable;
-        return *this;
-    }
-
-    std::shared_ptr<Rule> get_shared_ptr()
-    {
-        return this->shared_from_this();
-    }
-};
-
-template <typename Iterator, typename ActionType>
-class RuleWrapper
-{
-    std::shared_ptr<Rule<Iterator, ActionType>> ptr;
-
-public:
-    typedef Iterator iterator;
-    typedef typename Rule<Iterator, ActionType>::rule_result rule_result;
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    RuleWrapper() { }
-    RuleWrapper(std::shared_ptr<Rule<Iterator, ActionType>> r_) : ptr(r_) { }
-
-    RuleWrapper &operator =(const RuleWrapper &other)
-    {
-        if (this == &other)
-            return *this;
-
-        if (ptr) {
-            ptr->match = other->match;
-            ptr->must_consume_token = other->must_consume_token;
-            ptr->children = other->children;
-            if (other->check)
-                ptr->check = other->check;
-            if (other->action)
-                ptr->action = other->action;
-            if (other->name.size()) {
-                ptr->name = other->name;
-            }
-            return *this;
-        }
-
-        ptr = other.ptr;
-        return *this;
-    }
-
-    Rule<Iterator, ActionType> *operator ->()
-    {
-        assert(ptr);
-        return ptr.get();
-    }
-
-    const Rule<Iterator, ActionType> *operator ->() const
-    {
-        assert(ptr);
-        return ptr.get();
-    }
-
-    template <typename T>
-    RuleWrapper &operator [](T action)
-    {
-        assert(ptr);
-        ptr->action = action;
-        return *this;
-    }
-
-    template <typename T>
-    RuleWrapper &operator ()(T check)
-    {
-        assert(ptr);
-        ptr->check = check;
-        return *this;
-    }
-
-    void reset()
-    {
-        assert(ptr);
-        ptr->reset();
-        ptr.reset();
-    }
-
-    static RuleWrapper create_empty_rule()
-    {
-        return std::make_shared<Rule<Iterator, ActionType>>();
-    }
-
-    static RuleWrapper clone_rule(const RuleWrapper &other)
-    {
-        return RuleWrapper(std::make_shared<Rule<Iterator, ActionType>>(*other.ptr));
-    }
-};
-
-template <typename Iterator, typename ActionType>
-inline void Rule<Iterator, ActionType>::reset()
-{
-    name = "";
-    action = std::function<action_type>();
-    check = std::function<check_type>();
-    match = std::function<rule_result(Iterator, Iterator)>();
-    // Don't want to recurse, so make a copy and then clear children before iterating.
-    auto children_copy = children;
-    children.clear();
-    for (auto iter = children_copy.begin(); iter != children_copy.end(); ++iter) {
-        (*iter)->reset();
-    }
-}
-
-// This walks children who have not matched, and therefore end hasn't
-// propagated, therefore it's necessary to go get it.
-template <typename Iterator, typename ActionType>
-Match<Iterator, ActionType> right_most(Match<Iterator, ActionType> &m)
-{
-    if (m.children.empty())
-        return m;
-    return right_most(*m.children.back().get());
-}
-
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> regex(const std::string &regex_string)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("regex"));
-    std::regex re = std::regex(regex_string);
-    rule->match = [re](Iterator token_pos, Iterator) -> typename Rule<Iterator, ActionType>::rule_result { 
-        std::string token_string = *token_pos;
-        bool matched = std::regex_match(token_string, re);
-        return std::make_shared<match_type>(matched, matched ? ++token_pos : token_pos);
-    };
-    return rule;
-}
-
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> terminal(int id)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("terminal"));
-    rule->match = [id](Iterator token_pos, Iterator) -> typename Rule<Iterator, ActionType>::rule_result {
-        bool matched = (token_pos.token == id);
-        return std::make_shared<match_type>(matched, matched ? ++token_pos : token_pos);
-    };
-    return rule;
-}
-
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> newline(RuleWrapper<Iterator, ActionType> first)
-{
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("newline"));
-    rule->match = [first](Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result {
-        token_pos.start_newline();
-        auto ret = first->get_match(token_pos, eos);
-        ret->end.stop_newline();
-        return ret;
-    };
-    rule->children.push_back(first);
-    return rule;
-}
-
-// non-terminals propagate info from their children
-template <typename Iterator, typename ActionType>
-void propagate_child_info(Match<Iterator, ActionType> &ret, std::shared_ptr<Match<Iterator, ActionType>> child)
-{
-    ret.matched = child->matched;
-    ret.end = child->end;
-    ret.children.push_back(child->get_shared_ptr());
-}
-
-// Ordering this >> that
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> operator >>(RuleWrapper<Iterator, ActionType> first, 
-                                              RuleWrapper<Iterator, ActionType> second)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("order"));
-    rule->must_consume_token = first->must_consume_token || second->must_consume_token;
-    rule->match = [first, second](Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
-    {
-        typename Rule<Iterator, ActionType>::match_type ret(eos);
-        typename Rule<Iterator, ActionType>::rule_result tmp = first->get_match(token_pos, eos);
-        propagate_child_info(ret, tmp);
-        if (tmp->matched) {
-            tmp = second->get_match(tmp->end, eos);
-            propagate_child_info(ret, tmp);
-            if (!tmp->matched) {
-                ret.end = token_pos;
-            }
-        }
-        return std::make_shared<match_type>(ret);
-    };
-    rule->children.push_back(first);
-    rule->children.push_back(second);
-    return rule;
-}
-
-// Select this | that
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> operator |(RuleWrapper<Iterator, ActionType> first, 
-                                             RuleWrapper<Iterator, ActionType> second)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("or"));
-    rule->must_consume_token = first->must_consume_token || second->must_consume_token;
-    rule->match = [first, second](Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
-    { 
-        typename Rule<Iterator, ActionType>::match_type ret(eos);
-        typename Rule<Iterator, ActionType>::rule_result tmpl, tmpr;
-        tmpl = first->get_match(token_pos, eos);
-        // TODO: if both fail should we propagate all the child info? 
-        // Just the failure with the most children?
-        if (tmpl->matched) {
-            propagate_child_info(ret, tmpl);
-            return std::make_shared<match_type>(ret);
-        }
-        tmpr = second->get_match(token_pos, eos);
-        if (tmpr->matched) {
-            propagate_child_info(ret, tmpr);
-            return std::make_shared<match_type>(ret);
-        }
-
-        // Didn't match, see which match got further
-        typename Iterator::difference_type ld = right_most(*tmpl).end - token_pos;
-        typename Iterator::difference_type lr = right_most(*tmpr).end - token_pos;
-        if (ld < lr) {
-            propagate_child_info(ret, tmpr);
-        } else {
-            propagate_child_info(ret, tmpl);
-        }
-        return std::make_shared<match_type>(ret);
-    };
-    rule->children.push_back(first);
-    rule->children.push_back(second);
-    return rule;
-}
-
-// Kleene Star
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> operator *(RuleWrapper<Iterator, ActionType> first)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>(std::string("kleene->")+first->name));
-    rule->must_consume_token = false;
-    rule->match = [first](Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
-    {
-        typename Rule<Iterator, ActionType>::match_type ret(eos);
-        typename Rule<Iterator, ActionType>::rule_result tmp;
-        ret.end = token_pos;
-        Iterator tmp_pos = token_pos;
-        bool tmp_matched = true;
-        while (tmp_pos != eos && tmp_matched) {
-            tmp = first->get_match(tmp_pos, eos);
-            propagate_child_info(ret, tmp);
-            tmp_pos = tmp->end;
-            tmp_matched = tmp->matched;
-        }
-        ret.matched = true;
-        return std::make_shared<match_type>(ret);
-    };
-    rule->children.push_back(first);
-    return rule;
-}
-
-// Non-greedy kleene star
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> operator /(RuleWrapper<Iterator, ActionType> first, 
-                                             RuleWrapper<Iterator, ActionType> second)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("non-greedy kleene"));
-    rule->must_consume_token = first->must_consume_token || second->must_consume_token;
-    rule->match = [first, second](Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
-    {
-        typename Rule<Iterator, ActionType>::match_type ret(eos);
-        typename Rule<Iterator, ActionType>::rule_result tmp;
-        ret.matched = true;
-        bool matched_right_side = false;
-        Iterator tmp_pos = token_pos;
-        while (tmp_pos != eos) {
-            Iterator start_pos = tmp_pos;
-            tmp = second->get_match(start_pos, eos);
-            if (tmp->matched) {
-                propagate_child_info(ret, tmp);
-                matched_right_side = true;
-                break;
-            }
-            tmp = first->get_match(start_pos, eos);
-            tmp_pos = tmp->end;
-            propagate_child_info(ret, tmp);
-            // Optional or star can return true, but didn't consume anything.
-            // That means we'll loop forever.
-            if (!tmp->matched || (tmp->end == start_pos)) {
-                break;
-            }
-        }
-        if (!matched_right_side) {
-            ret.matched = false;
-            ret.end = token_pos;
-        }
-        return std::make_shared<match_type>(ret);
-    };
-    rule->children.push_back(first);
-    rule->children.push_back(second);
-    return rule;
-}
-
-// Optional this?
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> operator -(RuleWrapper<Iterator, ActionType> first)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("optional"));
-    rule->must_consume_token = false;
-    rule->match = [first](Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
-    {
-        typename Rule<Iterator, ActionType>::match_type ret(eos);
-        if (token_pos == eos)
-            return std::make_shared<match_type>(ret);
-        typename Rule<Iterator, ActionType>::rule_result tmp = first->get_match(token_pos, eos);
-        propagate_child_info(ret, tmp);
-        assert(ret.matched || (tmp->end == token_pos));
-        ret.matched = true;
-        return std::make_shared<match_type>(ret);
-    };
-    rule->children.push_back(first);
-    return rule;
-}
-
-// 1 or more
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> operator +(RuleWrapper<Iterator, ActionType> first)
-{
-    return (first >> (*first));
-}
-
-// Not
-template <typename Iterator, typename ActionType>
-RuleWrapper<Iterator, ActionType> operator !(RuleWrapper<Iterator, ActionType> first)
-{
-    typedef typename Rule<Iterator, ActionType>::match_type match_type;
-    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("not"));
-    rule->match = [first](Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
-    {
-        typename Rule<Iterator, ActionType>::match_type ret(eos);
-        if (token_pos == eos)
-            return std::make_shared<match_type>(ret);
-        typename Rule<Iterator, ActionType>::rule_result tmp = first->get_match(token_pos, eos);
-        const bool matched = !tmp->matched;
-        return std::make_shared<match_type>(matched, matched ? ++token_pos : token_pos);
-    };
-    rule->children.push_back(first);
-    return rule;
-}
-
-}
-
-#endif
-
+
+#ifndef VEMAPARSE_PARSER_H_
+#define VEMAPARSE_PARSER_H_
+
+#include <tuple>
+#include <functional>
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <iterator>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <set>
+#include <unordered_map>
+#include <cstring>
+#include <type_traits>
+#include <stdexcept>
+#include <string>
+#include <cassert>
+#include <stdint.h>
+
+#include <regex>
+
+#include "lexer.h"
+#include "events.h"
+
+#ifdef VEMAPARSE_PROFILE
+#include "profile.h"
+#endif
+
+namespace vemaparse
+{
+
+// A contiguous run of child pointers owned by a MatchArena.
+template <typename T>
+struct MatchChildren
+{
+    T **first;
+    uint32_t count;
+
+    MatchChildren() : first(NULL), count(0) { }
+    MatchChildren(T **first_, uint32_t count_) : first(first_), count(count_) { }
+
+    T **begin() const {return first;}
+    T **end() const {return first + count;}
+    T *front() const {assert(count); return first[0];}
+    T *back() const {assert(count); return first[count - 1];}
+    T *operator [](std::size_t i) const {assert(i < count); return first[i];}
+    std::size_t size() const {return count;}
+    bool empty() const {return count == 0;}
+};
+
+// Matches are plain records allocated from the parse's MatchArena and live
+// as long as it. The rule's name and action are looked up through the
+// Grammar by rule id.
+template <typename Iterator, typename ActionType>
+struct Match
+{
+    typedef Match *match_ptr;
+    static const uint32_t no_rule = ~uint32_t(0);
+
+    bool matched;
+    // Stands in for a subtree already handed to ParseContext::on_commit;
+    // parents don't keep it as a child.
+    bool committed;
+    // In the memo table, where ParseContext::splice finds it.
+    bool memoized;
+    uint32_t rule;
+    Iterator begin, end;
+    // One past the last position looked at to produce this match, counting
+    // the position end is at. An edit after it can't change the result.
+    std::size_t examined;
+    MatchChildren<Match> children;
+
+    Match(Iterator end_) : matched(false), committed(false), memoized(false), rule(no_rule), end(end_), examined(0) { }
+    Match(bool matched_, Iterator end_)
+        : matched(matched_), committed(false), memoized(false), rule(no_rule), end(end_), examined(0) { }
+};
+
+template <typename Iterator, typename ActionType>
+std::string to_string(const Match<Iterator, ActionType> &m)
+{
+    std::string ret;
+    for (Iterator iter = m.begin; iter != m.end; ++iter) {
+        auto text = *iter;
+        ret.append(text.begin(), text.end());
+    }
+    return ret;
+}
+
+template <typename Iterator, typename ActionType> class RuleWrapper;
+template <typename Iterator, typename ActionType> class Grammar;
+
+// Packrat memo keyed by (rule id, position). Positions come from
+// Iterator::position(). When the number of positions is known up front and
+// the table is small enough it is a dense array laid out position-major, so
+// all rules tried at one position share cache lines; otherwise it is an
+// open-addressing hash table. An empty handle means "not computed yet".
+template <typename Handle>
+class MemoTable
+{
+    struct Slot
+    {
+        uint64_t key;
+        Handle value;
+    };
+
+    static const uint64_t empty_key = ~uint64_t(0);
+
+    std::size_t num_rules;
+    std::vector<Handle> dense;
+    std::vector<Slot> sparse;
+    std::size_t sparse_size;
+    // Range of dense positions written since the last clear().
+    std::size_t dirty_begin, dirty_end;
+
+    std::size_t probe(uint64_t key) const
+    {
+        // Fibonacci hashing; sparse.size() is a power of two.
+        const std::size_t mask = sparse.size() - 1;
+        std::size_t i = std::size_t((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+        while (sparse[i].key != key && sparse[i].key != empty_key)
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old;
+        old.swap(sparse);
+        Slot empty = {empty_key, Handle()};
+        sparse.assign(old.empty() ? 1024 : old.size() * 2, empty);
+        for (auto iter = old.begin(); iter != old.end(); ++iter)
+            if (iter->key != empty_key)
+                sparse[probe(iter->key)] = *iter;
+    }
+
+public:
+    // Tables with more entries than this use the hash table.
+    static const std::size_t dense_limit = std::size_t(1) << 22;
+
+    MemoTable(std::size_t num_rules_ = 0, std::size_t num_positions = 0)
+        : num_rules(num_rules_), sparse_size(0), dirty_begin(~std::size_t(0)), dirty_end(0)
+    {
+        reset(num_positions);
+    }
+
+    // Forget every entry and size the table for num_positions positions.
+    void reset(std::size_t num_positions)
+    {
+        clear();
+        const std::size_t size = num_positions && num_rules && num_positions <= dense_limit / num_rules ? num_positions * num_rules : 0;
+        if (size != dense.size())
+            std::vector<Handle>(size).swap(dense);
+    }
+
+    const Handle *find(uint32_t rule, std::size_t position) const
+    {
+        if (!dense.empty()) {
+            const std::size_t i = position * num_rules + rule;
+            if (i < dense.size())
+                return dense[i] ? &dense[i] : NULL;
+        }
+        if (sparse.empty())
+            return NULL;
+        const Slot &slot = sparse[probe(uint64_t(position) * num_rules + rule)];
+        return slot.key == empty_key ? NULL : &slot.value;
+    }
+
+    void insert(uint32_t rule, std::size_t position, const Handle &value)
+    {
+        if (!dense.empty()) {
+            const std::size_t i = position * num_rules + rule;
+            if (i < dense.size()) {
+                dense[i] = value;
+                dirty_begin = std::min(dirty_begin, position);
+                dirty_end = std::max(dirty_end, position + 1);
+                return;
+            }
+        }
+        if ((sparse_size + 1) * 2 > sparse.size())
+            grow();
+        const uint64_t key = uint64_t(position) * num_rules + rule;
+        Slot &slot = sparse[probe(key)];
+        if (slot.key == empty_key) {
+            slot.key = key;
+            ++sparse_size;
+        }
+        slot.value = value;
+    }
+
+    // Forget every entry. Only the part of the table written since the
+    // last clear is touched, and the hash table keeps its capacity.
+    void clear()
+    {
+        if (dirty_begin < dirty_end)
+            std::fill(dense.begin() + dirty_begin * num_rules, dense.begin() + dirty_end * num_rules, Handle());
+        dirty_begin = ~std::size_t(0);
+        dirty_end = 0;
+        if (sparse_size) {
+            Slot empty = {empty_key, Handle()};
+            std::fill(sparse.begin(), sparse.end(), empty);
+            sparse_size = 0;
+        }
+    }
+
+    // Positions [first, first + removed) were replaced by inserted new ones.
+    // Their entries are dropped and later entries move with their
+    // positions. keep(handle, old_position) is called for every other
+    // entry and decides whether it stays.
+    template <typename Keep>
+    void splice(std::size_t first, std::size_t removed, std::size_t inserted, Keep keep)
+    {
+        const std::size_t after = first + removed;
+        std::vector<Slot> entries;
+        if (sparse_size) {
+            entries.reserve(sparse_size);
+            for (auto iter = sparse.begin(); iter != sparse.end(); ++iter)
+                if (iter->key != empty_key)
+                    entries.push_back(*iter);
+            Slot empty = {empty_key, Handle()};
+            std::fill(sparse.begin(), sparse.end(), empty);
+            sparse_size = 0;
+        }
+
+        if (!dense.empty()) {
+            for (std::size_t position = dirty_begin; position < dirty_end; ++position) {
+                Handle *values = &dense[position * num_rules];
+                if (position >= first && position < after) {
+                    std::fill_n(values, num_rules, Handle());
+                    continue;
+                }
+                for (std::size_t rule = 0; rule < num_rules; ++rule)
+                    if (values[rule] && !keep(values[rule], position))
+                        values[rule] = Handle();
+            }
+            dirty_begin = std::min(dirty_begin, first);
+            dirty_end = dirty_end > after ? dirty_end - removed + inserted : std::min(dirty_end, first);
+
+            // Move the positions after the edit up or down in place.
+            const std::size_t positions = dense.size() / num_rules - removed + inserted;
+            if (positions > dense_limit / num_rules) {
+                std::vector<Handle> old;
+                old.swap(dense);
+                for (std::size_t i = 0; i < old.size(); ++i) {
+                    if (old[i]) {
+                        const std::size_t position = i / num_rules;
+                        insert(uint32_t(i % num_rules), position < first ? position : position - removed + inserted, old[i]);
+                    }
+                }
+                dirty_begin = ~std::size_t(0);
+                dirty_end = 0;
+            } else if (inserted > removed) {
+                const std::size_t old_end = dense.size();
+                dense.resize(positions * num_rules);
+                std::copy_backward(dense.begin() + after * num_rules, dense.begin() + old_end, dense.end());
+                std::fill(dense.begin() + after * num_rules, dense.begin() + (first + inserted) * num_rules, Handle());
+            } else if (inserted < removed) {
+                std::copy(dense.begin() + after * num_rules, dense.end(), dense.begin() + (first + inserted) * num_rules);
+                dense.resize(positions * num_rules);
+            }
+        }
+
+        for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
+            std::size_t position = std::size_t(iter->key / num_rules);
+            if (position >= first && position < after)
+                continue;
+            if (!keep(iter->value, position))
+                continue;
+            if (position >= after)
+                position = position - removed + inserted;
+            insert(uint32_t(iter->key % num_rules), position, iter->value);
+        }
+    }
+};
+
+// Bump allocator for the Match records of one parse and their child
+// arrays. Nothing is freed individually; clear() and the destructor drop
+// the whole tree at once.
+template <typename Iterator, typename ActionType>
+class MatchArena
+{
+public:
+    typedef Match<Iterator, ActionType> match_type;
+
+private:
+    static_assert(std::is_trivially_destructible<match_type>::value, "Match records are never destroyed");
+
+    static const std::size_t block_size = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cur;
+    std::size_t left;
+    std::size_t total;
+    // Children of the matches still being built, innermost last.
+    std::vector<match_type *> scratch;
+
+    void *allocate(std::size_t size, std::size_t align)
+    {
+        std::size_t pad = std::size_t(-reinterpret_cast<uintptr_t>(cur)) & (align - 1);
+        if (pad + size > left) {
+            const std::size_t n = size + align > block_size ? size + align : block_size;
+            blocks.push_back(std::unique_ptr<char[]>(new char[n]));
+            cur = blocks.back().get();
+            left = n;
+            pad = std::size_t(-reinterpret_cast<uintptr_t>(cur)) & (align - 1);
+        }
+        void *ret = cur + pad;
+        cur += pad + size;
+        left -= pad + size;
+        total += size;
+        return ret;
+    }
+
+public:
+    // Allocation point that rewind() can return to.
+    struct State
+    {
+        std::size_t blocks;
+        char *cur;
+        std::size_t left;
+        std::size_t total;
+    };
+
+    // Whether make() gives matches the children pushed for them. Without,
+    // every match is a single record, and ParseContext::events is the only
+    // record of the tree; checks then see no children.
+    bool keep_children;
+
+    MatchArena() : cur(NULL), left(0), total(0), keep_children(true) { }
+    MatchArena(const MatchArena &) = delete;
+    MatchArena &operator =(const MatchArena &) = delete;
+
+    std::size_t mark() const
+    {
+        return scratch.size();
+    }
+
+    void push(match_type *child)
+    {
+        if (keep_children)
+            scratch.push_back(child);
+    }
+
+    // New match whose children are everything pushed since mark.
+    match_type *make(bool matched, Iterator end, std::size_t mark)
+    {
+        assert(mark <= scratch.size());
+        match_type *ret = new (allocate(sizeof(match_type), alignof(match_type))) match_type(matched, end);
+        const std::size_t count = scratch.size() - mark;
+        if (count) {
+            match_type **children = static_cast<match_type **>(allocate(count * sizeof(match_type *), alignof(match_type *)));
+            std::copy(scratch.begin() + mark, scratch.end(), children);
+            ret->children = MatchChildren<match_type>(children, uint32_t(count));
+            scratch.resize(mark);
+        }
+        return ret;
+    }
+
+    match_type *make(bool matched, Iterator end)
+    {
+        return make(matched, end, scratch.size());
+    }
+
+    // Bytes handed out so far.
+    std::size_t size() const
+    {
+        return total;
+    }
+
+    State state() const
+    {
+        State ret = {blocks.size(), cur, left, total};
+        return ret;
+    }
+
+    // Release every record allocated since state was taken.
+    void rewind(const State &state)
+    {
+        assert(state.blocks <= blocks.size());
+        blocks.resize(state.blocks);
+        cur = state.cur;
+        left = state.left;
+        total = state.total;
+    }
+
+    void clear()
+    {
+        blocks.clear();
+        scratch.clear();
+        cur = NULL;
+        left = total = 0;
+    }
+};
+
+// Matches and memo hits per rule id in a parse, for Grammar::tune. Set
+// ParseContext::memo_profile to collect them.
+struct MemoProfile
+{
+    std::vector<uint64_t> matches;
+    std::vector<uint64_t> hits;
+
+    explicit MemoProfile(std::size_t num_rules) : matches(num_rules), hits(num_rules) { }
+};
+
+// Everything a parse changes: the memo tables, the matches and the lookahead
+// being tracked. Pass the number of positions (e.g. TokenStream::size() + 1)
+// to get a dense memo table. Matches returned by get_match are owned by the
+// context. Use one context per thread; reset() it to parse another input.
+template <typename Iterator, typename ActionType>
+struct ParseContext
+{
+    typedef Match<Iterator, ActionType> match_type;
+    typedef match_type *rule_result;
+    MemoTable<rule_result> memo;
+    // Iterators in newline mode don't skip newline tokens, so rules matched
+    // in that mode are memoized apart from the rest.
+    MemoTable<rule_result> newline_memo;
+    MatchArena<Iterator, ActionType> arena;
+    // Called with each subtree completed by a cut(). When set, the subtree
+    // is released afterwards instead of being kept in the parse tree.
+    std::function<void(match_type &)> on_commit;
+    // Every match is logged to it as it is made when set; see EventLog.
+    EventLog *events;
+    match_type committed;
+    // Match::examined of the rule being matched, so far.
+    std::size_t examined;
+    // The farthest position a rule without children (a token) failed at,
+    // and the ids of the ones that did, in the order they were tried. With
+    // nothing failed yet, expected is empty.
+    std::size_t farthest_failure;
+    std::vector<uint32_t> expected;
+    // What the last vemalex::LexerError thrown while matching said, or empty.
+    // The rule that was being matched fails instead.
+    std::string lexer_error;
+    // Counted into when set; kept by reset().
+    MemoProfile *memo_profile;
+#ifdef VEMAPARSE_PROFILE
+    // Likewise.
+    Profiler *profiler;
+#endif
+
+    // grammar is anything that gives its number of rules as size(), e.g. a
+    // Grammar or a fixed::Grammar.
+    template <typename GrammarType>
+    ParseContext(const GrammarType &grammar, std::size_t num_positions = 0)
+        : memo(grammar.size(), num_positions), newline_memo(grammar.size()), events(NULL), committed(Iterator()),
+          examined(0), farthest_failure(0), memo_profile(NULL), event_floor(0)
+    {
+#ifdef VEMAPARSE_PROFILE
+        profiler = NULL;
+#endif
+    }
+
+    MemoTable<rule_result> &memo_for(const Iterator &pos)
+    {
+        return pos.newline() ? newline_memo : memo;
+    }
+
+    // Drop every memo entry but keep the matches.
+    void clear_memo()
+    {
+        memo.clear();
+        newline_memo.clear();
+        saved_events.clear();
+        spans.clear();
+        logged.clear();
+    }
+
+    // Drop everything from earlier parses, keeping the allocated capacity,
+    // and size the memo for num_positions positions. on_commit and events
+    // are kept.
+    void reset(std::size_t num_positions = 0)
+    {
+        memo.reset(num_positions);
+        newline_memo.clear();
+        saved_events.clear();
+        spans.clear();
+        logged.clear();
+        event_floor = 0;
+        arena.clear();
+        committed = match_type(Iterator());
+        examined = 0;
+        farthest_failure = 0;
+        expected.clear();
+        lexer_error.clear();
+    }
+
+    // Token rule failed at position.
+    void expect(uint32_t rule, std::size_t position)
+    {
+        if (position < farthest_failure || rule == match_type::no_rule)
+            return;
+        if (position > farthest_failure) {
+            farthest_failure = position;
+            expected.clear();
+        }
+        if (std::find(expected.begin(), expected.end(), rule) == expected.end())
+            expected.push_back(rule);
+    }
+
+    // Each of rules failed at position, e.g. the token rules an alternative
+    // that wasn't tried there could have started with (FirstSet::rules).
+    void expect(const std::vector<uint32_t> &rules, std::size_t position)
+    {
+        for (auto iter = rules.begin(); iter != rules.end(); ++iter)
+            expect(*iter, position);
+    }
+
+    // Nothing before m->end will be looked at again. Drops the memo and,
+    // with an on_commit callback or an event log, hands m over (its events
+    // are already logged and now stay), frees everything allocated since
+    // state and returns a stand-in for it.
+    rule_result commit(rule_result m, const typename MatchArena<Iterator, ActionType>::State &state)
+    {
+        clear_memo();
+        if (!on_commit && !events)
+            return m;
+        if (events)
+            event_floor = events->size();
+        if (on_commit)
+            on_commit(*m);
+        const Iterator end = m->end;
+        arena.rewind(state);
+        committed = match_type(true, end);
+        committed.committed = true;
+        return &committed;
+    }
+
+    // Get ready to parse again after the positions [first, first + removed)
+    // were replaced by inserted new ones, e.g. as reported by
+    // TokenStream::edit. Entries that looked at the replaced positions are
+    // dropped; the ones after them are moved along, which needs
+    // Iterator::shift(). The arena keeps the dropped matches until reset().
+    // The farthest failure is forgotten, as the rules answered from the memo
+    // won't report theirs again. With events set the whole memo is dropped,
+    // as memo hits log their events again from the last parse's log.
+    void splice(std::size_t first, std::size_t removed, std::size_t inserted)
+    {
+        farthest_failure = 0;
+        expected.clear();
+        if (events) {
+            clear_memo();
+            return;
+        }
+        const std::ptrdiff_t delta = std::ptrdiff_t(inserted) - std::ptrdiff_t(removed);
+        auto keep = [first, delta](rule_result m, std::size_t position) -> bool {
+            if (position < first)
+                return m->examined <= first;
+            if (delta)
+                ParseContext::shift(m, delta);
+            return true;
+        };
+        memo.splice(first, removed, inserted, keep);
+        newline_memo.splice(first, removed, inserted, keep);
+    }
+
+    // Logging to events, by get_match and the like: log_enter() when a rule
+    // starts matching, log_leave() with its finished match, which logs it or
+    // takes back everything since, and log_hit() for a match from the memo.
+    std::size_t log_enter(uint32_t rule, std::size_t position)
+    {
+        return events ? events->open(rule, uint32_t(position)) : 0;
+    }
+
+    void log_leave(std::size_t at, rule_result m)
+    {
+        if (!events)
+            return;
+        if (m->matched && m->end != m->begin) {
+            events->close(at, uint32_t(m->end.position()));
+            if (m->memoized) {
+                const EventSpan span = {at, events->size() - at, false};
+                spans[m] = span;
+                logged.push_back(m);
+            }
+            return;
+        }
+        if (at >= event_floor) {
+            take_back(at);
+            return;
+        }
+        // Failed around committed subtrees, which stay. Close it after them
+        // so the log stays balanced.
+        take_back(event_floor);
+        events->close(at, (*events)[events->size() - 1].end);
+    }
+
+    void log_hit(const match_type &m)
+    {
+        if (!events || !m.matched || m.end == m.begin)
+            return;
+        const auto iter = spans.find(&m);
+        if (iter == spans.end())
+            return;
+        const EventSpan &span = iter->second;
+        if (span.saved)
+            events->append(&saved_events[span.first], &saved_events[span.first] + span.count);
+        else
+            events->repeat(span.first, span.count);
+    }
+
+private:
+    // Where the events of a memoized match are: count of them from first
+    // in the log, or in saved_events once they were taken back.
+    struct EventSpan
+    {
+        std::size_t first, count;
+        bool saved;
+    };
+
+    // Events of memoized matches that were taken back, for memo hits, the
+    // spans of all logged memoized matches, and the ones whose events are
+    // still in the log, in the order they were logged. Events before
+    // event_floor were committed.
+    std::vector<Event> saved_events;
+    std::unordered_map<const match_type *, EventSpan> spans;
+    std::vector<const match_type *> logged;
+    std::size_t event_floor;
+
+    // Truncate the log to mark, first saving the events of the memoized
+    // matches logged since. Those that were logged later contain the
+    // earlier ones or come after them, so going backwards each one is
+    // either inside the last range saved or needs a new one.
+    void take_back(std::size_t mark)
+    {
+        std::size_t first = logged.size();
+        while (first && spans[logged[first - 1]].first >= mark)
+            --first;
+        std::size_t begin = 0, end = 0, base = 0;
+        for (std::size_t i = logged.size(); i-- > first;) {
+            EventSpan &span = spans[logged[i]];
+            if (span.first < begin || span.first + span.count > end) {
+                begin = span.first;
+                end = begin + span.count;
+                base = saved_events.size();
+                saved_events.insert(saved_events.end(), events->begin() + begin, events->begin() + end);
+            }
+            span.first = base + (span.first - begin);
+            span.saved = true;
+        }
+        logged.resize(first);
+        events->truncate(mark);
+    }
+
+    // Memoized children are in the table themselves and get moved there.
+    static void shift(rule_result m, std::ptrdiff_t delta)
+    {
+        m->begin.shift(delta);
+        m->end.shift(delta);
+        m->examined = std::size_t(std::ptrdiff_t(m->examined) + delta);
+        for (auto iter = m->children.begin(); iter != m->children.end(); ++iter)
+            if (!(*iter)->memoized)
+                shift(*iter, delta);
+    }
+};
+
+// Collects a non-terminal's children in the arena as they are matched.
+template <typename Iterator, typename ActionType>
+struct MatchBuilder
+{
+    MatchArena<Iterator, ActionType> &arena;
+    std::size_t mark;
+    bool matched;
+    Iterator end;
+
+    MatchBuilder(ParseContext<Iterator, ActionType> &ctx, Iterator end_)
+        : arena(ctx.arena), mark(ctx.arena.mark()), matched(false), end(end_) { }
+
+    Match<Iterator, ActionType> *finish()
+    {
+        return arena.make(matched, end, mark);
+    }
+};
+
+// What a rule's match does, so it can be analyzed (see FirstSet) and run by
+// a Program (vm.h) without calling it. Anything else, e.g. a hand written
+// match, is CUSTOM.
+struct RuleKind
+{
+    enum Kind
+    {
+        CUSTOM,
+        SEQUENCE,       // children[0] >> children[1]
+        CHOICE,         // children[0] | children[1]
+        STAR,           // *children[0]
+        NON_GREEDY,     // children[0] / children[1]
+        OPTIONAL,       // -children[0]
+        NOT,            // !children[0]
+        TERMINAL,       // token kind == token
+        LITERAL         // token text == text
+    };
+};
+
+// Whether a rule's matches go in the memo table. MEMO_AUTO memoizes all but
+// single token rules, which are cheaper to match again than to look up, and
+// lets Grammar::tune turn it off for rules whose entries are rarely reused.
+enum MemoPolicy
+{
+    MEMO_AUTO,
+    MEMO_ALWAYS,
+    MEMO_NEVER
+};
+
+inline bool memoize_by_default(RuleKind::Kind kind)
+{
+    return kind != RuleKind::TERMINAL && kind != RuleKind::LITERAL;
+}
+
+// The tokens a rule's match can start with: any token kind in kinds or
+// token text in texts, or with any set, anything. A nullable rule can also
+// match nothing. A rule that is neither can't match at a token outside its
+// set, so choices don't try it there.
+struct FirstSet
+{
+    static const int max_kinds = 64;
+
+    bool nullable;
+    bool any;
+    uint64_t kinds;
+    std::vector<std::string> texts;
+    // The ids of the terminal and literal rules behind kinds and texts, in
+    // order, which are reported as expected where the rule isn't tried.
+    std::vector<uint32_t> rules;
+
+    // Until the grammar has been analyzed, a rule can start with anything.
+    FirstSet() : nullable(false), any(true), kinds(0) { }
+
+    template <typename Iterator>
+    bool may_start(const Iterator &pos, const Iterator &eos) const
+    {
+        if (any || nullable || pos == eos)
+            return true;
+        if (unsigned(pos.token) < unsigned(max_kinds) && (kinds >> pos.token & 1))
+            return true;
+        if (texts.empty())
+            return false;
+        const auto text = *pos;
+        for (auto iter = texts.begin(); iter != texts.end(); ++iter)
+            if (text.equals(iter->data(), iter->size()))
+                return true;
+        return false;
+    }
+
+    // Add other's tokens; true if that changed anything.
+    bool merge(const FirstSet &other)
+    {
+        const FirstSet before = *this;
+        any = any || other.any;
+        kinds |= other.kinds;
+        for (auto iter = other.texts.begin(); iter != other.texts.end(); ++iter)
+            if (std::find(texts.begin(), texts.end(), *iter) == texts.end())
+                texts.push_back(*iter);
+        for (auto iter = other.rules.begin(); iter != other.rules.end(); ++iter) {
+            const auto pos = std::lower_bound(rules.begin(), rules.end(), *iter);
+            if (pos == rules.end() || *pos != *iter)
+                rules.insert(pos, *iter);
+        }
+        return any != before.any || kinds != before.kinds || texts.size() != before.texts.size() ||
+               rules.size() != before.rules.size();
+    }
+};
+
+// A rule as the analysis sees it: what Rule's kind, token, text and
+// must_consume_token say, and its children by id.
+struct RuleSummary
+{
+    RuleKind::Kind kind;
+    bool must_consume_token;
+    int token;
+    std::string text;
+    std::vector<uint32_t> children;
+};
+
+// First sets and nullability of every rule, by id, worked out by repeating
+// until nothing changes.
+inline std::vector<FirstSet> first_sets(const std::vector<RuleSummary> &rules)
+{
+    std::vector<FirstSet> ret(rules.size());
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+        const RuleSummary &rule = rules[i];
+        FirstSet &set = ret[i];
+        set.any = false;
+        switch (rule.kind) {
+        case RuleKind::TERMINAL:
+            if (unsigned(rule.token) < unsigned(FirstSet::max_kinds))
+                set.kinds = uint64_t(1) << rule.token;
+            else
+                set.any = true;
+            set.rules.push_back(uint32_t(i));
+            break;
+        case RuleKind::LITERAL:
+            set.texts.push_back(rule.text);
+            set.rules.push_back(uint32_t(i));
+            break;
+        case RuleKind::STAR:
+        case RuleKind::OPTIONAL:
+            set.nullable = true;
+            break;
+        case RuleKind::SEQUENCE:
+        case RuleKind::CHOICE:
+        case RuleKind::NON_GREEDY:
+            break;
+        default:
+            // NOT takes any token a doesn't start; custom rules are unknown.
+            set.any = true;
+            set.nullable = !rule.must_consume_token;
+            break;
+        }
+    }
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (std::size_t i = 0; i < rules.size(); ++i) {
+            const RuleSummary &rule = rules[i];
+            FirstSet &set = ret[i];
+            if (rule.kind == RuleKind::STAR || rule.kind == RuleKind::OPTIONAL) {
+                changed |= set.merge(ret[rule.children[0]]);
+            } else if (rule.kind == RuleKind::SEQUENCE) {
+                const FirstSet &a = ret[rule.children[0]], &b = ret[rule.children[1]];
+                changed |= set.merge(a);
+                if (a.nullable)
+                    changed |= set.merge(b);
+                if (!set.nullable && a.nullable && b.nullable)
+                    changed = set.nullable = true;
+            } else if (rule.kind == RuleKind::CHOICE || rule.kind == RuleKind::NON_GREEDY) {
+                // a / b ends with b, or starts with a consuming something.
+                const FirstSet &a = ret[rule.children[0]], &b = ret[rule.children[1]];
+                changed |= set.merge(a);
+                changed |= set.merge(b);
+                const bool nullable = rule.kind == RuleKind::CHOICE ? a.nullable || b.nullable : b.nullable;
+                if (!set.nullable && nullable)
+                    changed = set.nullable = true;
+            }
+        }
+    }
+    return ret;
+}
+
+namespace detail
+{
+#ifdef VEMAPARSE_PROFILE
+    // One get_match call, counted into ParseContext::profiler if it's set
+    // and the rule is part of a grammar.
+    struct ProfileCall
+    {
+        Profiler *profiler;
+        uint32_t rule;
+        Profiler::Call call;
+
+        template <typename Context>
+        ProfileCall(Context &ctx, uint32_t rule_) : profiler(rule_ != ~uint32_t(0) ? ctx.profiler : NULL), rule(rule_) { }
+
+        // Answered from the memo table or at the end of the input.
+        template <typename M>
+        void answer(const M &m, bool memo_hit)
+        {
+            if (profiler)
+                profiler->answer(rule, m.matched, m.end.position() - m.begin.position(), memo_hit);
+        }
+
+        void enter()
+        {
+            if (profiler)
+                profiler->enter(rule, call);
+        }
+
+        template <typename M>
+        void leave(const M &m, bool memo_miss)
+        {
+            if (profiler)
+                profiler->leave(rule, call, m.matched, m.end.position() - m.begin.position(),
+                                m.examined - m.begin.position(), memo_miss);
+        }
+    };
+#else
+    struct ProfileCall
+    {
+        template <typename Context>
+        ProfileCall(Context &, uint32_t) { }
+
+        template <typename M>
+        void answer(const M &, bool) { }
+
+        void enter() { }
+
+        template <typename M>
+        void leave(const M &, bool) { }
+    };
+#endif
+}
+
+template <typename Iterator, typename ActionType>
+struct Rule : std::enable_shared_from_this<Rule<Iterator, ActionType>>, RuleKind
+{
+    typedef Match<Iterator, ActionType> match_type;
+    typedef match_type *rule_result;
+    typedef ParseContext<Iterator, ActionType> context_type;
+    typedef MatchBuilder<Iterator, ActionType> builder_type;
+    typedef void action_type(ActionType &);
+    typedef bool check_type(const match_type &);
+    typedef Iterator iterator;
+
+    // Rules without an id (not reachable from a Grammar's start rule) are
+    // not memoized.
+    static const uint32_t no_id = ~uint32_t(0);
+    uint32_t id;
+
+    std::string name;
+    std::function<action_type> action;
+    std::function<check_type> check;
+    std::function<rule_result(context_type &, Iterator, Iterator)> match;
+    bool must_consume_token;
+    std::vector<RuleWrapper<Iterator, ActionType>> children;
+    // Set kind back to CUSTOM when replacing the match of a built-in rule.
+    Kind kind;
+    int token;
+    std::string text;
+    MemoPolicy memo_policy;
+    // Filled in by Grammar.
+    FirstSet first_set;
+    bool memoized;
+
+    Rule() : id(no_id), must_consume_token(true), kind(CUSTOM), token(0), memo_policy(MEMO_AUTO), memoized(false) { }
+    Rule(const std::string name_)
+        : id(no_id), name(name_), must_consume_token(true), kind(CUSTOM), token(0), memo_policy(MEMO_AUTO), memoized(false) { }
+
+    // Use this to break shared_ptr cycles
+    void reset();
+
+    rule_result get_match(context_type &ctx, Iterator token_pos, Iterator eos) const
+    {
+        const std::size_t position = token_pos.position();
+        detail::ProfileCall profile(ctx, id);
+        if (must_consume_token && token_pos == eos) {
+            rule_result ret = ctx.arena.make(false, eos);
+            ret->begin = token_pos;
+            ret->examined = position + 1;
+            ctx.examined = std::max(ctx.examined, ret->examined);
+            if (children.empty())
+                ctx.expect(id, position);
+            else
+                ctx.expect(first_set.rules, position);
+            profile.answer(*ret, false);
+            return ret;
+        }
+        if (memoized) {
+            const rule_result *memo = ctx.memo_for(token_pos).find(id, position);
+            if (memo) {
+                if (ctx.memo_profile)
+                    ++ctx.memo_profile->hits[id];
+                ctx.examined = std::max(ctx.examined, (*memo)->examined);
+                ctx.log_hit(**memo);
+                profile.answer(**memo, true);
+                return *memo;
+            }
+        }
+        // The caller's lookahead so far; ours starts at token_pos.
+        const std::size_t examined = ctx.examined;
+        ctx.examined = position + 1;
+        profile.enter();
+        const std::size_t event = ctx.log_enter(id, position);
+        rule_result ret;
+        try {
+            ret = match(ctx, token_pos, eos);
+        } catch (const vemalex::LexerError &ex) {
+            ctx.lexer_error = ex.what();
+            ret = ctx.arena.make(false, token_pos);
+            ret->begin = token_pos;
+            ret->examined = ctx.examined;
+            ctx.examined = std::max(examined, ret->examined);
+            ctx.log_leave(event, ret);
+            profile.leave(*ret, memoized);
+            return ret;
+        }
+        assert(ret->matched || ret->end == token_pos);
+        ret->begin = token_pos;
+        ret->rule = id;
+        ret->examined = std::max(ctx.examined, ret->end.position() + 1);
+        ctx.examined = std::max(examined, ret->examined);
+        if (check) {
+            ret->matched = check(*ret);
+            if (!ret->matched)
+                ret->end = token_pos;
+        }
+        if (!ret->matched && children.empty())
+            ctx.expect(id, position);
+        if (memoized) {
+            ctx.memo_for(token_pos).insert(id, position, ret);
+            ret->memoized = true;
+        }
+        if (ctx.memo_profile && id != no_id)
+            ++ctx.memo_profile->matches[id];
+        ctx.log_leave(event, ret);
+        profile.leave(*ret, memoized);
+        return ret;
+    }
+
+    Rule &operator [](std::function<action_type> callable)
+    {
+        action = callable;
+        return *this;
+    }
+
+    Rule &operator ()(std::function<check_type> callable)
+    {
+        check = callable;
+        return *this;
+    }
+
+    std::shared_ptr<Rule> get_shared_ptr()
+    {
+        return this->shared_from_this();
+    }
+};
+
+template <typename Iterator, typename ActionType>
+class RuleWrapper
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> ptr;
+
+public:
+    typedef Iterator iterator;
+    typedef typename Rule<Iterator, ActionType>::rule_result rule_result;
+    RuleWrapper() { }
+    RuleWrapper(std::shared_ptr<Rule<Iterator, ActionType>> r_) : ptr(r_) { }
+
+    RuleWrapper &operator =(const RuleWrapper &other)
+    {
+        if (this == &other)
+            return *this;
+
+        if (ptr) {
+            ptr->match = other->match;
+            ptr->must_consume_token = other->must_consume_token;
+            ptr->children = other->children;
+            ptr->kind = other->kind;
+            ptr->token = other->token;
+            ptr->text = other->text;
+            if (other->memo_policy != MEMO_AUTO)
+                ptr->memo_policy = other->memo_policy;
+            if (other->check)
+                ptr->check = other->check;
+            if (other->action)
+                ptr->action = other->action;
+            if (other->name.size()) {
+                ptr->name = other->name;
+            }
+            return *this;
+        }
+
+        ptr = other.ptr;
+        return *this;
+    }
+
+    Rule<Iterator, ActionType> *operator ->()
+    {
+        assert(ptr);
+        return ptr.get();
+    }
+
+    const Rule<Iterator, ActionType> *operator ->() const
+    {
+        assert(ptr);
+        return ptr.get();
+    }
+
+    template <typename T>
+    RuleWrapper &operator [](T action)
+    {
+        assert(ptr);
+        ptr->action = action;
+        return *this;
+    }
+
+    template <typename T>
+    RuleWrapper &operator ()(T check)
+    {
+        assert(ptr);
+        ptr->check = check;
+        return *this;
+    }
+
+    void reset()
+    {
+        assert(ptr);
+        ptr->reset();
+        ptr.reset();
+    }
+
+    static RuleWrapper create_empty_rule()
+    {
+        return std::make_shared<Rule<Iterator, ActionType>>();
+    }
+
+    static RuleWrapper clone_rule(const RuleWrapper &other)
+    {
+        return RuleWrapper(std::make_shared<Rule<Iterator, ActionType>>(*other.ptr));
+    }
+};
+
+struct GrammarError : public std::logic_error
+{
+    GrammarError(const std::string &error) : std::logic_error(error) { }
+};
+
+// Assigns every rule reachable from start a small id, in depth first order
+// with start as 0, works out their first sets and keeps the rules alive
+// for as long as the grammar.
+// The rules must not be changed afterwards; matching only reads them, so
+// one grammar can serve any number of threads, each parsing with its own
+// ParseContext. A rule can only be part of one grammar.
+template <typename Iterator, typename ActionType>
+class Grammar
+{
+    std::vector<RuleWrapper<Iterator, ActionType>> rules;
+
+public:
+    typedef RuleWrapper<Iterator, ActionType> rule_type;
+
+    Grammar(rule_type start)
+    {
+        std::set<const Rule<Iterator, ActionType> *> seen;
+        std::vector<rule_type> stack(1, start);
+        while (!stack.empty()) {
+            rule_type rule = stack.back();
+            stack.pop_back();
+            if (!seen.insert(rule.operator ->()).second)
+                continue;
+            const uint32_t id = uint32_t(rules.size());
+            if (rule->id != Rule<Iterator, ActionType>::no_id && rule->id != id)
+                throw GrammarError("rule \"" + rule->name + "\" is already part of another grammar");
+            rule->id = id;
+            rules.push_back(rule);
+            for (auto iter = rule->children.rbegin(); iter != rule->children.rend(); ++iter)
+                stack.push_back(*iter);
+        }
+
+        std::vector<RuleSummary> summaries(rules.size());
+        for (std::size_t i = 0; i < rules.size(); ++i) {
+            const rule_type &rule = rules[i];
+            RuleSummary &summary = summaries[i];
+            summary.kind = rule->kind;
+            summary.must_consume_token = rule->must_consume_token;
+            summary.token = rule->token;
+            summary.text = rule->text;
+            for (auto iter = rule->children.begin(); iter != rule->children.end(); ++iter)
+                summary.children.push_back((*iter)->id);
+        }
+        const std::vector<FirstSet> sets = first_sets(summaries);
+        for (std::size_t i = 0; i < rules.size(); ++i) {
+            rules[i]->first_set = sets[i];
+            const MemoPolicy policy = rules[i]->memo_policy;
+            rules[i]->memoized = policy == MEMO_ALWAYS || (policy == MEMO_AUTO && memoize_by_default(rules[i]->kind));
+        }
+    }
+
+    // Stop memoizing the MEMO_AUTO rules whose memo entries were reused for
+    // less than min_reuse of their matches in the profiled parses, and
+    // return how many those were. Rules the profile never saw are left
+    // alone. Like building the grammar, this must be done before parsing
+    // with it (or building a Program from it).
+    std::size_t tune(const MemoProfile &profile, double min_reuse = 0.01)
+    {
+        std::size_t ret = 0;
+        for (std::size_t i = 0; i < rules.size() && i < profile.matches.size(); ++i) {
+            Rule<Iterator, ActionType> &rule = *rules[i].operator ->();
+            if (rule.memo_policy != MEMO_AUTO || !rule.memoized || !profile.matches[i])
+                continue;
+            if (double(profile.hits[i]) < min_reuse * double(profile.matches[i])) {
+                rule.memoized = false;
+                ++ret;
+            }
+        }
+        return ret;
+    }
+
+    std::size_t size() const
+    {
+        return rules.size();
+    }
+
+    const rule_type &start() const
+    {
+        return rules.front();
+    }
+
+    const rule_type &rule(uint32_t id) const
+    {
+        return rules[id];
+    }
+
+    const std::string &name(uint32_t id) const
+    {
+        static const std::string none;
+        return id < rules.size() ? rules[id]->name : none;
+    }
+
+    const std::string &name(const Match<Iterator, ActionType> &m) const
+    {
+        return name(m.rule);
+    }
+
+    // The id of the first rule named name, or Rule::no_id. Matches and trees
+    // only keep rule ids, so this is for the occasional lookup the other
+    // way, e.g. to find the kind of a named rule's nodes once.
+    uint32_t find(const std::string &name) const
+    {
+        for (uint32_t id = 0; id < rules.size(); ++id)
+            if (rules[id]->name == name)
+                return id;
+        return Rule<Iterator, ActionType>::no_id;
+    }
+
+    const std::function<void(ActionType &)> &action(uint32_t id) const
+    {
+        static const std::function<void(ActionType &)> none;
+        return id < rules.size() ? rules[id]->action : none;
+    }
+
+    const std::function<void(ActionType &)> &action(const Match<Iterator, ActionType> &m) const
+    {
+        return action(m.rule);
+    }
+};
+
+template <typename Iterator, typename ActionType>
+inline void Rule<Iterator, ActionType>::reset()
+{
+    name = "";
+    action = std::function<action_type>();
+    check = std::function<check_type>();
+    match = std::function<rule_result(context_type &, Iterator, Iterator)>();
+    kind = CUSTOM;
+    first_set = FirstSet();
+    // Don't want to recurse, so make a copy and then clear children before iterating.
+    auto children_copy = children;
+    children.clear();
+    for (auto iter = children_copy.begin(); iter != children_copy.end(); ++iter) {
+        (*iter)->reset();
+    }
+}
+
+// This walks children who have not matched, and therefore end hasn't
+// propagated, therefore it's necessary to go get it.
+template <typename Iterator, typename ActionType>
+const Match<Iterator, ActionType> &right_most(const Match<Iterator, ActionType> &m)
+{
+    const Match<Iterator, ActionType> *ret = &m;
+    while (!ret->children.empty())
+        ret = ret->children.back();
+    return *ret;
+}
+
+namespace detail
+{
+    // True if pattern only ever matches one fixed string, which is stored
+    // in text. Escaped punctuation counts as literal; any other escape or
+    // unescaped metacharacter does not.
+    inline bool regex_literal(const std::string &pattern, std::string &text)
+    {
+        static const char meta[] = ".^$|()[]{}*+?";
+        text.clear();
+        for (std::size_t i = 0; i < pattern.size(); ++i) {
+            char c = pattern[i];
+            if (c == '\\') {
+                if (++i == pattern.size())
+                    return false;
+                c = pattern[i];
+                if (::isalnum(static_cast<unsigned char>(c)) || c == '\0')
+                    return false;
+            } else if (c == '\0' || std::strchr(meta, c)) {
+                return false;
+            }
+            text += c;
+        }
+        return true;
+    }
+}
+
+// Matches a token whose text is exactly text.
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> literal(const std::string &text)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("literal"));
+    rule->kind = Rule<Iterator, ActionType>::LITERAL;
+    rule->text = text;
+    rule->match = [text](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator) -> typename Rule<Iterator, ActionType>::rule_result {
+        bool matched = (*token_pos).equals(text.data(), text.size());
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    };
+    return rule;
+}
+
+// Patterns that are plain strings are matched as literals.
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> regex(const std::string &regex_string)
+{
+    std::string text;
+    if (detail::regex_literal(regex_string, text)) {
+        RuleWrapper<Iterator, ActionType> rule = literal<Iterator, ActionType>(text);
+        rule->name = "regex";
+        return rule;
+    }
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("regex"));
+    // Not used to match, but it tells the pattern apart in fingerprint().
+    rule->text = regex_string;
+    std::regex re = std::regex(regex_string);
+    rule->match = [re](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator) -> typename Rule<Iterator, ActionType>::rule_result { 
+        auto text = *token_pos;
+        bool matched = std::regex_match(text.begin(), text.end(), re);
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    };
+    return rule;
+}
+
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> terminal(int id)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("terminal"));
+    rule->kind = Rule<Iterator, ActionType>::TERMINAL;
+    rule->token = id;
+    rule->match = [id](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator) -> typename Rule<Iterator, ActionType>::rule_result {
+        bool matched = (token_pos.token == id);
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    };
+    return rule;
+}
+
+// non-terminals propagate info from their children
+template <typename Iterator, typename ActionType>
+void propagate_child_info(MatchBuilder<Iterator, ActionType> &ret, Match<Iterator, ActionType> *child)
+{
+    ret.matched = child->matched;
+    ret.end = child->end;
+    if (!child->committed)
+        ret.arena.push(child);
+}
+
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> newline(RuleWrapper<Iterator, ActionType> first)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("newline"));
+    rule->match = [first](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result {
+        // first's match is memoized under its own rule, so it gets wrapped
+        // rather than changed.
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        token_pos.start_newline();
+        propagate_child_info(ret, first->get_match(ctx, token_pos, eos));
+        ret.end.stop_newline();
+        return ret.finish();
+    };
+    rule->children.push_back(first);
+    return rule;
+}
+
+// Ordering this >> that
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> operator >>(RuleWrapper<Iterator, ActionType> first, 
+                                              RuleWrapper<Iterator, ActionType> second)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("order"));
+    rule->must_consume_token = first->must_consume_token || second->must_consume_token;
+    rule->kind = Rule<Iterator, ActionType>::SEQUENCE;
+    rule->match = [first, second](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
+    {
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        typename Rule<Iterator, ActionType>::rule_result tmp = first->get_match(ctx, token_pos, eos);
+        propagate_child_info(ret, tmp);
+        if (tmp->matched) {
+            tmp = second->get_match(ctx, tmp->end, eos);
+            propagate_child_info(ret, tmp);
+            if (!tmp->matched) {
+                ret.end = token_pos;
+            }
+        }
+        return ret.finish();
+    };
+    rule->children.push_back(first);
+    rule->children.push_back(second);
+    return rule;
+}
+
+// Select this | that
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> operator |(RuleWrapper<Iterator, ActionType> first, 
+                                             RuleWrapper<Iterator, ActionType> second)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("or"));
+    rule->must_consume_token = first->must_consume_token || second->must_consume_token;
+    rule->kind = Rule<Iterator, ActionType>::CHOICE;
+    rule->match = [first, second](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
+    { 
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        // Alternatives that can't start here aren't tried at all, but their
+        // tokens are still expected here.
+        const bool try_first = first->first_set.may_start(token_pos, eos);
+        const bool try_second = second->first_set.may_start(token_pos, eos);
+        if (!try_first)
+            ctx.expect(first->first_set.rules, token_pos.position());
+        if (!try_second)
+            ctx.expect(second->first_set.rules, token_pos.position());
+        if (!try_first || !try_second) {
+            if (try_first || try_second)
+                propagate_child_info(ret, (try_first ? first : second)->get_match(ctx, token_pos, eos));
+            else
+                ret.end = token_pos;
+            return ret.finish();
+        }
+        typename Rule<Iterator, ActionType>::rule_result tmpl, tmpr;
+        tmpl = first->get_match(ctx, token_pos, eos);
+        // TODO: if both fail should we propagate all the child info? 
+        // Just the failure with the most children?
+        if (tmpl->matched) {
+            propagate_child_info(ret, tmpl);
+            return ret.finish();
+        }
+        tmpr = second->get_match(ctx, token_pos, eos);
+        if (tmpr->matched) {
+            propagate_child_info(ret, tmpr);
+            return ret.finish();
+        }
+
+        // Didn't match, see which match got further
+        typename Iterator::difference_type ld = right_most(*tmpl).end - token_pos;
+        typename Iterator::difference_type lr = right_most(*tmpr).end - token_pos;
+        if (ld < lr) {
+            propagate_child_info(ret, tmpr);
+        } else {
+            propagate_child_info(ret, tmpl);
+        }
+        return ret.finish();
+    };
+    rule->children.push_back(first);
+    rule->children.push_back(second);
+    return rule;
+}
+
+// Kleene Star
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> operator *(RuleWrapper<Iterator, ActionType> first)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>(std::string("kleene->")+first->name));
+    rule->must_consume_token = false;
+    rule->kind = Rule<Iterator, ActionType>::STAR;
+    rule->match = [first](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
+    {
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        typename Rule<Iterator, ActionType>::rule_result tmp;
+        ret.end = token_pos;
+        Iterator tmp_pos = token_pos;
+        bool tmp_matched = true;
+        while (tmp_pos != eos && tmp_matched) {
+            tmp = first->get_match(ctx, tmp_pos, eos);
+            propagate_child_info(ret, tmp);
+            tmp_pos = tmp->end;
+            tmp_matched = tmp->matched;
+        }
+        ret.matched = true;
+        return ret.finish();
+    };
+    rule->children.push_back(first);
+    return rule;
+}
+
+// Non-greedy kleene star
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> operator /(RuleWrapper<Iterator, ActionType> first, 
+                                             RuleWrapper<Iterator, ActionType> second)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("non-greedy kleene"));
+    rule->must_consume_token = first->must_consume_token || second->must_consume_token;
+    rule->kind = Rule<Iterator, ActionType>::NON_GREEDY;
+    rule->match = [first, second](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
+    {
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        typename Rule<Iterator, ActionType>::rule_result tmp;
+        ret.matched = true;
+        bool matched_right_side = false;
+        Iterator tmp_pos = token_pos;
+        while (tmp_pos != eos) {
+            Iterator start_pos = tmp_pos;
+            tmp = second->get_match(ctx, start_pos, eos);
+            if (tmp->matched) {
+                propagate_child_info(ret, tmp);
+                matched_right_side = true;
+                break;
+            }
+            tmp = first->get_match(ctx, start_pos, eos);
+            tmp_pos = tmp->end;
+            propagate_child_info(ret, tmp);
+            // Optional or star can return true, but didn't consume anything.
+            // That means we'll loop forever.
+            if (!tmp->matched || (tmp->end == start_pos)) {
+                break;
+            }
+        }
+        if (!matched_right_side) {
+            ret.matched = false;
+            ret.end = token_pos;
+        }
+        return ret.finish();
+    };
+    rule->children.push_back(first);
+    rule->children.push_back(second);
+    return rule;
+}
+
+// Optional this?
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> operator -(RuleWrapper<Iterator, ActionType> first)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("optional"));
+    rule->must_consume_token = false;
+    rule->kind = Rule<Iterator, ActionType>::OPTIONAL;
+    rule->match = [first](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
+    {
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        if (token_pos == eos)
+            return ret.finish();
+        typename Rule<Iterator, ActionType>::rule_result tmp = first->get_match(ctx, token_pos, eos);
+        propagate_child_info(ret, tmp);
+        assert(ret.matched || (tmp->end == token_pos));
+        ret.matched = true;
+        return ret.finish();
+    };
+    rule->children.push_back(first);
+    return rule;
+}
+
+// 1 or more
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> operator +(RuleWrapper<Iterator, ActionType> first)
+{
+    return (first >> (*first));
+}
+
+// Not
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> operator !(RuleWrapper<Iterator, ActionType> first)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("not"));
+    rule->kind = Rule<Iterator, ActionType>::NOT;
+    rule->match = [first](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
+    {
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        if (token_pos == eos)
+            return ret.finish();
+        typename Rule<Iterator, ActionType>::rule_result tmp = first->get_match(ctx, token_pos, eos);
+        const bool matched = !tmp->matched;
+        return ctx.arena.make(matched, matched ? ++token_pos : token_pos);
+    };
+    rule->children.push_back(first);
+    return rule;
+}
+
+// Cut: match first, then commit to it. The grammar must never backtrack to
+// before the end of a successful match, which lets the context forget its
+// memo entries and, with ParseContext::on_commit set, the whole subtree.
+// E.g. +cut(item) parses a long stream of items in bounded memory.
+template <typename Iterator, typename ActionType>
+RuleWrapper<Iterator, ActionType> cut(RuleWrapper<Iterator, ActionType> first)
+{
+    std::shared_ptr<Rule<Iterator, ActionType>> rule(new Rule<Iterator, ActionType>("cut"));
+    rule->must_consume_token = first->must_consume_token;
+    rule->match = [first](typename Rule<Iterator, ActionType>::context_type &ctx, Iterator token_pos, Iterator eos) -> typename Rule<Iterator, ActionType>::rule_result 
+    {
+        const typename MatchArena<Iterator, ActionType>::State state = ctx.arena.state();
+        typename Rule<Iterator, ActionType>::rule_result tmp = first->get_match(ctx, token_pos, eos);
+        if (tmp->matched) {
+            tmp = ctx.commit(tmp, state);
+            if (tmp->committed)
+                return tmp;
+        }
+        typename Rule<Iterator, ActionType>::builder_type ret(ctx, eos);
+        propagate_child_info(ret, tmp);
+        return ret.finish();
+    };
+    rule->children.push_back(first);
+    return rule;
+}
+
+// Parse again after removed bytes at offset were replaced by inserted ones.
+// tokens and ctx are the ones the last parse used and lexer is over the
+// whole new input. Only the tokens around the edit are relexed and only the
+// rules that looked at them are run again.
+template <typename Iterator, typename ActionType, typename Tokens, typename Lexer>
+Match<Iterator, ActionType> *reparse(const Grammar<Iterator, ActionType> &grammar, ParseContext<Iterator, ActionType> &ctx,
+                                     Tokens &tokens, const Lexer &lexer,
+                                     std::size_t offset, std::size_t removed, std::size_t inserted)
+{
+    const auto edit = tokens.edit(lexer, offset, removed, inserted);
+    ctx.splice(edit.first, edit.removed, edit.inserted);
+    return grammar.start()->get_match(ctx, tokens.begin(), tokens.end());
+}
+
+}
+
+#endif
+
@@ -0,0 +1,211 @@
+
+#ifndef VEMAPARSE_PROFILE_H_
+#define VEMAPARSE_PROFILE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace vemaparse
+{
+
+// What the parser did in one rule.
+struct RuleProfile
+{
+    uint32_t rule;
+    std::string name;
+    // Calls to get_match, and how many were answered from the memo table,
+    // looked there in vain or failed right away at the end of the input. For
+    // a memoized rule these add up to the calls.
+    uint64_t invocations;
+    uint64_t memo_hits;
+    uint64_t memo_misses;
+    uint64_t at_end;
+    uint64_t successes;
+    uint64_t failures;
+    // Tokens covered by successful matches.
+    uint64_t consumed;
+    // Tokens looked at by matches that then failed.
+    uint64_t backtracked;
+    // Seconds spent matching the rule, with and without the rules it called.
+    // A rule that calls itself is only timed at the outermost call.
+    double inclusive;
+    double exclusive;
+
+    RuleProfile()
+        : rule(0), invocations(0), memo_hits(0), memo_misses(0), at_end(0), successes(0), failures(0), consumed(0),
+          backtracked(0), inclusive(0), exclusive(0) { }
+};
+
+// Per rule counters filled in by get_match through ParseContext::profiler.
+// Only compiled in with VEMAPARSE_PROFILE defined:
+//
+//   #define VEMAPARSE_PROFILE
+//   #include <vemaparse/parser.h>
+//
+//   vemaparse::Profiler profiler;
+//   ctx.profiler = &profiler;
+//   start->get_match(ctx, tokens.begin(), tokens.end());
+//   vemaparse::write_csv(std::cout, profiler.report(grammar, 20));
+//
+// Program (vm.h) doesn't count its built-in rules.
+class Profiler
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    // A call being timed.
+    struct Call
+    {
+        clock::time_point start;
+        double children;
+        bool outermost;
+    };
+
+private:
+    std::vector<RuleProfile> rules;
+    std::vector<uint32_t> active;
+    // Time spent in the calls made by the innermost call being timed.
+    double children;
+
+    RuleProfile &at(uint32_t rule)
+    {
+        if (rule >= rules.size()) {
+            rules.resize(rule + 1);
+            active.resize(rule + 1);
+        }
+        return rules[rule];
+    }
+
+public:
+    Profiler() : children(0) { }
+
+    void enter(uint32_t rule, Call &call)
+    {
+        ++at(rule).invocations;
+        call.children = children;
+        call.outermost = active[rule]++ == 0;
+        children = 0;
+        call.start = clock::now();
+    }
+
+    // A call answered without matching, from the memo table or because it
+    // was at the end of the input.
+    void answer(uint32_t rule, bool matched, std::size_t consumed, bool memo_hit)
+    {
+        RuleProfile &profile = at(rule);
+        ++profile.invocations;
+        profile.memo_hits += memo_hit;
+        profile.at_end += !memo_hit;
+        if (matched) {
+            ++profile.successes;
+            profile.consumed += consumed;
+        } else {
+            ++profile.failures;
+        }
+    }
+
+    void leave(uint32_t rule, const Call &call, bool matched, std::size_t consumed, std::size_t examined, bool memo_miss)
+    {
+        const double elapsed = std::chrono::duration<double>(clock::now() - call.start).count();
+        RuleProfile &profile = rules[rule];
+        profile.memo_misses += memo_miss;
+        if (matched) {
+            ++profile.successes;
+            profile.consumed += consumed;
+        } else {
+            ++profile.failures;
+            profile.backtracked += examined;
+        }
+        if (--active[rule] == 0)
+            profile.inclusive += elapsed;
+        profile.exclusive += elapsed - children;
+        children = call.children + elapsed;
+    }
+
+    void clear()
+    {
+        rules.clear();
+        active.clear();
+        children = 0;
+    }
+
+    // The n rules with the most exclusive time, named by grammar.name(id).
+    template <typename GrammarType>
+    std::vector<RuleProfile> report(const GrammarType &grammar, std::size_t n = std::size_t(-1)) const
+    {
+        std::vector<RuleProfile> ret;
+        for (uint32_t i = 0; i < rules.size(); ++i) {
+            if (!rules[i].invocations)
+                continue;
+            ret.push_back(rules[i]);
+            ret.back().rule = i;
+            ret.back().name = grammar.name(i);
+        }
+        std::sort(ret.begin(), ret.end(), [](const RuleProfile &a, const RuleProfile &b) {
+            return a.exclusive > b.exclusive;
+        });
+        if (ret.size() > n)
+            ret.resize(n);
+        return ret;
+    }
+};
+
+namespace detail
+{
+    inline void write_quoted(std::ostream &out, const std::string &text, bool json)
+    {
+        out << '"';
+        for (auto iter = text.begin(); iter != text.end(); ++iter) {
+            const unsigned char c = static_cast<unsigned char>(*iter);
+            if (c == '"') {
+                out << (json ? "\\\"" : "\"\"");
+            } else if (json && c == '\\') {
+                out << "\\\\";
+            } else if (json && c < 0x20) {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out << escape;
+            } else {
+                out << *iter;
+            }
+        }
+        out << '"';
+    }
+}
+
+inline void write_csv(std::ostream &out, const std::vector<RuleProfile> &profiles)
+{
+    out << "rule,name,invocations,memo_hits,memo_misses,at_end,successes,failures,consumed,backtracked,inclusive,exclusive\n";
+    for (auto iter = profiles.begin(); iter != profiles.end(); ++iter) {
+        out << iter->rule << ',';
+        detail::write_quoted(out, iter->name, false);
+        out << ',' << iter->invocations << ',' << iter->memo_hits << ',' << iter->memo_misses << ',' << iter->at_end << ','
+            << iter->successes << ',' << iter->failures << ',' << iter->consumed << ',' << iter->backtracked << ','
+            << iter->inclusive << ',' << iter->exclusive << '\n';
+    }
+}
+
+inline void write_json(std::ostream &out, const std::vector<RuleProfile> &profiles)
+{
+    out << "[\n";
+    for (auto iter = profiles.begin(); iter != profiles.end(); ++iter) {
+        out << "  {\"rule\": " << iter->rule << ", \"name\": ";
+        detail::write_quoted(out, iter->name, true);
+        out << ", \"invocations\": " << iter->invocations << ", \"memo_hits\": " << iter->memo_hits
+            << ", \"memo_misses\": " << iter->memo_misses << ", \"at_end\": " << iter->at_end
+            << ", \"successes\": " << iter->successes
+            << ", \"failures\": " << iter->failures << ", \"consumed\": " << iter->consumed
+            << ", \"backtracked\": " << iter->backtracked << ", \"inclusive\": " << iter->inclusive
+            << ", \"exclusive\": " << iter->exclusive << '}' << (iter + 1 != profiles.end() ? "," : "") << '\n';
+    }
+    out << "]\n";
+}
+
+}
+
+#endif
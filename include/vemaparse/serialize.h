@@ -0,0 +1,429 @@
+
+#ifndef VEMAPARSE_SERIALIZE_H_
+#define VEMAPARSE_SERIALIZE_H_
+
+#include <cctype>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "lexer.h"
+#include "ast.h"
+
+namespace ast
+{
+
+struct FormatError : public std::runtime_error
+{
+    FormatError(const std::string &error) : std::runtime_error(error) { }
+};
+
+// Collects output in one large block and hands it to the stream a block at
+// a time, instead of going through the stream per value.
+class Writer
+{
+    std::ostream &stream;
+    std::vector<char> buffer;
+    std::size_t used;
+
+public:
+    explicit Writer(std::ostream &stream_, std::size_t size = 1 << 16) : stream(stream_), buffer(size ? size : 1), used(0) { }
+
+    ~Writer()
+    {
+        flush();
+    }
+
+    void put(char c)
+    {
+        if (used == buffer.size())
+            flush();
+        buffer[used++] = c;
+    }
+
+    void write(const char *s, std::size_t n)
+    {
+        if (n > buffer.size() - used) {
+            flush();
+            if (n >= buffer.size()) {
+                stream.write(s, std::streamsize(n));
+                return;
+            }
+        }
+        std::memcpy(&buffer[used], s, n);
+        used += n;
+    }
+
+    void write(const char *s)
+    {
+        write(s, std::strlen(s));
+    }
+
+    void write(const std::string &s)
+    {
+        write(s.data(), s.size());
+    }
+
+    void number(uint64_t n)
+    {
+        char digits[20];
+        std::size_t i = sizeof(digits);
+        do {
+            digits[--i] = char('0' + n % 10);
+            n /= 10;
+        } while (n);
+        write(digits + i, sizeof(digits) - i);
+    }
+
+    void flush()
+    {
+        if (used)
+            stream.write(&buffer[0], std::streamsize(used));
+        used = 0;
+    }
+};
+
+namespace detail
+{
+    // A DOT id: the name with anything but letters and digits replaced,
+    // numbered to tell nodes apart.
+    template <typename Text>
+    void write_dot_id(Writer &out, const Text &name, uint64_t number)
+    {
+        for (auto iter = name.begin(); iter != name.end(); ++iter) {
+            const char c = *iter;
+            out.put(::isalnum(static_cast<unsigned char>(c)) ? c : '_');
+        }
+        out.number(number);
+    }
+
+    // Line breaks become _ so every label stays on one line.
+    template <typename InputIt>
+    void write_dot_label(Writer &out, InputIt begin, InputIt end)
+    {
+        for (; begin != end; ++begin) {
+            const char c = *begin;
+            switch (c) {
+            case '"':
+            case '\\':
+                out.put('\\');
+                out.put(c);
+                break;
+            case '\n':
+            case '\r':
+                out.put('_');
+                break;
+            default:
+                out.put(c);
+                break;
+            }
+        }
+    }
+
+    template <typename Name, typename Text>
+    void write_dot_node(Writer &out, const Name &name, const Text &text, uint64_t number)
+    {
+        write_dot_id(out, name, number);
+        out.write(" [label=\"");
+        write_dot_label(out, name.begin(), name.end());
+        out.write(" - ");
+        write_dot_label(out, text.begin(), text.end());
+        out.write("\"];\n");
+    }
+
+    template <typename InputIt>
+    void write_json_string(Writer &out, InputIt begin, InputIt end)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out.put('"');
+        for (; begin != end; ++begin) {
+            const unsigned char c = static_cast<unsigned char>(*begin);
+            switch (c) {
+            case '"': out.write("\\\"", 2); break;
+            case '\\': out.write("\\\\", 2); break;
+            case '\n': out.write("\\n", 2); break;
+            case '\r': out.write("\\r", 2); break;
+            case '\t': out.write("\\t", 2); break;
+            default:
+                if (c < 0x20) {
+                    out.write("\\u00", 4);
+                    out.put(hex[c >> 4]);
+                    out.put(hex[c & 0xf]);
+                } else {
+                    out.put(char(c));
+                }
+                break;
+            }
+        }
+        out.put('"');
+    }
+
+    template <typename Node>
+    void write_dot(Writer &out, const Node &node, const Node *parent, uint64_t parent_number, uint64_t &counter)
+    {
+        const uint64_t number = counter++;
+        write_dot_node(out, node.name, node.text, number);
+        if (parent) {
+            write_dot_id(out, parent->name, parent_number);
+            out.write(" -> ");
+            write_dot_id(out, node.name, number);
+            out.write(";\n");
+        }
+        for (auto iter = node.children.begin(); iter != node.children.end(); ++iter)
+            detail::write_dot(out, **iter, &node, number, counter);
+    }
+
+    template <typename Node>
+    void write_json(Writer &out, const Node &node)
+    {
+        out.write("{\"name\":");
+        write_json_string(out, node.name.begin(), node.name.end());
+        out.write(",\"text\":");
+        write_json_string(out, node.text.begin(), node.text.end());
+        if (!node.children.empty()) {
+            out.write(",\"children\":[");
+            for (auto iter = node.children.begin(); iter != node.children.end(); ++iter) {
+                if (iter != node.children.begin())
+                    out.put(',');
+                detail::write_json(out, **iter);
+            }
+            out.put(']');
+        }
+        out.put('}');
+    }
+}
+
+// A tree of nodes with a name, text and children (shared or plain
+// pointers), like the ones visit_match builds, as a DOT graph.
+template <typename Node>
+void write_dot(Writer &out, const Node &root)
+{
+    uint64_t counter = 0;
+    out.write("digraph ast {\n");
+    detail::write_dot(out, root, static_cast<const Node *>(NULL), 0, counter);
+    out.write("}\n");
+}
+
+template <typename Node>
+void write_json(Writer &out, const Node &root)
+{
+    detail::write_json(out, root);
+    out.put('\n');
+}
+
+// An ast::Tree as a DOT graph. name(kind) returns the name of a node kind
+// and text(id, buffer) puts the text of node id into buffer, which is
+// reused from node to node.
+template <typename Name, typename Text>
+void write_dot(Writer &out, const Tree &tree, Name name, Text text)
+{
+    std::string buffer;
+    std::vector<uint64_t> numbers;
+    uint64_t counter = 0;
+    out.write("digraph ast {\n");
+    tree.preorder([&](uint32_t id, uint32_t depth) {
+        const Tree::Node &node = tree[id];
+        numbers.resize(depth);
+        buffer.clear();
+        text(id, buffer);
+        detail::write_dot_node(out, name(node.kind), buffer, counter);
+        if (depth) {
+            detail::write_dot_id(out, name(tree[node.parent].kind), numbers.back());
+            out.write(" -> ");
+            detail::write_dot_id(out, name(node.kind), counter);
+            out.write(";\n");
+        }
+        numbers.push_back(counter++);
+    });
+    out.write("}\n");
+}
+
+// The root has no kind if the tree was created without one.
+template <typename Name, typename Text>
+void write_json(Writer &out, const Tree &tree, Name name, Text text)
+{
+    std::string buffer;
+    uint32_t id = tree.root();
+    while (true) {
+        const Tree::Node &node = tree[id];
+        out.put('{');
+        if (node.kind != Tree::none) {
+            out.write("\"kind\":");
+            out.number(node.kind);
+            out.write(",\"name\":");
+            const auto &s = name(node.kind);
+            detail::write_json_string(out, s.begin(), s.end());
+            out.put(',');
+        }
+        out.write("\"begin\":");
+        out.number(node.begin);
+        out.write(",\"end\":");
+        out.number(node.end);
+        buffer.clear();
+        text(id, buffer);
+        out.write(",\"text\":");
+        detail::write_json_string(out, buffer.begin(), buffer.end());
+        if (node.first_child != Tree::none) {
+            out.write(",\"children\":[");
+            id = node.first_child;
+            continue;
+        }
+        out.put('}');
+        while (id != tree.root() && tree[id].next_sibling == Tree::none) {
+            id = tree[id].parent;
+            out.write("]}");
+        }
+        if (id == tree.root())
+            break;
+        out.put(',');
+        id = tree[id].next_sibling;
+    }
+    out.put('\n');
+}
+
+// The binary format: a BinaryHeader, the nodes in depth first order as
+// BinaryNodes, then header.names + 1 offsets into the chars of the kind
+// names that follow them. Integers are 32 bit in the writer's byte order,
+// which BinaryTree checks through byte_order.
+struct BinaryHeader
+{
+    char magic[4];
+    uint32_t byte_order;
+    uint32_t nodes;
+    uint32_t names;
+    uint32_t chars;
+};
+
+struct BinaryNode
+{
+    uint32_t kind;
+    uint32_t begin, end;
+    uint32_t parent;
+    // One past the last node of the subtree; the first child is the next
+    // node if there is one.
+    uint32_t next;
+};
+
+// An ast::Tree in the binary format, with name(kind) for every kind up to
+// the largest one in the tree. Removed nodes are left out.
+template <typename Name>
+void write_binary(Writer &out, const Tree &tree, Name name)
+{
+    std::vector<BinaryNode> nodes;
+    std::vector<uint32_t> open;
+    uint32_t kinds = 0;
+    tree.preorder([&](uint32_t id, uint32_t depth) {
+        const Tree::Node &node = tree[id];
+        while (open.size() > depth) {
+            nodes[open.back()].next = uint32_t(nodes.size());
+            open.pop_back();
+        }
+        BinaryNode b = {node.kind, node.begin, node.end, open.empty() ? Tree::none : open.back(), 0};
+        open.push_back(uint32_t(nodes.size()));
+        nodes.push_back(b);
+        if (node.kind != Tree::none && node.kind >= kinds)
+            kinds = node.kind + 1;
+    });
+    for (auto iter = open.begin(); iter != open.end(); ++iter)
+        nodes[*iter].next = uint32_t(nodes.size());
+
+    std::vector<uint32_t> offsets(1, 0);
+    std::string chars;
+    for (uint32_t kind = 0; kind < kinds; ++kind) {
+        const auto &s = name(kind);
+        chars.append(s.begin(), s.end());
+        offsets.push_back(uint32_t(chars.size()));
+    }
+
+    BinaryHeader header = {{'V', 'P', 'T', '1'}, 0x01020304, uint32_t(nodes.size()), kinds, uint32_t(chars.size())};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(&nodes[0]), nodes.size() * sizeof(BinaryNode));
+    out.write(reinterpret_cast<const char *>(&offsets[0]), offsets.size() * sizeof(uint32_t));
+    out.write(chars);
+}
+
+// Reads the binary format in place, e.g. from a vemalex::MappedSource,
+// without copying or decoding it. data must stay valid and be 4 byte
+// aligned, which mappings and heap blocks are. The sizes, name offsets and
+// links between nodes are checked once here, so the accessors don't need to.
+class BinaryTree
+{
+    const BinaryHeader *header;
+    const BinaryNode *nodes;
+    const uint32_t *offsets;
+    const char *chars;
+
+public:
+    static const uint32_t none = ~uint32_t(0);
+
+    BinaryTree(const char *begin, const char *end)
+    {
+        const std::size_t size = std::size_t(end - begin);
+        if (reinterpret_cast<uintptr_t>(begin) % 4)
+            throw FormatError("binary tree data isn't aligned");
+        if (size < sizeof(BinaryHeader))
+            throw FormatError("binary tree data is too short");
+        header = reinterpret_cast<const BinaryHeader *>(begin);
+        if (std::memcmp(header->magic, "VPT1", 4))
+            throw FormatError("not a binary tree");
+        if (header->byte_order != 0x01020304)
+            throw FormatError("binary tree was written with another byte order");
+        const uint64_t expected = sizeof(BinaryHeader) + uint64_t(header->nodes) * sizeof(BinaryNode) +
+                                  (uint64_t(header->names) + 1) * sizeof(uint32_t) + header->chars;
+        if (expected != size)
+            throw FormatError("binary tree data has the wrong size");
+        nodes = reinterpret_cast<const BinaryNode *>(header + 1);
+        offsets = reinterpret_cast<const uint32_t *>(nodes + header->nodes);
+        chars = reinterpret_cast<const char *>(offsets + header->names + 1);
+
+        for (uint32_t kind = 0; kind < header->names; ++kind)
+            if (offsets[kind] > offsets[kind + 1])
+                throw FormatError("binary tree names are out of order");
+        if (offsets[0] != 0 || offsets[header->names] != header->chars)
+            throw FormatError("binary tree names don't match their characters");
+        for (uint32_t id = 0; id < header->nodes; ++id) {
+            const BinaryNode &node = nodes[id];
+            if (node.next <= id || node.next > header->nodes)
+                throw FormatError("binary tree node has a bad subtree end");
+            if (id == 0 ? node.parent != none
+                        : node.parent >= id || node.next > nodes[node.parent].next)
+                throw FormatError("binary tree node has a bad parent");
+        }
+    }
+
+    // Node 0 is the root.
+    std::size_t size() const
+    {
+        return header->nodes;
+    }
+
+    const BinaryNode &operator [](uint32_t id) const
+    {
+        return nodes[id];
+    }
+
+    uint32_t first_child(uint32_t id) const
+    {
+        return nodes[id].next > id + 1 ? id + 1 : none;
+    }
+
+    uint32_t next_sibling(uint32_t id) const
+    {
+        const uint32_t parent = nodes[id].parent;
+        return parent != none && nodes[id].next < nodes[parent].next ? nodes[id].next : none;
+    }
+
+    vemalex::TokenView<const char *> name(uint32_t kind) const
+    {
+        if (kind >= header->names)
+            return vemalex::TokenView<const char *>();
+        return vemalex::TokenView<const char *>(chars + offsets[kind], chars + offsets[kind + 1]);
+    }
+};
+
+}
+
+#endif
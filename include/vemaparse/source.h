@@ -0,0 +1,294 @@
+
+#ifndef VEMAPARSE_SOURCE_H_
+#define VEMAPARSE_SOURCE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "lexer.h"
+
+namespace vemalex
+{
+
+struct SourceError : public LexerError
+{
+    SourceError(const std::string &error) : LexerError(error) { }
+};
+
+// Read-only mapping of a whole file. Lex it through Lexer<const char *>
+// so the input is never copied:
+//
+//   vemalex::MappedSource source(path);
+//   vemalex::Lexer<const char *> lexer(source.begin(), source.end());
+class MappedSource
+{
+    const char *data_;
+    std::size_t size_;
+#if defined(_WIN32)
+    HANDLE mapping;
+#endif
+
+    void release()
+    {
+        if (!size_)
+            return;
+#if defined(_WIN32)
+        ::UnmapViewOfFile(data_);
+        ::CloseHandle(mapping);
+#else
+        ::munmap(const_cast<char *>(data_), size_);
+#endif
+    }
+
+public:
+    MappedSource() : data_(""), size_(0) { }
+
+    explicit MappedSource(const std::string &path) : data_(""), size_(0)
+    {
+#if defined(_WIN32)
+        HANDLE file = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            throw SourceError("could not open " + path);
+        LARGE_INTEGER size;
+        if (!::GetFileSizeEx(file, &size)) {
+            ::CloseHandle(file);
+            throw SourceError("could not stat " + path);
+        }
+        if (size.QuadPart) {
+            mapping = ::CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            const void *view = mapping ? ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+            if (!view) {
+                if (mapping)
+                    ::CloseHandle(mapping);
+                ::CloseHandle(file);
+                throw SourceError("could not map " + path);
+            }
+            data_ = static_cast<const char *>(view);
+            size_ = std::size_t(size.QuadPart);
+        }
+        ::CloseHandle(file);
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw SourceError("could not open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw SourceError("could not stat " + path);
+        }
+        if (st.st_size) {
+            void *map = ::mmap(NULL, std::size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                ::close(fd);
+                throw SourceError("could not map " + path);
+            }
+#if defined(MADV_SEQUENTIAL)
+            ::madvise(map, std::size_t(st.st_size), MADV_SEQUENTIAL);
+#endif
+            data_ = static_cast<const char *>(map);
+            size_ = std::size_t(st.st_size);
+        }
+        ::close(fd);
+#endif
+    }
+
+    MappedSource(MappedSource &&other) : data_(other.data_), size_(other.size_)
+    {
+#if defined(_WIN32)
+        mapping = other.mapping;
+#endif
+        other.data_ = "";
+        other.size_ = 0;
+    }
+
+    MappedSource &operator =(MappedSource &&other)
+    {
+        if (this != &other) {
+            release();
+            data_ = other.data_;
+            size_ = other.size_;
+#if defined(_WIN32)
+            mapping = other.mapping;
+#endif
+            other.data_ = "";
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    MappedSource(const MappedSource &) = delete;
+    MappedSource &operator =(const MappedSource &) = delete;
+
+    ~MappedSource()
+    {
+        release();
+    }
+
+    const char *begin() const {return data_;}
+    const char *end() const {return data_ + size_;}
+    const char *data() const {return data_;}
+    std::size_t size() const {return size_;}
+    bool empty() const {return size_ == 0;}
+};
+
+// The size of the file at path, without opening it. False if it can't be
+// looked at.
+inline bool file_size(const std::string &path, std::size_t &size)
+{
+#if defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!::GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+        return false;
+    size = std::size_t((uint64_t(data.nFileSizeHigh) << 32) | data.nFileSizeLow);
+#else
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return false;
+    size = std::size_t(st.st_size);
+#endif
+    return true;
+}
+
+// Append the paths of the files under directory and its subdirectories,
+// in no particular order.
+inline void list_files(const std::string &directory, std::vector<std::string> &paths)
+{
+#if defined(_WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE find = ::FindFirstFileA((directory + "\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+        throw SourceError("could not list " + directory);
+    try {
+        do {
+            const std::string name = data.cFileName;
+            if (name == "." || name == "..")
+                continue;
+            if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                list_files(directory + "\\" + name, paths);
+            else
+                paths.push_back(directory + "\\" + name);
+        } while (::FindNextFileA(find, &data));
+    } catch (...) {
+        ::FindClose(find);
+        throw;
+    }
+    ::FindClose(find);
+#else
+    DIR *dir = ::opendir(directory.c_str());
+    if (!dir)
+        throw SourceError("could not list " + directory);
+    try {
+        while (const struct dirent *entry = ::readdir(dir)) {
+            const std::string name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+            const std::string path = directory + "/" + name;
+            bool is_dir = false, is_file = false;
+#if defined(DT_DIR)
+            is_dir = entry->d_type == DT_DIR;
+            is_file = entry->d_type == DT_REG;
+            if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+#endif
+            {
+                struct stat st;
+                if (::stat(path.c_str(), &st) == 0) {
+                    is_dir = S_ISDIR(st.st_mode);
+                    is_file = S_ISREG(st.st_mode);
+                }
+            }
+            if (is_dir)
+                list_files(path, paths);
+            else if (is_file)
+                paths.push_back(path);
+        }
+    } catch (...) {
+        ::closedir(dir);
+        throw;
+    }
+    ::closedir(dir);
+#endif
+}
+
+// Line and column of an offset into a source, by binary search over the
+// offsets of its newlines. Those are found with memchr for contiguous
+// input, when the first lookup needs them. Lines and columns count from 1.
+// Not safe to share between threads until the first lookup is done.
+template <typename Iterator>
+class LineIndex
+{
+    Iterator begin_, end_;
+    mutable std::vector<std::size_t> newlines;
+    mutable bool built;
+
+    const std::vector<std::size_t> &index() const
+    {
+        if (!built) {
+            typedef detail::Scanner<Iterator> scanner;
+            for (Iterator cur = scanner::find_newline(begin_, end_); cur != end_;
+                 cur = scanner::find_newline(++cur, end_))
+                newlines.push_back(std::size_t(cur - begin_));
+            built = true;
+        }
+        return newlines;
+    }
+
+public:
+    LineIndex(Iterator begin, Iterator end) : begin_(begin), end_(end), built(false) { }
+
+    // The line offset is on; a newline is the last character of its line.
+    std::size_t line(std::size_t offset) const
+    {
+        const std::vector<std::size_t> &nl = index();
+        return std::size_t(std::lower_bound(nl.begin(), nl.end(), offset) - nl.begin()) + 1;
+    }
+
+    std::size_t column(std::size_t offset) const
+    {
+        return offset - line_begin(line(offset)) + 1;
+    }
+
+    std::size_t lines() const
+    {
+        return index().size() + 1;
+    }
+
+    // Offset of the first character of line.
+    std::size_t line_begin(std::size_t line) const
+    {
+        return line > 1 ? index()[line - 2] + 1 : 0;
+    }
+
+    // Offset of line's newline, or of the end of the input for the last.
+    std::size_t line_end(std::size_t line) const
+    {
+        const std::vector<std::size_t> &nl = index();
+        return line <= nl.size() ? nl[line - 1] : std::size_t(end_ - begin_);
+    }
+
+    // Line without its newline.
+    std::string text(std::size_t line) const
+    {
+        return std::string(begin_ + line_begin(line), begin_ + line_end(line));
+    }
+};
+
+}
+
+#endif
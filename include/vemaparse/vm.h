@@ -0,0 +1,454 @@
+
+#ifndef VEMAPARSE_VM_H_
+#define VEMAPARSE_VM_H_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+#include "parser.h"
+
+namespace vemaparse
+{
+
+// A grammar compiled to one instruction per rule, run by a loop with an
+// explicit stack instead of std::function calls and recursion. It builds
+// exactly the matches, memo entries and lookahead that get_match would:
+//
+//   vemaparse::Program<TokenStream::iterator, Node> program(grammar);
+//   Match *tree = program.match(ctx, tokens.begin(), tokens.end());
+//
+// Rules with Rule::CUSTOM kind are run through their match function, and
+// whatever those call runs through get_match. A Program is read-only once
+// built, like its Grammar.
+template <typename Iterator, typename ActionType>
+class Program
+{
+public:
+    typedef Rule<Iterator, ActionType> rule_type;
+    typedef Match<Iterator, ActionType> match_type;
+    typedef match_type *rule_result;
+    typedef ParseContext<Iterator, ActionType> context_type;
+
+    // op is the rule's Rule::Kind; a and b are the child rule ids, or the
+    // token kind for TERMINAL and the index into literals for LITERAL.
+    struct Instruction
+    {
+        uint8_t op;
+        bool must_consume_token;
+        bool check;
+        bool memoized;
+        uint32_t a, b;
+    };
+
+private:
+    const Grammar<Iterator, ActionType> &grammar;
+    std::vector<Instruction> code;
+    std::vector<std::string> literals;
+
+    struct Frame
+    {
+        uint32_t rule;
+        uint32_t state;
+        Iterator pos;
+        // Loop position for STAR and NON_GREEDY.
+        Iterator cur;
+        // The match being built, as in MatchBuilder.
+        std::size_t mark;
+        bool matched;
+        bool matched_right;
+        Iterator end;
+        // CHOICE's failed first alternative.
+        rule_result left;
+        // The caller's lookahead, as saved by get_match.
+        std::size_t examined;
+        // Where its ParseContext::log_enter() went.
+        std::size_t event;
+    };
+
+    void propagate(context_type &ctx, Frame &f, rule_result child) const
+    {
+        f.matched = child->matched;
+        f.end = child->end;
+        if (!child->committed)
+            ctx.arena.push(child);
+    }
+
+    rule_result build(context_type &ctx, Frame &f) const
+    {
+        return ctx.arena.make(f.matched, f.end, f.mark);
+    }
+
+    // No children, as with Rule::get_match's check for ParseContext::expect.
+    bool leaf(uint8_t op, uint32_t rule) const
+    {
+        return op == rule_type::TERMINAL || op == rule_type::LITERAL ||
+               (op == rule_type::CUSTOM && grammar.rule(rule)->children.empty());
+    }
+
+    rule_result token(context_type &ctx, const Instruction &in, Iterator pos) const
+    {
+        bool matched;
+        if (in.op == rule_type::TERMINAL) {
+            matched = pos.token == int(in.a);
+        } else {
+            const std::string &text = literals[in.a];
+            matched = (*pos).equals(text.data(), text.size());
+        }
+        return ctx.arena.make(matched, matched ? ++pos : pos);
+    }
+
+    rule_result failed(context_type &ctx, const vemalex::LexerError &ex, Iterator pos, std::size_t examined,
+                       std::size_t event) const
+    {
+        ctx.lexer_error = ex.what();
+        rule_result ret = ctx.arena.make(false, pos);
+        ret->begin = pos;
+        ret->examined = ctx.examined;
+        ctx.examined = std::max(examined, ret->examined);
+        ctx.log_leave(event, ret);
+        return ret;
+    }
+
+    // The end of get_match, given the caller's lookahead.
+    rule_result finish(context_type &ctx, uint32_t rule, Iterator pos, std::size_t examined, std::size_t event,
+                       rule_result ret) const
+    {
+        const Instruction &in = code[rule];
+        assert(ret->matched || ret->end == pos);
+        ret->begin = pos;
+        ret->rule = rule;
+        ret->examined = std::max(ctx.examined, ret->end.position() + 1);
+        ctx.examined = std::max(examined, ret->examined);
+        if (in.check) {
+            ret->matched = grammar.rule(rule)->check(*ret);
+            if (!ret->matched)
+                ret->end = pos;
+        }
+        if (!ret->matched && leaf(in.op, rule))
+            ctx.expect(rule, pos.position());
+        if (in.memoized) {
+            ctx.memo_for(pos).insert(rule, pos.position(), ret);
+            ret->memoized = true;
+        }
+        if (ctx.memo_profile)
+            ++ctx.memo_profile->matches[rule];
+        ctx.log_leave(event, ret);
+        return ret;
+    }
+
+    // The start of get_match: the result if there is one already, or NULL
+    // with a new frame on the stack. Tokens are matched right away.
+    rule_result call(context_type &ctx, std::vector<Frame> &stack, uint32_t rule, Iterator pos, Iterator eos) const
+    {
+        const Instruction &in = code[rule];
+        const std::size_t position = pos.position();
+        if (in.must_consume_token && pos == eos) {
+            rule_result ret = ctx.arena.make(false, eos);
+            ret->begin = pos;
+            ret->examined = position + 1;
+            ctx.examined = std::max(ctx.examined, ret->examined);
+            if (leaf(in.op, rule))
+                ctx.expect(rule, position);
+            else
+                ctx.expect(grammar.rule(rule)->first_set.rules, position);
+            return ret;
+        }
+        if (in.memoized) {
+            const rule_result *memo = ctx.memo_for(pos).find(rule, position);
+            if (memo) {
+                if (ctx.memo_profile)
+                    ++ctx.memo_profile->hits[rule];
+                ctx.examined = std::max(ctx.examined, (*memo)->examined);
+                ctx.log_hit(**memo);
+                return *memo;
+            }
+        }
+        const std::size_t examined = ctx.examined;
+        ctx.examined = position + 1;
+        const std::size_t event = ctx.log_enter(rule, position);
+        if (in.op == rule_type::TERMINAL || in.op == rule_type::LITERAL) {
+            rule_result ret;
+            try {
+                ret = token(ctx, in, pos);
+            } catch (const vemalex::LexerError &ex) {
+                return failed(ctx, ex, pos, examined, event);
+            }
+            return finish(ctx, rule, pos, examined, event, ret);
+        }
+        stack.push_back(Frame());
+        Frame &f = stack.back();
+        f.rule = rule;
+        f.state = 0;
+        f.pos = pos;
+        f.examined = examined;
+        f.event = event;
+        return NULL;
+    }
+
+    // Run the top frame until it needs a child matched, which is returned
+    // in callee and at, or has its result.
+    rule_result step(context_type &ctx, Frame &f, rule_result value, Iterator eos, uint32_t &callee, Iterator &at) const
+    {
+        const Instruction &in = code[f.rule];
+        switch (in.op) {
+        case rule_type::SEQUENCE:
+            switch (f.state) {
+            case 0:
+                f.mark = ctx.arena.mark();
+                f.matched = false;
+                f.end = eos;
+                f.state = 1;
+                callee = in.a;
+                at = f.pos;
+                return NULL;
+            case 1:
+                propagate(ctx, f, value);
+                if (!value->matched)
+                    return build(ctx, f);
+                f.state = 2;
+                callee = in.b;
+                at = value->end;
+                return NULL;
+            default:
+                propagate(ctx, f, value);
+                if (!value->matched)
+                    f.end = f.pos;
+                return build(ctx, f);
+            }
+
+        case rule_type::CHOICE:
+            switch (f.state) {
+            case 0:
+            {
+                f.mark = ctx.arena.mark();
+                f.matched = false;
+                f.end = eos;
+                const FirstSet &first = grammar.rule(in.a)->first_set, &second = grammar.rule(in.b)->first_set;
+                const bool try_first = first.may_start(f.pos, eos);
+                const bool try_second = second.may_start(f.pos, eos);
+                if (!try_first)
+                    ctx.expect(first.rules, f.pos.position());
+                if (!try_second)
+                    ctx.expect(second.rules, f.pos.position());
+                if (!try_first && !try_second) {
+                    f.end = f.pos;
+                    return build(ctx, f);
+                }
+                // Only one alternative can start here; take its result.
+                f.state = try_first && try_second ? 1 : 3;
+                callee = try_first ? in.a : in.b;
+                at = f.pos;
+                return NULL;
+            }
+            case 1:
+                if (value->matched) {
+                    propagate(ctx, f, value);
+                    return build(ctx, f);
+                }
+                f.left = value;
+                f.state = 2;
+                callee = in.b;
+                at = f.pos;
+                return NULL;
+            case 3:
+                propagate(ctx, f, value);
+                return build(ctx, f);
+            default:
+                if (value->matched) {
+                    propagate(ctx, f, value);
+                    return build(ctx, f);
+                }
+                // Neither matched; keep the one that got further.
+                if (right_most(*f.left).end - f.pos < right_most(*value).end - f.pos)
+                    propagate(ctx, f, value);
+                else
+                    propagate(ctx, f, f.left);
+                return build(ctx, f);
+            }
+
+        case rule_type::STAR:
+            if (f.state == 0) {
+                f.mark = ctx.arena.mark();
+                f.matched = false;
+                f.end = f.pos;
+                f.cur = f.pos;
+                f.state = 1;
+            } else {
+                propagate(ctx, f, value);
+                f.cur = value->end;
+                if (!value->matched) {
+                    f.matched = true;
+                    return build(ctx, f);
+                }
+            }
+            if (f.cur == eos) {
+                f.matched = true;
+                return build(ctx, f);
+            }
+            callee = in.a;
+            at = f.cur;
+            return NULL;
+
+        case rule_type::NON_GREEDY:
+            switch (f.state) {
+            case 0:
+                f.mark = ctx.arena.mark();
+                f.matched = true;
+                f.matched_right = false;
+                f.end = eos;
+                f.cur = f.pos;
+                break;
+            case 1:
+                // Tried the right side at cur.
+                if (value->matched) {
+                    propagate(ctx, f, value);
+                    f.matched_right = true;
+                    return build(ctx, f);
+                }
+                f.state = 2;
+                callee = in.a;
+                at = f.cur;
+                return NULL;
+            default:
+                // Tried the left side at cur; stop if it failed or matched
+                // nothing, or that would loop forever.
+                propagate(ctx, f, value);
+                if (!value->matched || value->end == f.cur) {
+                    f.matched = false;
+                    f.end = f.pos;
+                    return build(ctx, f);
+                }
+                f.cur = value->end;
+                break;
+            }
+            if (f.cur == eos) {
+                f.matched = false;
+                f.end = f.pos;
+                return build(ctx, f);
+            }
+            f.state = 1;
+            callee = in.b;
+            at = f.cur;
+            return NULL;
+
+        case rule_type::OPTIONAL:
+            if (f.state == 0) {
+                f.mark = ctx.arena.mark();
+                f.matched = false;
+                f.end = eos;
+                if (f.pos == eos)
+                    return build(ctx, f);
+                f.state = 1;
+                callee = in.a;
+                at = f.pos;
+                return NULL;
+            }
+            propagate(ctx, f, value);
+            f.matched = true;
+            return build(ctx, f);
+
+        case rule_type::NOT:
+            if (f.state == 0) {
+                if (f.pos == eos)
+                    return ctx.arena.make(false, eos);
+                f.state = 1;
+                callee = in.a;
+                at = f.pos;
+                return NULL;
+            } else {
+                const bool matched = !value->matched;
+                Iterator pos = f.pos;
+                return ctx.arena.make(matched, matched ? ++pos : pos);
+            }
+
+        default:
+            return grammar.rule(f.rule)->match(ctx, f.pos, eos);
+        }
+    }
+
+public:
+    Program(const Grammar<Iterator, ActionType> &grammar_) : grammar(grammar_)
+    {
+        code.reserve(grammar.size());
+        for (uint32_t id = 0; id < grammar.size(); ++id) {
+            const rule_type &rule = *grammar.rule(id).operator ->();
+            Instruction in = {uint8_t(rule.kind), rule.must_consume_token, bool(rule.check), rule.memoized, 0, 0};
+            switch (rule.kind) {
+            case rule_type::TERMINAL:
+                in.a = uint32_t(rule.token);
+                break;
+            case rule_type::LITERAL:
+                in.a = uint32_t(literals.size());
+                literals.push_back(rule.text);
+                break;
+            case rule_type::SEQUENCE:
+            case rule_type::CHOICE:
+            case rule_type::NON_GREEDY:
+                assert(rule.children.size() == 2);
+                in.a = rule.children[0]->id;
+                in.b = rule.children[1]->id;
+                break;
+            case rule_type::STAR:
+            case rule_type::OPTIONAL:
+            case rule_type::NOT:
+                assert(rule.children.size() == 1);
+                in.a = rule.children[0]->id;
+                break;
+            default:
+                in.op = rule_type::CUSTOM;
+                break;
+            }
+            code.push_back(in);
+        }
+    }
+
+    std::size_t size() const
+    {
+        return code.size();
+    }
+
+    const Instruction &operator [](uint32_t rule) const
+    {
+        return code[rule];
+    }
+
+    // Same as grammar.rule(rule)->get_match(ctx, pos, eos).
+    rule_result match(context_type &ctx, uint32_t rule, Iterator pos, Iterator eos) const
+    {
+        std::vector<Frame> stack;
+        stack.reserve(64);
+        rule_result value = call(ctx, stack, rule, pos, eos);
+        while (!stack.empty()) {
+            uint32_t callee = 0;
+            Iterator at;
+            rule_result ret;
+            try {
+                ret = step(ctx, stack.back(), value, eos, callee, at);
+            } catch (const vemalex::LexerError &ex) {
+                const Frame f = stack.back();
+                stack.pop_back();
+                value = failed(ctx, ex, f.pos, f.examined, f.event);
+                continue;
+            }
+            if (ret) {
+                const Frame f = stack.back();
+                stack.pop_back();
+                value = finish(ctx, f.rule, f.pos, f.examined, f.event, ret);
+            } else {
+                value = call(ctx, stack, callee, at, eos);
+            }
+        }
+        return value;
+    }
+
+    rule_result match(context_type &ctx, Iterator pos, Iterator eos) const
+    {
+        return match(ctx, 0, pos, eos);
+    }
+};
+
+}
+
+#endif
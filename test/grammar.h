@@ -0,0 +1,133 @@
+#ifndef VEMATEST_GRAMMAR_H_
+#define VEMATEST_GRAMMAR_H_
+
+// The test grammar, shared by vematest and vemabench.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <memory>
+#include <vemaparse/lexer.h>
+#include <vemaparse/parser.h>
+#include <vemaparse/ast.h>
+
+struct Node;
+
+typedef vemalex::Lexer<const char *> Lexer;
+typedef vemalex::TokenStream<const char *> TokenStream;
+typedef vemaparse::Match<TokenStream::iterator, Node> Match;
+typedef vemaparse::RuleWrapper<TokenStream::iterator, Node> Rule;
+typedef vemaparse::Grammar<TokenStream::iterator, Node> Grammar;
+typedef vemaparse::ParseContext<TokenStream::iterator, Node> ParseContext;
+
+struct Node
+{
+    typedef std::shared_ptr<Node> node_ptr;
+    typedef std::list<std::shared_ptr<Node>>::iterator child_iterator_type;
+
+    std::string name;
+    std::string text;
+    node_ptr parent;
+    std::list<std::shared_ptr<Node>> children;
+};
+
+inline Rule r(const std::string &regex, const std::string name = "")
+{
+    auto regex_helper_action = [regex](Node &n){std::cout << "regex match " << regex << " -> " << n.text << std::endl;};
+    auto rule = vemaparse::regex<TokenStream::iterator, Node>(regex);
+    if (!name.empty())
+        rule->name = name;
+    rule->action = regex_helper_action;
+    return rule;
+}
+
+inline Rule t(int id, const std::string name = "token")
+{
+    auto rule = vemaparse::terminal<TokenStream::iterator, Node>(id);
+    if (!name.empty())
+        rule->name = name;
+    return rule;
+}
+
+inline void create_parse_tree(const Grammar &grammar, Match &match, Node::node_ptr parent)
+{
+    const std::string match_string = vemaparse::to_string(match);
+    Node::node_ptr node = std::make_shared<Node>();
+    node->name = grammar.name(match);
+    node->text = match_string;
+    parent->children.push_back(node);
+
+    for (auto c = match.children.begin(); c != match.children.end(); ++c) 
+        create_parse_tree(grammar, **c, node);
+}
+
+inline void visit_match(const Grammar &grammar, Match &match, Node::node_ptr parent, bool failed = false)
+{
+    const std::string &match_string = vemaparse::to_string(match);
+    if (match_string.empty() && !failed) {
+        return;
+    }
+
+    Node::node_ptr node = std::make_shared<Node>();
+    node->parent = parent;
+    node->name = grammar.name(match);
+    node->text = match_string;
+    parent->children.push_back(node);
+
+    for (auto c = match.children.begin(); c != match.children.end(); ++c) 
+        visit_match(grammar, **c, node, failed);
+
+    const auto &action = grammar.action(match);
+    if (action) {
+        action(*node);
+    } else {
+        ast::skip_node(*node);
+    }
+}
+
+// With stream set, each top level item is cut so it can be consumed as
+// soon as it has been parsed.
+inline Rule grammar(bool stream = false)
+{
+    auto open_comment = r("/\\*.*");
+    auto close_comment = r("[^\\\\]*\\*/");
+    auto anything = r(".*");
+    auto comment = (t(vemalex::COMMENT) | (open_comment >> (anything / close_comment)));
+    comment->name = "comment";
+
+    auto id = t(vemalex::IDENTIFIER);
+    id->name = "id";
+
+    auto semi = r(";");
+    semi->name = "semi";
+
+    auto include = r("#") >> r("include") >> (t(vemalex::STRING_LITERAL) | (r("<") >> t(vemalex::IDENTIFIER) >> r(">")));
+    include->name = "include";
+
+    auto keyword = r("int") | r("float") | r("double");
+    keyword->name = "keyword";
+    auto declaration = keyword >> id >> (anything / semi);
+    declaration->name = "declaration";
+
+    auto expression = Rule::create_empty_rule();
+    expression->name = "expression";
+    auto subexpression = r("\\(") >> expression >> r("\\)");
+    subexpression->name = "subexpression";
+    expression = subexpression | anything;
+
+    auto block = Rule::create_empty_rule();
+    auto statement = Rule::create_empty_rule();
+    block = (r("\\{") >> r("\\}")) |
+            (r("\\{") >> (+statement) >> r("\\}"));
+
+    auto if_statement = (r("if") >> r("\\(") >> expression >> r("\\)") >> statement >> r("else") >> statement) |
+                        (r("if") >> r("\\(") >> expression >> r("\\)") >> statement);
+
+    statement = (expression >> r(";")) | block | if_statement;
+
+    auto item = comment | include | declaration | statement;
+    return stream ? +vemaparse::cut(item) : +item;
+}
+
+#endif
@@ -1,196 +1,1278 @@
 
+// For --profile; a context without a profiler costs one check per call.
+#define VEMAPARSE_PROFILE
+
 #include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <fstream>
 #include <iomanip>
 #include <vector>
 #include <list>
+#include <iterator>
+#include <chrono>
 #include <vemaparse/lexer.h>
+#include <vemaparse/source.h>
 #include <vemaparse/parser.h>
+#include <vemaparse/parallel.h>
+#include <vemaparse/vm.h>
+#include <vemaparse/fixed.h>
 #include <vemaparse/ast.h>
+#include <vemaparse/serialize.h>
+#include <vemaparse/cache.h>
+#include <vemaparse/batch.h>
+#include "grammar.h"
 
-struct Node;
+typedef vemaparse::ParallelParser<TokenStream::iterator, Node> ParallelParser;
+typedef vemaparse::Program<TokenStream::iterator, Node> Program;
 
-typedef vemalex::Lexer<std::string::iterator> Lexer;
-typedef vemaparse::Match<Lexer::iterator, Node> Match;
-typedef vemaparse::RuleWrapper<Lexer::iterator, Node> Rule;
+// What a token rule that failed was looking for.
+std::string expected_token(const Grammar &grammar, uint32_t id)
+{
+    const auto &rule = grammar.rule(id);
+    if (rule->kind == vemaparse::RuleKind::LITERAL)
+        return "'" + rule->text + "'";
+    return grammar.name(id);
+}
 
-struct Node
+std::size_t count_matches(const Match &match)
 {
-    typedef std::shared_ptr<Node> node_ptr;
-    typedef std::list<std::shared_ptr<Node>>::iterator child_iterator_type;
+    std::size_t ret = 1;
+    for (auto c = match.children.begin(); c != match.children.end(); ++c)
+        ret += count_matches(**c);
+    return ret;
+}
 
-    std::string name;
-    std::string text;
-    node_ptr parent;
-    std::list<std::shared_ptr<Node>> children;
-    std::string debug(std::ostream &stream)
+// Parse item by item, dropping each subtree once it is complete, and
+// report how much arena memory that needed.
+int stream_parse(const TokenStream &tokens)
+{
+    auto start = grammar(true);
+    Grammar compiled(start);
+    ParseContext ctx(compiled);
+    std::size_t items = 0, matches = 0, peak = 0;
+    ctx.on_commit = [&](Match &m) {
+        ++items;
+        matches += count_matches(m);
+        peak = std::max(peak, ctx.arena.size());
+    };
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    const bool failed = ret->end != tokens.end();
+    std::cout << items << " items, " << matches << " matches, peak arena " << peak << " bytes\n";
+    if (failed)
+        std::cerr << "ERROR: failed to parse\n";
+    start->reset();
+    return failed ? 1 : 0;
+}
+
+// Builds the same AST as visit_match, from an event log.
+struct AstBuilder
+{
+    const Grammar &grammar;
+    const TokenStream &tokens;
+    std::vector<Node::node_ptr> stack;
+
+    AstBuilder(const Grammar &grammar_, const TokenStream &tokens_, Node::node_ptr root)
+        : grammar(grammar_), tokens(tokens_), stack(1, root) { }
+
+    void enter(const vemaparse::Event &e)
     {
-        static uint64_t counter = 0;
-        std::string name = std::regex_replace(this->name, std::regex(" |-|>|\n|\r|\\\\|\\(|\\)"), std::string("_"));
-        {
-            std::ostringstream ss;
-            ss << name << counter++;
-            name = ss.str();
+        Node::node_ptr node = std::make_shared<Node>();
+        node->parent = stack.back();
+        node->name = grammar.name(e.rule);
+        for (TokenStream::iterator iter(&tokens, e.begin, true); iter.position() < e.end; ++iter) {
+            auto text = *iter;
+            node->text.append(text.begin(), text.end());
         }
+        stack.back()->children.push_back(node);
+        stack.push_back(node);
+    }
 
-        std::string label = this->text;
-        label = std::regex_replace(label, std::regex("(?!\\\\)\""), std::string("\\\""));
-        label = std::regex_replace(label, std::regex("\n|\r"), std::string("_"));
-        stream << name << " [label=\"" << this->name << " - " << label << "\"];" << std::endl;
+    void leave(const vemaparse::Event &e)
+    {
+        Node::node_ptr node = stack.back();
+        stack.pop_back();
+        const auto &action = grammar.action(e.rule);
+        if (action)
+            action(*node);
+        else
+            ast::skip_node(*node);
+    }
 
-        std::vector<std::string> names;
-        for (auto iter = this->children.cbegin(); iter != this->children.cend(); ++iter)
-            names.push_back((*iter)->debug(stream));
-        for (auto iter = names.begin(); iter != names.end(); ++iter)
-            stream << name << " -> " << (*iter) << ";" << std::endl;
-        return name;
+    void token(const vemaparse::Event &e)
+    {
+        enter(e);
+        leave(e);
     }
 };
 
-Rule r(const std::string &regex, const std::string name = "")
+// Node names and text for writing an ast::Tree.
+struct TreeName
 {
-    auto regex_helper_action = [regex](Node &n){std::cout << "regex match " << regex << " -> " << n.text << std::endl;};
-    auto rule = vemaparse::regex<Lexer::iterator, Node>(regex);
-    if (!name.empty())
-        rule->name = name;
-    rule->action = regex_helper_action;
-    return rule;
+    const Grammar &grammar;
+
+    explicit TreeName(const Grammar &grammar_) : grammar(grammar_) { }
+
+    const std::string &operator ()(uint32_t kind) const
+    {
+        static const std::string root("root");
+        return kind == ast::Tree::none ? root : grammar.name(kind);
+    }
+};
+
+struct TreeText
+{
+    const TokenStream &tokens;
+    const ast::Tree &tree;
+
+    TreeText(const TokenStream &tokens_, const ast::Tree &tree_) : tokens(tokens_), tree(tree_) { }
+
+    void operator ()(uint32_t id, std::string &buffer) const
+    {
+        const ast::Tree::Node &node = tree[id];
+        for (TokenStream::iterator iter(&tokens, node.begin, true); iter.position() < node.end; ++iter) {
+            auto token = *iter;
+            buffer.append(token.begin(), token.end());
+        }
+    }
+};
+
+// The AST as an ast::Tree, skipping the nodes without an action like
+// visit_match does.
+void build_tree(const Grammar &grammar, const Match &match, bool failed, ast::Tree &tree)
+{
+    auto skip = [&grammar](ast::Tree &t, uint32_t id) {
+        if (!grammar.action(t[id].kind))
+            t.skip(id);
+    };
+    for (auto iter = match.children.begin(); iter != match.children.end(); ++iter)
+        tree.append(tree.root(), **iter, skip, failed);
+    tree.compact();
 }
 
-Rule t(int id, const std::string name = "token")
+// Build the AST as an ast::Tree into tree.dot, which should match ast.dot, and time it
+// against visit_match.
+int tree_parse(const TokenStream &tokens)
 {
-    auto rule = vemaparse::terminal<Lexer::iterator, Node>(id);
-    if (!name.empty())
-        rule->name = name;
-    return rule;
+    typedef std::chrono::steady_clock clock;
+    auto start = grammar();
+    Grammar compiled(start);
+    ParseContext ctx(compiled);
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    const bool failed = ret->end != tokens.end();
+    if (failed)
+        std::cerr << "ERROR: failed to parse\n";
+
+    clock::time_point begin = clock::now();
+    ast::Tree tree;
+    build_tree(compiled, *ret, failed, tree);
+    const double tree_time = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+
+    // The actions print.
+    std::streambuf *out = std::cout.rdbuf(NULL);
+    begin = clock::now();
+    Node::node_ptr root = std::make_shared<Node>();
+    for (auto iter = ret->children.begin(); iter != ret->children.end(); ++iter)
+        visit_match(compiled, **iter, root, failed);
+    const double node_time = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+    std::cout.rdbuf(out);
+
+    std::size_t nodes = 0;
+    tree.preorder([&nodes](uint32_t, uint32_t) {++nodes;});
+    std::cout << nodes << " nodes, tree " << tree_time << " ms, visit_match " << node_time << " ms\n";
+    std::ofstream ofs("tree.dot", std::ios::binary | std::ios::trunc);
+    ast::Writer writer(ofs);
+    ast::write_dot(writer, tree, TreeName(compiled), TreeText(tokens, tree));
+    start->reset();
+    return failed ? 1 : 0;
 }
 
-template <typename Iterator, typename LexerIterator>
-std::string get_line(const Iterator &begin, const Iterator &end, const LexerIterator &lex_iter)
+// Whether walking binary with first_child and next_sibling visits the
+// nodes of tree in the same order, with the same kinds, names and spans.
+bool same_tree(const Grammar &grammar, const ast::Tree &tree, const ast::BinaryTree &binary)
 {
-    std::string line_string;
-    // get the line number
-    {
-        int line_number = 1;
-        Iterator i = begin;
-        while (i != lex_iter.begin) {
-            if (*i++ == '\n')
-                ++line_number;
+    std::vector<uint32_t> walked;
+    uint32_t id = 0;
+    while (true) {
+        walked.push_back(id);
+        if (binary.first_child(id) != ast::BinaryTree::none) {
+            id = binary.first_child(id);
+            continue;
         }
-        std::ostringstream ss;
-        ss << line_number;
-        line_string = ss.str() + ": ";
+        while (id != 0 && binary.next_sibling(id) == ast::BinaryTree::none)
+            id = binary[id].parent;
+        if (id == 0)
+            break;
+        id = binary.next_sibling(id);
     }
 
-    // get the line
-    {
-        Iterator b, e;
-        b = lex_iter.begin;
-        e = lex_iter.end;
-        if (b == end)
-            --b;
-        while (b != begin && (*b != '\n'))
-            --b;
-        if (*b == '\n')
-            ++b;
-        while (e != end && (*e != '\n'))
-            ++e;
-        // TODO: make this faster
-        std::for_each(b, e, [&line_string](char c) {line_string += c;});
+    std::size_t i = 0;
+    bool same = true;
+    tree.preorder([&](uint32_t node_id, uint32_t) {
+        const ast::Tree::Node &node = tree[node_id];
+        if (i >= walked.size() || walked[i] != i)
+            same = false;
+        else if (binary[i].kind != node.kind || binary[i].begin != node.begin || binary[i].end != node.end)
+            same = false;
+        else if (node.kind != ast::Tree::none && binary.name(node.kind) != grammar.name(node.kind))
+            same = false;
+        ++i;
+    });
+    return same && i == walked.size();
+}
+
+// Whether BinaryTree refuses data with word index set to value.
+bool rejects(const vemalex::MappedSource &mapped, std::size_t index, uint32_t value)
+{
+    std::vector<uint32_t> words(mapped.size() / 4 + 1);
+    std::memcpy(&words[0], mapped.begin(), mapped.size());
+    words[index] = value;
+    const char *begin = reinterpret_cast<const char *>(&words[0]);
+    try {
+        ast::BinaryTree(begin, begin + mapped.size());
+    } catch (const ast::FormatError &) {
+        return true;
     }
-    return line_string;
+    return false;
 }
 
-void create_parse_tree(Match &match, Node::node_ptr parent)
+// Write the AST as DOT, JSON and binary, timing each, and check that the
+// mapped binary file walks like the tree and that corrupted links and name
+// offsets are refused.
+int serialize_parse(const TokenStream &tokens)
 {
-    const std::string match_string = vemaparse::to_string(match);
-    Node::node_ptr node = std::make_shared<Node>();
-    node->name = match.name;
-    node->text = match_string;
-    parent->children.push_back(node);
+    typedef std::chrono::steady_clock clock;
+    auto start = grammar();
+    Grammar compiled(start);
+    ParseContext ctx(compiled);
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    const bool failed = ret->end != tokens.end();
+    if (failed)
+        std::cerr << "ERROR: failed to parse\n";
+    ast::Tree tree;
+    build_tree(compiled, *ret, failed, tree);
+
+    const char *paths[] = {"serialize.dot", "serialize.json", "serialize.bin"};
+    double times[3];
+    for (int i = 0; i < 3; ++i) {
+        const clock::time_point begin = clock::now();
+        std::ofstream ofs(paths[i], std::ios::binary | std::ios::trunc);
+        ast::Writer out(ofs);
+        if (i == 0)
+            ast::write_dot(out, tree, TreeName(compiled), TreeText(tokens, tree));
+        else if (i == 1)
+            ast::write_json(out, tree, TreeName(compiled), TreeText(tokens, tree));
+        else
+            ast::write_binary(out, tree, TreeName(compiled));
+        out.flush();
+        ofs.close();
+        times[i] = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+    }
 
-    for (auto c = match.children.begin(); c != match.children.end(); ++c) 
-        create_parse_tree(**c, node);
+    const clock::time_point begin = clock::now();
+    vemalex::MappedSource mapped(paths[2]);
+    const bool same = same_tree(compiled, tree, ast::BinaryTree(mapped.begin(), mapped.end()));
+    const double walk_time = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+    std::cout << ast::BinaryTree(mapped.begin(), mapped.end()).size() << " nodes, dot " << times[0] << " ms, json "
+              << times[1] << " ms, binary " << times[2] << " ms (" << mapped.size() << " bytes), map, walk and compare "
+              << walk_time << " ms\n";
+    if (!same) {
+        std::cerr << "ERROR: binary tree differs\n";
+        return 1;
+    }
+    const std::size_t header = sizeof(ast::BinaryHeader) / 4, node = sizeof(ast::BinaryNode) / 4;
+    const std::size_t nodes = ast::BinaryTree(mapped.begin(), mapped.end()).size();
+    const std::size_t last = header + (nodes - 1) * node;
+    if (nodes < 2 || !rejects(mapped, last + 3, uint32_t(nodes - 1)) || !rejects(mapped, last + 4, uint32_t(nodes + 1)) ||
+        !rejects(mapped, header + 3, 0) || !rejects(mapped, header + nodes * node + 1, 1u << 30)) {
+        std::cerr << "ERROR: corrupted binary tree accepted\n";
+        return 1;
+    }
+    start->reset();
+    return failed ? 1 : 0;
 }
 
-void visit_match(Match &match, Node::node_ptr parent, bool failed = false)
+// Without failed, children that didn't match are left out.
+void dump_matches(const Grammar &grammar, const Match &match, std::ostream &out, bool failed = true)
 {
-    const std::string &match_string = vemaparse::to_string(match);
-    if (match_string.empty() && !failed) {
+    out << grammar.name(match) << ' ' << match.matched << ' ' << match.begin.position() << ' ' << match.end.position() << " (";
+    for (auto c = match.children.begin(); c != match.children.end(); ++c)
+        if (failed || (*c)->matched)
+            dump_matches(grammar, **c, out, failed);
+    out << ')';
+}
+
+// Insert a declaration at a few line starts and take it out again,
+// reparsing incrementally after each edit, and check every tree against a
+// parse from scratch.
+int incremental_parse(const vemalex::MappedSource &input)
+{
+    typedef std::chrono::steady_clock clock;
+    std::string text(input.begin(), input.end());
+    std::vector<std::size_t> lines(1, 0);
+    for (std::size_t i = 0; i < text.size(); ++i)
+        if (text[i] == '\n' && i + 1 < text.size())
+            lines.push_back(i + 1);
+
+    auto start = grammar();
+    Grammar compiled(start);
+    TokenStream tokens(Lexer(text.data(), text.data() + text.size()));
+    ParseContext ctx(compiled, tokens.size() + 1);
+    start->get_match(ctx, tokens.begin(), tokens.end());
+
+    const std::string declaration = "int inserted;\n";
+    const std::size_t edits = std::min<std::size_t>(lines.size(), 16);
+    double incremental = 0, full = 0;
+    int failed = 0;
+    ParseContext fresh(compiled);
+    for (std::size_t i = 0; i < 2 * edits; ++i) {
+        const std::size_t offset = lines[(i / 2) * lines.size() / edits];
+        std::size_t removed = 0, inserted = 0;
+        if (i % 2 == 0) {
+            text.insert(offset, declaration);
+            inserted = declaration.size();
+        } else {
+            text.erase(offset, declaration.size());
+            removed = declaration.size();
+        }
+        Lexer lexer(text.data(), text.data() + text.size());
+
+        clock::time_point begin = clock::now();
+        Match *ret = vemaparse::reparse(compiled, ctx, tokens, lexer, offset, removed, inserted);
+        incremental += std::chrono::duration<double>(clock::now() - begin).count();
+
+        begin = clock::now();
+        TokenStream fresh_tokens(lexer);
+        fresh.reset(fresh_tokens.size() + 1);
+        Match *expected = start->get_match(fresh, fresh_tokens.begin(), fresh_tokens.end());
+        full += std::chrono::duration<double>(clock::now() - begin).count();
+
+        std::ostringstream a, b;
+        dump_matches(compiled, *ret, a);
+        dump_matches(compiled, *expected, b);
+        if (a.str() != b.str()) {
+            std::cerr << "ERROR: incremental parse differs after edit " << i << " at offset " << offset << std::endl;
+            ++failed;
+        }
+    }
+    std::cout << 2 * edits << " edits, " << failed << " mismatches, incremental "
+              << incremental * 1000 << " ms, full " << full * 1000 << " ms\n";
+    start->reset();
+    return failed ? 1 : 0;
+}
+
+// Top level items, wherever the tree puts them.
+void collect_items(const Match &match, uint32_t item, std::vector<std::pair<std::size_t, std::size_t>> &items)
+{
+    if (match.rule == item) {
+        items.push_back(std::make_pair(match.begin.position(), match.end.position()));
         return;
     }
+    for (auto c = match.children.begin(); c != match.children.end(); ++c)
+        collect_items(**c, item, items);
+}
+
+// Parse tokens with a ParallelParser and check it builds the same tree as
+// the sequential parse. Unless the input doesn't parse, it must also have
+// been split into chunks that were parsed on the pool.
+bool check_parallel(const Grammar &compiled, const TokenStream &tokens)
+{
+    typedef std::chrono::steady_clock clock;
+    const uint32_t item = compiled.start()->children.front()->id;
+
+    clock::time_point begin = clock::now();
+    ParseContext ctx(compiled, tokens.size() + 1);
+    Match *expected = compiled.start()->get_match(ctx, tokens.begin(), tokens.end());
+    const double sequential = std::chrono::duration<double>(clock::now() - begin).count();
+
+    // Four threads whatever the machine, and chunks small enough for the
+    // test inputs, so the split and join are always exercised.
+    ParallelParser parser(compiled, 4);
+    parser.min_chunk = 16;
+    parser.boundary = [](const TokenStream::iterator &next) {return *next != "else";};
+    begin = clock::now();
+    Match *ret = parser.parse(tokens.begin(), tokens.end());
+    const double parallel = std::chrono::duration<double>(clock::now() - begin).count();
+
+    std::vector<std::pair<std::size_t, std::size_t>> items;
+    collect_items(*ret, item, items);
+    // Lookahead past the end of a chunk fails before reaching any rule, so
+    // only the failed children there can differ.
+    std::ostringstream a, b;
+    dump_matches(compiled, *ret, a, false);
+    dump_matches(compiled, *expected, b, false);
+    const bool same = a.str() == b.str();
+    std::cout << items.size() << " items in " << parser.chunks() << " chunks" << (parser.fell_back() ? " (fell back)" : "")
+              << ", parallel " << parallel * 1000 << " ms, sequential " << sequential * 1000 << " ms\n";
+    if (!same)
+        std::cerr << "ERROR: parallel parse differs from sequential parse\n";
+    const bool parses = expected->matched && expected->end == tokens.end();
+    const bool split = parser.chunks() >= 2 && !parser.fell_back();
+    if (parses && !split)
+        std::cerr << "ERROR: input wasn't parsed in parallel\n";
+    return same && (split || !parses);
+}
+
+// The input and, as it may not split, generated items that do.
+int parallel_parse(const TokenStream &tokens)
+{
+    auto start = grammar();
+    Grammar compiled(start);
+    bool ok = check_parallel(compiled, tokens);
+
+    std::string text;
+    for (int i = 0; i < 64; ++i)
+        text += "int x = 5 ;\n{ a; b; }\nif (c) { d; } else e;\n";
+    const TokenStream generated((Lexer(text.data(), text.data() + text.size())));
+    ok &= check_parallel(compiled, generated);
+    start->reset();
+    return ok ? 0 : 1;
+}
+
+// Parse with the compiled program and check it builds the same tree as
+// get_match.
+int vm_parse(const TokenStream &tokens)
+{
+    typedef std::chrono::steady_clock clock;
+    auto start = grammar();
+    Grammar compiled(start);
+    Program program(compiled);
+
+    clock::time_point begin = clock::now();
+    ParseContext ctx(compiled, tokens.size() + 1);
+    Match *expected = start->get_match(ctx, tokens.begin(), tokens.end());
+    const double recursive = std::chrono::duration<double>(clock::now() - begin).count();
+
+    begin = clock::now();
+    ParseContext vm_ctx(compiled, tokens.size() + 1);
+    Match *ret = program.match(vm_ctx, tokens.begin(), tokens.end());
+    const double vm = std::chrono::duration<double>(clock::now() - begin).count();
+
+    std::ostringstream a, b;
+    dump_matches(compiled, *ret, a);
+    dump_matches(compiled, *expected, b);
+    std::cout << program.size() << " instructions, vm " << vm * 1000 << " ms, get_match " << recursive * 1000 << " ms\n";
+    if (a.str() != b.str()) {
+        std::cerr << "ERROR: program built a different tree\n";
+        return 1;
+    }
+    start->reset();
+    return 0;
+}
+
+// Parse with every rule memoized, with the default memo policy and with the
+// grammar tuned on a profiled parse, and check the trees are the same.
+int memo_parse(const TokenStream &tokens)
+{
+    typedef std::chrono::steady_clock clock;
+    auto start = grammar();
+    Grammar compiled(start);
+    // Best of three
+    auto timed_parse = [&](std::string &dump) -> double {
+        double ret = 0;
+        for (int i = 0; i < 3; ++i) {
+            const clock::time_point begin = clock::now();
+            ParseContext ctx(compiled, tokens.size() + 1);
+            Match *m = start->get_match(ctx, tokens.begin(), tokens.end());
+            const double elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+            ret = i ? std::min(ret, elapsed) : elapsed;
+            std::ostringstream out;
+            dump_matches(compiled, *m, out);
+            dump = out.str();
+        }
+        return ret;
+    };
+
+    vemaparse::MemoProfile profile(compiled.size());
+    {
+        ParseContext ctx(compiled, tokens.size() + 1);
+        ctx.memo_profile = &profile;
+        start->get_match(ctx, tokens.begin(), tokens.end());
+    }
+    std::string automatic, all, tuned;
+    const double automatic_time = timed_parse(automatic);
+    for (uint32_t i = 0; i < compiled.size(); ++i) {
+        Rule rule = compiled.rule(i);
+        rule->memoized = true;
+    }
+    const double all_time = timed_parse(all);
+    // Back to the default policy
+    Grammar retuned(start);
+    const std::size_t off = retuned.tune(profile);
+    const double tuned_time = timed_parse(tuned);
+
+    std::cout << "all memoized " << all_time * 1000 << " ms, auto " << automatic_time * 1000
+              << " ms, tuned (" << off << " more rules not memoized) " << tuned_time * 1000 << " ms\n";
+    if (automatic != all || tuned != all) {
+        std::cerr << "ERROR: memo policy changed the tree\n";
+        return 1;
+    }
+    start->reset();
+    return 0;
+}
+
+// The same grammar, fixed at compile time.
+namespace fixed_grammar
+{
+    using namespace vemaparse::fixed;
+
+    bool line_break(char c)
+    {
+        return c == '\n' || c == '\r';
+    }
+
+    // .*
+    struct any_text
+    {
+        template <typename Text>
+        bool operator ()(const Text &text) const
+        {
+            return std::find_if(text.begin(), text.end(), line_break) == text.end();
+        }
+    };
+
+    // /\*.*
+    struct open_comment_text
+    {
+        template <typename Text>
+        bool operator ()(const Text &text) const
+        {
+            return text.size() >= 2 && text.begin()[0] == '/' && text.begin()[1] == '*' &&
+                   std::find_if(text.begin() + 2, text.end(), line_break) == text.end();
+        }
+    };
+
+    // [^\\]*\*/
+    struct close_comment_text
+    {
+        template <typename Text>
+        bool operator ()(const Text &text) const
+        {
+            const std::size_t n = text.size();
+            return n >= 2 && text.begin()[n - 2] == '*' && text.begin()[n - 1] == '/' &&
+                   std::find(text.begin(), text.end() - 2, '\\') == text.end() - 2;
+        }
+    };
+
+    typedef predicate<any_text> anything;
+
+    struct comment : rule<comment, decltype(token<vemalex::COMMENT>() |
+                                            (predicate<open_comment_text>() >> (anything() / predicate<close_comment_text>())))>
+    {
+        static const char *name() {return "comment";}
+    };
+
+    struct id : rule<id, token<vemalex::IDENTIFIER>>
+    {
+        static const char *name() {return "id";}
+    };
+
+    struct include : rule<include, decltype(lit<'#'>() >> lit<'i', 'n', 'c', 'l', 'u', 'd', 'e'>() >>
+                                            (token<vemalex::STRING_LITERAL>() | (lit<'<'>() >> token<vemalex::IDENTIFIER>() >> lit<'>'>())))>
+    {
+        static const char *name() {return "include";}
+    };
+
+    struct keyword : rule<keyword, decltype(lit<'i', 'n', 't'>() | lit<'f', 'l', 'o', 'a', 't'>() | lit<'d', 'o', 'u', 'b', 'l', 'e'>())>
+    {
+        static const char *name() {return "keyword";}
+    };
+
+    struct declaration : rule<declaration, decltype(keyword() >> id() >> (anything() / lit<';'>()))>
+    {
+        static const char *name() {return "declaration";}
+    };
+
+    struct expression;
+    struct statement;
+
+    struct subexpression : rule<subexpression, seq<seq<lit<'('>, expression>, lit<')'>>>
+    {
+        static const char *name() {return "subexpression";}
+    };
+
+    struct expression : rule<expression, choice<subexpression, anything>>
+    {
+        static const char *name() {return "expression";}
+    };
+
+    typedef choice<seq<lit<'{'>, lit<'}'>>, seq<seq<lit<'{'>, plus<statement>>, lit<'}'>>> block;
+
+    typedef seq<seq<seq<seq<lit<'i', 'f'>, lit<'('>>, expression>, lit<')'>>, statement> if_head;
+    typedef choice<seq<seq<if_head, lit<'e', 'l', 's', 'e'>>, statement>, if_head> if_statement;
+
+    struct statement : rule<statement, decltype((expression() >> lit<';'>()) | block() | if_statement())> { };
+
+    typedef decltype(+(comment() | include() | declaration() | statement())) start;
+}
+
+void dump_shape(const Match &match, std::ostream &out)
+{
+    out << match.matched << ' ' << match.begin.position() << ' ' << match.end.position() << " (";
+    for (auto c = match.children.begin(); c != match.children.end(); ++c)
+        dump_shape(**c, out);
+    out << ')';
+}
+
+// Parse with the profiler on, check its counts and times add up, and print
+// its report as CSV.
+int profile_parse(const TokenStream &tokens)
+{
+    auto start = grammar();
+    Grammar compiled(start);
+    vemaparse::Profiler profiler;
+    ParseContext ctx(compiled, tokens.size() + 1);
+    ctx.profiler = &profiler;
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    const bool failed = ret->end != tokens.end();
+    if (failed)
+        std::cerr << "ERROR: failed to parse\n";
+
+    const std::vector<vemaparse::RuleProfile> rules = profiler.report(compiled);
+    double exclusive = 0, inclusive = 0;
+    bool counted = true;
+    for (auto iter = rules.begin(); iter != rules.end(); ++iter) {
+        exclusive += iter->exclusive;
+        if (iter->rule == 0)
+            inclusive = iter->inclusive;
+        if (iter->invocations != iter->successes + iter->failures)
+            counted = false;
+        const bool memoized = compiled.rule(iter->rule)->memoized;
+        if (memoized ? iter->invocations != iter->memo_hits + iter->memo_misses + iter->at_end
+                     : iter->memo_hits || iter->memo_misses) {
+            std::cerr << "ERROR: rule " << iter->rule << " " << iter->name << " has " << iter->invocations
+                      << " invocations, " << iter->memo_hits << " memo hits, " << iter->memo_misses << " misses and "
+                      << iter->at_end << " at the end\n";
+            counted = false;
+        }
+    }
+    // Every call's own time is in exactly one rule's exclusive time.
+    const bool timed = !rules.empty() && std::fabs(exclusive - inclusive) <= 1e-6 * inclusive + 1e-9;
+    if (!timed)
+        std::cerr << "ERROR: exclusive times add up to " << exclusive << " s, the start rule took " << inclusive << " s\n";
+    vemaparse::write_csv(std::cout, rules);
+    start->reset();
+    return failed || !counted || !timed ? 1 : 0;
+}
+
+// Parse with the grammar fixed at compile time and check it builds a tree of
+// the same shape as the dynamic one and fills in a MemoProfile.
+int static_parse(const TokenStream &tokens)
+{
+    typedef std::chrono::steady_clock clock;
+    typedef vemaparse::fixed::Grammar<fixed_grammar::start, TokenStream::iterator, Node> FixedGrammar;
+    auto start = grammar();
+    Grammar compiled(start);
+    FixedGrammar fixed;
+
+    clock::time_point begin = clock::now();
+    ParseContext ctx(compiled, tokens.size() + 1);
+    Match *expected = start->get_match(ctx, tokens.begin(), tokens.end());
+    const double dynamic = std::chrono::duration<double>(clock::now() - begin).count();
+
+    begin = clock::now();
+    ParseContext fixed_ctx(fixed, tokens.size() + 1);
+    Match *ret = fixed.match(fixed_ctx, tokens.begin(), tokens.end());
+    const double elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+
+    std::ostringstream a, b;
+    dump_shape(*ret, a);
+    dump_shape(*expected, b);
+    std::cout << fixed.size() << " rules, fixed " << elapsed * 1000 << " ms, "
+              << compiled.size() << " rules, dynamic " << dynamic * 1000 << " ms\n";
+    if (a.str() != b.str()) {
+        std::cerr << "ERROR: fixed grammar built a different tree\n";
+        return 1;
+    }
 
-    Node::node_ptr node = std::make_shared<Node>();
-    node->parent = parent;
-    node->name = match.name;
-    node->text = match_string;
-    parent->children.push_back(node);
+    // The memo profile counts the same hits and matches as the profiler.
+    vemaparse::MemoProfile profile(fixed.size());
+    vemaparse::Profiler profiler;
+    fixed_ctx.reset(tokens.size() + 1);
+    fixed_ctx.memo_profile = &profile;
+    fixed_ctx.profiler = &profiler;
+    fixed.match(fixed_ctx, tokens.begin(), tokens.end());
+    const std::vector<vemaparse::RuleProfile> rules = profiler.report(fixed);
+    bool counted = !rules.empty();
+    for (auto iter = rules.begin(); iter != rules.end(); ++iter)
+        if (profile.hits[iter->rule] != iter->memo_hits ||
+            profile.matches[iter->rule] != iter->invocations - iter->memo_hits - iter->at_end)
+            counted = false;
+    if (!counted) {
+        std::cerr << "ERROR: fixed grammar memo profile differs from the profiler\n";
+        return 1;
+    }
+    start->reset();
+    return 0;
+}
 
-    for (auto c = match.children.begin(); c != match.children.end(); ++c) 
-        visit_match(**c, node, failed);
+// Whether two logs have the same events, comparing rule ids only with ids.
+bool same_events(const vemaparse::EventLog &a, const vemaparse::EventLog &b, bool ids)
+{
+    if (a.size() != b.size())
+        return false;
+    for (std::size_t i = 0; i < a.size(); ++i)
+        if (a[i].type != b[i].type || a[i].begin != b[i].begin || a[i].end != b[i].end || (ids && a[i].rule != b[i].rule))
+            return false;
+    return true;
+}
 
-    if (match.action) {
-        match.action(*node);
-    } else {
-        ast::skip_node(*node);
+std::string ast_dot(const Node &root)
+{
+    std::ostringstream ss;
+    {
+        ast::Writer out(ss);
+        ast::write_dot(out, root);
     }
+    return ss.str();
 }
 
-Rule grammar()
+// Log the events while matching with get_match, a Program and the fixed
+// grammar, without building the tree, and check that each log holds the
+// tree a normal parse builds. Then log with each item committed by a cut()
+// and build the AST from the log into events.dot, which must match the one
+// visit_match builds (ast.dot).
+int events_parse(const TokenStream &tokens)
 {
-    auto open_comment = r("/\\*.*");
-    auto close_comment = r("[^\\\\]*\\*/");
-    auto anything = r(".*");
-    auto comment = (t(vemalex::COMMENT) | (open_comment >> (anything / close_comment)));
-    comment->name = "comment";
+    typedef vemaparse::fixed::Grammar<fixed_grammar::start, TokenStream::iterator, Node> FixedGrammar;
+    auto start = grammar();
+    Grammar compiled(start);
+    ParseContext ctx(compiled, tokens.size() + 1);
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    const bool failed = ret->end != tokens.end();
+    if (failed)
+        std::cerr << "ERROR: failed to parse\n";
+    vemaparse::EventLog expected;
+    expected.append(*ret);
 
-    auto id = t(vemalex::IDENTIFIER);
-    id->name = "id";
+    Program program(compiled);
+    FixedGrammar fixed;
+    ParseContext plain(compiled, tokens.size() + 1), vm_ctx(compiled, tokens.size() + 1), fixed_ctx(fixed, tokens.size() + 1);
+    vemaparse::EventLog logs[3];
+    ParseContext *contexts[] = {&plain, &vm_ctx, &fixed_ctx};
+    for (int i = 0; i < 3; ++i) {
+        contexts[i]->events = &logs[i];
+        contexts[i]->arena.keep_children = false;
+    }
+    start->get_match(plain, tokens.begin(), tokens.end());
+    program.match(vm_ctx, tokens.begin(), tokens.end());
+    fixed.match(fixed_ctx, tokens.begin(), tokens.end());
+    // The fixed grammar numbers its rules differently.
+    bool logged = same_events(logs[0], expected, true) && same_events(logs[1], expected, true) &&
+                        same_events(logs[2], expected, false);
+    std::cout << expected.size() << " events, " << expected.size() * sizeof(vemaparse::Event) << " bytes; tree "
+              << ctx.arena.size() << " bytes, arena without the tree " << plain.arena.size() << " bytes\n";
+    if (!logged)
+        std::cerr << "ERROR: logged events differ from the tree: get_match " << logs[0].size() << ", vm "
+                  << logs[1].size() << ", fixed " << logs[2].size() << ", tree " << expected.size() << "\n";
 
-    auto semi = r(";");
-    semi->name = "semi";
+    // A memoized match taken back with the alternative that failed must be
+    // logged again when the next one gets it from the memo.
+    {
+        const char text[] = "a b d";
+        const TokenStream short_tokens((Lexer(text, text + std::strlen(text))));
+        Rule x = vemaparse::literal<TokenStream::iterator, Node>("a") >> vemaparse::literal<TokenStream::iterator, Node>("b");
+        Rule both = (x >> vemaparse::literal<TokenStream::iterator, Node>("c")) |
+                    (x >> vemaparse::literal<TokenStream::iterator, Node>("d"));
+        Grammar small(both);
+        ParseContext tree_ctx(small), log_ctx(small);
+        vemaparse::EventLog tree_log, log;
+        tree_log.append(*both->get_match(tree_ctx, short_tokens.begin(), short_tokens.end()));
+        log_ctx.events = &log;
+        log_ctx.arena.keep_children = false;
+        both->get_match(log_ctx, short_tokens.begin(), short_tokens.end());
+        if (tree_log.empty() || !same_events(log, tree_log, true)) {
+            std::cerr << "ERROR: events of a memo hit after backtracking differ\n";
+            logged = false;
+        }
+        both->reset();
+    }
 
-    auto include = r("#") >> r("include") >> (t(vemalex::STRING_LITERAL) | (r("<") >> t(vemalex::IDENTIFIER) >> r(">")));
-    include->name = "include";
+    Node::node_ptr visited = std::make_shared<Node>();
+    visited->name = "root";
+    for (auto iter = ret->children.begin(); iter != ret->children.end(); ++iter)
+        visit_match(compiled, **iter, visited, failed);
 
-    auto keyword = r("int") | r("float") | r("double");
-    keyword->name = "keyword";
-    auto declaration = keyword >> id >> (anything / semi);
-    declaration->name = "declaration";
+    auto cut_start = grammar(true);
+    Grammar cut_compiled(cut_start);
+    ParseContext cut_ctx(cut_compiled);
+    vemaparse::EventLog log;
+    cut_ctx.events = &log;
+    cut_ctx.arena.keep_children = false;
+    std::size_t peak = 0;
+    cut_ctx.on_commit = [&](Match &) {peak = std::max(peak, cut_ctx.arena.size());};
+    cut_start->get_match(cut_ctx, tokens.begin(), tokens.end());
+    std::cout << log.size() << " events with cut(), peak arena " << peak << " bytes\n";
+    // Even when the parse fails after committing items, every ENTER has its
+    // LEAVE.
+    int depth = 0;
+    for (auto iter = log.begin(); iter != log.end() && depth >= 0; ++iter)
+        depth += iter->type == vemaparse::Event::ENTER ? 1 : iter->type == vemaparse::Event::LEAVE ? -1 : 0;
+    if (depth) {
+        std::cerr << "ERROR: events with cut() aren't balanced\n";
+        logged = false;
+    }
 
-    auto expression = Rule::create_empty_rule();
-    expression->name = "expression";
-    auto subexpression = r("\\(") >> expression >> r("\\)");
-    subexpression->name = "subexpression";
-    expression = subexpression | anything;
+    Node::node_ptr root = std::make_shared<Node>();
+    root->name = "root";
+    AstBuilder builder(cut_compiled, tokens, root);
+    vemaparse::replay(log, builder);
+    const std::string dot = ast_dot(*root);
+    std::ofstream("events.dot", std::ios::binary | std::ios::trunc) << dot;
+    const bool same = failed || dot == ast_dot(*visited);
+    if (!same)
+        std::cerr << "ERROR: AST built from events differs from visit_match's\n";
+    cut_start->reset();
+    start->reset();
+    return failed || !logged || !same ? 1 : 0;
+}
 
-    auto block = Rule::create_empty_rule();
-    auto statement = Rule::create_empty_rule();
-    block = (r("\\{") >> r("\\}")) |
-            (r("\\{") >> (+statement) >> r("\\}"));
+// Where a parse failed farthest and the ids of the token rules expected
+// there, e.g. "1: 3 4".
+std::string failure(const ParseContext &ctx)
+{
+    std::ostringstream ss;
+    ss << ctx.farthest_failure << ":";
+    for (auto iter = ctx.expected.begin(); iter != ctx.expected.end(); ++iter)
+        ss << " " << *iter;
+    return ss.str();
+}
 
-    auto if_statement = (r("if") >> r("\\(") >> expression >> r("\\)") >> statement >> r("else") >> statement) |
-                        (r("if") >> r("\\(") >> expression >> r("\\)") >> statement);
+// Parse text with start through get_match, a Program and the fixed grammar
+// Fixed, which number their rules alike as long as no literal appears
+// twice, and check that all three fail at
+// position with the expected tokens, given by name or 'literal'.
+template <typename Fixed>
+bool check_failure(const char *text, Rule start, std::size_t position, const std::string &expected)
+{
+    typedef vemaparse::fixed::Grammar<Fixed, TokenStream::iterator, Node> FixedGrammar;
+    const TokenStream tokens((Lexer(text, text + std::strlen(text))));
+    Grammar compiled(start);
+    Program program(compiled);
+    FixedGrammar fixed;
+    ParseContext ctx(compiled, tokens.size() + 1), vm_ctx(compiled, tokens.size() + 1), fixed_ctx(fixed, tokens.size() + 1);
+    start->get_match(ctx, tokens.begin(), tokens.end());
+    program.match(vm_ctx, tokens.begin(), tokens.end());
+    fixed.match(fixed_ctx, tokens.begin(), tokens.end());
+
+    std::string names;
+    for (auto iter = ctx.expected.begin(); iter != ctx.expected.end(); ++iter)
+        names += (iter == ctx.expected.begin() ? "" : ", ") + expected_token(compiled, *iter);
+    const bool ok = ctx.farthest_failure == position && names == expected &&
+                    failure(vm_ctx) == failure(ctx) && failure(fixed_ctx) == failure(ctx);
+    std::cout << "\"" << text << "\": " << ctx.farthest_failure << " expected " << names << (ok ? "" : " WRONG") << "\n";
+    if (!ok)
+        std::cerr << "ERROR: get_match " << failure(ctx) << ", vm " << failure(vm_ctx) << ", fixed " << failure(fixed_ctx) << "\n";
+    start->reset();
+    return ok;
+}
 
-    statement = (expression >> r(";")) | block | if_statement;
+namespace fixed_errors
+{
+    using namespace vemaparse::fixed;
 
-    return +(comment | include | declaration | statement);
+    struct c_text
+    {
+        template <typename Text>
+        bool operator ()(const Text &text) const
+        {
+            return text == "c";
+        }
+    };
+
+    typedef decltype(lit<'a'>() >> (lit<'b'>() | lit<'c'>())) choice;
+    typedef decltype(lit<'a'>() >> (lit<'b'>() | predicate<c_text>())) custom;
+    typedef decltype(lit<'a'>() >> ((lit<'b'>() >> lit<'x'>()) | -lit<'e'>() >> lit<'c'>())) nested;
+
+    struct throws
+    {
+        template <typename Text>
+        bool operator ()(const Text &) const
+        {
+            throw vemalex::LexerError("bad token");
+        }
+    };
+
+    typedef decltype(lit<'a'>() >> (predicate<throws>() | lit<'b'>())) lexer_error;
+}
+
+// Check the failures reported on malformed inputs, including ones where
+// choices skip alternatives that can't start at the failing token, and that
+// the test grammar fails on input at the same place with every engine.
+int error_parse(const TokenStream &tokens)
+{
+    typedef vemaparse::fixed::Grammar<fixed_grammar::start, TokenStream::iterator, Node> FixedGrammar;
+    typedef vemaparse::RuleWrapper<TokenStream::iterator, Node> (*Make)(const std::string &);
+    const Make lit = vemaparse::literal<TokenStream::iterator, Node>;
+    const Rule c = vemaparse::regex<TokenStream::iterator, Node>("[c]");
+    bool ok = check_failure<fixed_errors::choice>("a d", lit("a") >> (lit("b") | lit("c")), 1, "'b', 'c'");
+    ok &= check_failure<fixed_errors::custom>("a d", lit("a") >> (lit("b") | c), 1, "'b', regex");
+    ok &= check_failure<fixed_errors::nested>("a d", lit("a") >> ((lit("b") >> lit("x")) | (-lit("e") >> lit("c"))), 1,
+                                              "'b', 'e', 'c'");
+    ok &= check_failure<fixed_errors::choice>("a", lit("a") >> (lit("b") | lit("c")), 1, "'b', 'c'");
+
+    // A lexer error fails the rule that threw it, and is kept in the context.
+    {
+        const char text[] = "a b";
+        const TokenStream short_tokens((Lexer(text, text + std::strlen(text))));
+        Rule bad(std::make_shared<vemaparse::Rule<TokenStream::iterator, Node>>("bad"));
+        bad->match = [](ParseContext &, TokenStream::iterator, TokenStream::iterator) -> Match * {
+            throw vemalex::LexerError("bad token");
+        };
+        Rule start = lit("a") >> (bad | lit("b"));
+        Grammar compiled(start);
+        Program program(compiled);
+        vemaparse::fixed::Grammar<fixed_errors::lexer_error, TokenStream::iterator, Node> fixed;
+        ParseContext ctx(compiled), vm_ctx(compiled), fixed_ctx(fixed);
+        const bool parsed = start->get_match(ctx, short_tokens.begin(), short_tokens.end())->end == short_tokens.end() &&
+                            program.match(vm_ctx, short_tokens.begin(), short_tokens.end())->end == short_tokens.end() &&
+                            fixed.match(fixed_ctx, short_tokens.begin(), short_tokens.end())->end == short_tokens.end();
+        std::cout << "\"" << text << "\": lexer error \"" << ctx.lexer_error << "\"\n";
+        if (!parsed || ctx.lexer_error != "bad token" || vm_ctx.lexer_error != ctx.lexer_error ||
+            fixed_ctx.lexer_error != ctx.lexer_error) {
+            std::cerr << "ERROR: lexer error not kept: get_match \"" << ctx.lexer_error << "\", vm \""
+                      << vm_ctx.lexer_error << "\", fixed \"" << fixed_ctx.lexer_error << "\"\n";
+            ok = false;
+        }
+        start->reset();
+    }
+
+    auto start = grammar();
+    Grammar compiled(start);
+    Program program(compiled);
+    FixedGrammar fixed;
+    ParseContext ctx(compiled, tokens.size() + 1), vm_ctx(compiled, tokens.size() + 1), fixed_ctx(fixed, tokens.size() + 1);
+    const bool failed = start->get_match(ctx, tokens.begin(), tokens.end())->end != tokens.end();
+    program.match(vm_ctx, tokens.begin(), tokens.end());
+    fixed.match(fixed_ctx, tokens.begin(), tokens.end());
+    std::cout << "input " << (failed ? "failed at " + failure(ctx) : std::string("parsed")) << "\n";
+    // The fixed grammar has one rule per distinct literal, so only its
+    // position can be compared.
+    if (failure(vm_ctx) != failure(ctx) || fixed_ctx.farthest_failure != ctx.farthest_failure ||
+        fixed_ctx.expected.empty() != ctx.expected.empty()) {
+        std::cerr << "ERROR: get_match " << failure(ctx) << ", vm " << failure(vm_ctx) << ", fixed " << failure(fixed_ctx) << "\n";
+        ok = false;
+    }
+    start->reset();
+    return ok ? 0 : 1;
+}
+
+// Parse through a ParseCache in the current directory twice, so that at
+// least the second parse is a hit, and check both against a plain parse.
+int cache_parse(const vemalex::MappedSource &input)
+{
+    typedef std::chrono::steady_clock clock;
+    const Lexer lexer(input.begin(), input.end());
+    auto start = grammar();
+    Grammar compiled(start);
+    vemaparse::ParseCache<Node> cache(".", compiled);
+    vemaparse::CachedParse parses[2];
+    double times[2];
+    for (int i = 0; i < 2; ++i) {
+        const clock::time_point begin = clock::now();
+        cache.parse(lexer, parses[i]);
+        times[i] = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+    }
+
+    const clock::time_point begin = clock::now();
+    TokenStream tokens(lexer);
+    ParseContext ctx(compiled, tokens.size() + 1);
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    ast::Tree tree;
+    tree.append(tree.root(), *ret, [](ast::Tree &, uint32_t) { });
+    const double plain = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+
+    bool same = true;
+    for (int i = 0; i < 2; ++i) {
+        const vemaparse::CachedParse &parse = parses[i];
+        if (parse.tokens.size() != tokens.size() || parse.matched != ret->matched || parse.end != ret->end.position())
+            same = false;
+        for (uint32_t t = 0; same && t < tokens.size(); ++t)
+            if (parse.tokens.kind(t) != tokens.kind(t) || parse.tokens.offset(t) != tokens.offset(t) ||
+                parse.tokens.length(t) != tokens.length(t))
+                same = false;
+        if (!same_tree(compiled, tree, parse.tree()))
+            same = false;
+    }
+
+    // Point the first token far past the input: the entry must be refused
+    // and stored again.
+    bool refused = false;
+    if (tokens.size()) {
+        std::string entry;
+        {
+            std::ifstream ifs(cache.entry(lexer).c_str(), std::ios::binary);
+            entry.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        }
+        const uint64_t offset = uint64_t(1) << 20, at = sizeof(vemaparse::CacheHeader) + (tokens.size() + 7) / 8 * 8;
+        if (entry.size() >= at + sizeof(offset)) {
+            std::memcpy(&entry[at], &offset, sizeof(offset));
+            std::ofstream(cache.entry(lexer).c_str(), std::ios::binary | std::ios::trunc) << entry;
+            vemaparse::CachedParse corrupt, stored;
+            cache.parse(lexer, corrupt);
+            cache.parse(lexer, stored);
+            refused = !corrupt.hit && stored.hit && corrupt.tokens.offset(0) == tokens.offset(0);
+        }
+    }
+
+    auto other_start = grammar(true);
+    Grammar other(other_start);
+    const bool distinct = vemaparse::fingerprint(other) != vemaparse::fingerprint(compiled);
+    other_start->reset();
+
+    std::cout << "first parse " << (parses[0].hit ? "hit " : "missed ") << times[0] << " ms, second "
+              << (parses[1].hit ? "hit " : "missed ") << times[1] << " ms, without the cache " << plain << " ms\n";
+    start->reset();
+    if (!same) {
+        std::cerr << "ERROR: cached parse differs\n";
+        return 1;
+    }
+    if (!refused) {
+        std::cerr << "ERROR: corrupted cache entry was used\n";
+        return 1;
+    }
+    if (!parses[1].hit || !distinct) {
+        std::cerr << "ERROR: " << (distinct ? "second parse missed the cache" : "grammars share a fingerprint") << "\n";
+        return 1;
+    }
+    return ret->end != tokens.end() ? 1 : 0;
+}
+
+// Parse the files named on the command line, and the ones under the
+// directories named there, on every core or on --threads N threads, and
+// report each file and the total throughput.
+int batch_parse(int argc, char *argv[])
+{
+    typedef std::chrono::steady_clock clock;
+    unsigned threads = 0;
+    std::vector<std::string> paths;
+    for (int i = 0; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = unsigned(std::atoi(argv[++i]));
+            continue;
+        }
+        try {
+            vemalex::list_files(arg, paths);
+        } catch (const vemalex::SourceError &) {
+            // Not a directory. If it's no file either, that's reported with
+            // the results.
+            paths.push_back(arg);
+        }
+    }
+
+    auto start = grammar();
+    Grammar compiled(start);
+    vemaparse::BatchParser<Node> batch(compiled, threads);
+    const clock::time_point begin = clock::now();
+    const std::vector<vemaparse::BatchResult> results = batch.parse(paths);
+    const double elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+
+    std::size_t counts[4] = {0, 0, 0, 0};
+    uint64_t bytes = 0, tokens = 0;
+    for (auto iter = results.begin(); iter != results.end(); ++iter) {
+        ++counts[iter->status];
+        bytes += iter->bytes;
+        tokens += iter->tokens;
+        switch (iter->status) {
+        case vemaparse::BatchResult::PARSED:
+            std::cout << iter->path << ": parsed " << iter->tokens << " tokens in " << iter->seconds * 1000 << " ms\n";
+            break;
+        case vemaparse::BatchResult::FAILED:
+            std::cout << iter->path << ":" << iter->line << ":" << iter->column << ": failed to parse, expected";
+            for (auto e = iter->expected.begin(); e != iter->expected.end(); ++e)
+                std::cout << (e == iter->expected.begin() ? " " : ", ") << expected_token(compiled, *e);
+            std::cout << "\n";
+            break;
+        default:
+            std::cout << iter->path << ": " << iter->error << "\n";
+            break;
+        }
+    }
+    std::cout << results.size() << " files on " << batch.thread_count() << " threads: " << counts[0] << " parsed, "
+              << counts[1] << " failed, " << counts[2] + counts[3] << " errors; " << bytes << " bytes, " << tokens
+              << " tokens in " << elapsed << " s, " << bytes / elapsed / (1 << 20) << " MB/s\n";
+    start->reset();
+    return counts[0] == results.size() ? 0 : 1;
+}
+
+// Lex the input with a symbol table, check that every identifier's symbol
+// has its text, and count the declared names through the "id" nodes of the
+// parse tree.
+int symbol_parse(const vemalex::MappedSource &input)
+{
+    typedef std::chrono::steady_clock clock;
+    Lexer lexer(input.begin(), input.end());
+    clock::time_point begin = clock::now();
+    const TokenStream plain(lexer);
+    const double plain_time = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+    vemalex::SymbolTable symbols;
+    begin = clock::now();
+    const TokenStream tokens(lexer, &symbols);
+    const double symbol_time = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+
+    std::size_t identifiers = 0, wrong = 0;
+    for (uint32_t i = 0; i < tokens.size(); ++i) {
+        const uint32_t symbol = tokens.symbol(i);
+        if (tokens.kind(i) != vemalex::IDENTIFIER) {
+            wrong += symbol != vemalex::SymbolTable::none;
+            continue;
+        }
+        ++identifiers;
+        const vemalex::TokenView<const char *> text(tokens.token_begin(i), tokens.token_end(i));
+        wrong += symbol == vemalex::SymbolTable::none || symbols.text(symbol) != text || symbols.find(text.begin(), text.end()) != symbol;
+    }
+    std::cout << identifiers << " identifiers, " << symbols.size() << " symbols, " << wrong << " wrong; lexing "
+              << plain_time << " ms, with symbols " << symbol_time << " ms\n";
+
+    auto start = grammar();
+    Grammar compiled(start);
+    ParseContext ctx(compiled, tokens.size() + 1);
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    const bool failed = ret->end != tokens.end();
+    if (failed)
+        std::cerr << "ERROR: failed to parse\n";
+    ast::Tree tree;
+    tree.append(tree.root(), *ret, [](ast::Tree &, uint32_t) { }, failed);
+    const uint32_t id = compiled.find("id");
+    std::vector<uint32_t> declared(symbols.size());
+    std::size_t declarations = 0;
+    tree.preorder([&](uint32_t node, uint32_t) {
+        if (tree[node].kind != id)
+            return;
+        const uint32_t symbol = ast::symbol(tokens, tree[node]);
+        if (symbol == vemalex::SymbolTable::none) {
+            ++wrong;
+            return;
+        }
+        ++declarations;
+        ++declared[symbol];
+    });
+    std::cout << declarations << " declarations:";
+    for (uint32_t symbol = 0; symbol < declared.size(); ++symbol)
+        if (declared[symbol])
+            std::cout << " " << symbols.text(symbol) << " x" << declared[symbol];
+    std::cout << "\n";
+    start->reset();
+    return failed || wrong ? 1 : 0;
+}
+
+// Lex the input repeatedly for about a second and report throughput.
+int lex_bench(const vemalex::MappedSource &input)
+{
+    typedef std::chrono::steady_clock clock;
+    const clock::time_point start = clock::now();
+    uint64_t passes = 0, tokens = 0;
+    double elapsed = 0;
+    try {
+        do {
+            Lexer lexer(input.begin(), input.end());
+            for (auto iter = lexer.begin(); iter != lexer.end(); ++iter)
+                ++tokens;
+            ++passes;
+            elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        } while (elapsed < 1.0);
+    } catch (const vemalex::LexerError &error) {
+        std::cerr << "ERROR: " << error.what() << std::endl;
+        return 1;
+    }
+    std::cout << "lexed " << input.size() << " bytes x " << passes << ": "
+              << (double(input.size()) * passes / elapsed) << " bytes/s, "
+              << (tokens / elapsed) << " tokens/s\n";
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
-        std::cerr << "USAGE: " << argv[0] << " input_file\n";
+    if (argc > 2 && std::string(argv[1]) == "--batch")
+        return batch_parse(argc - 2, argv + 2);
+    const std::string mode = argc == 3 ? argv[1] : "";
+    const bool bench = mode == "--lex-bench";
+    const bool stream = mode == "--stream";
+    const bool incremental = mode == "--incremental";
+    const bool parallel = mode == "--parallel";
+    const bool vm = mode == "--vm";
+    const bool fixed = mode == "--static";
+    const bool memo = mode == "--memo";
+    const bool events = mode == "--events";
+    const bool tree = mode == "--tree";
+    const bool serialize = mode == "--serialize";
+    const bool cache = mode == "--cache";
+    const bool symbols = mode == "--symbols";
+    const bool errors = mode == "--errors";
+    const bool profile = mode == "--profile";
+    if ((argc != 2 && argc != 3) ||
+        (argc == 3 && !bench && !stream && !incremental && !parallel && !vm && !fixed && !memo && !events && !tree &&
+         !serialize && !cache && !symbols && !errors &&
+         !profile)) {
+        std::cerr << "USAGE: " << argv[0]
+                  << " [--lex-bench | --stream | --incremental | --parallel | --vm | --static | --memo | --events | --tree"
+                  << " | --serialize | --cache | --symbols | --errors | --profile] input_file\n"
+                  << "       " << argv[0] << " --batch [--threads N] file_or_directory...\n";
         ::exit(1);
     }
-    std::ifstream file(argv[1]);
-    if (!file) {
-        std::cerr << "ERROR: could not open \"" << argv[1] << "\"; exiting." << std::endl;
+    const char *path = argv[argc - 1];
+    vemalex::MappedSource input;
+    try {
+        input = vemalex::MappedSource(path);
+    } catch (const vemalex::SourceError &) {
+        std::cerr << "ERROR: could not open \"" << path << "\"; exiting." << std::endl;
         ::exit(1);
     }
-    std::string input = std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    vemalex::Lexer<std::string::iterator> lexer = vemalex::Lexer<std::string::iterator>(input.begin(), input.end());
+    if (bench)
+        return lex_bench(input);
+    if (cache) {
+        try {
+            return cache_parse(input);
+        } catch (const vemalex::LexerError &error) {
+            std::cerr << "ERROR: " << error.what() << std::endl;
+            ::exit(1);
+        }
+    }
+    if (symbols) {
+        try {
+            return symbol_parse(input);
+        } catch (const vemalex::LexerError &error) {
+            std::cerr << "ERROR: " << error.what() << std::endl;
+            ::exit(1);
+        }
+    }
+    if (incremental) {
+        try {
+            return incremental_parse(input);
+        } catch (const vemalex::LexerError &error) {
+            std::cerr << "ERROR: " << error.what() << std::endl;
+            ::exit(1);
+        }
+    }
+    Lexer lexer(input.begin(), input.end());
+    if (stream || parallel || vm || fixed || memo || events || tree || serialize || errors || profile) {
+        try {
+            TokenStream tokens(lexer);
+            if (vm)
+                return vm_parse(tokens);
+            if (memo)
+                return memo_parse(tokens);
+            if (events)
+                return events_parse(tokens);
+            if (tree)
+                return tree_parse(tokens);
+            if (serialize)
+                return serialize_parse(tokens);
+            if (fixed)
+                return static_parse(tokens);
+            if (errors)
+                return error_parse(tokens);
+            if (profile)
+                return profile_parse(tokens);
+            return stream ? stream_parse(tokens) : parallel_parse(tokens);
+        } catch (const vemalex::LexerError &error) {
+            std::cerr << "ERROR: " << error.what() << std::endl;
+            ::exit(1);
+        }
+    }
     #if 1
     try {
         for (auto iter = lexer.begin(); iter != lexer.end(); ++iter) {
@@ -202,54 +1284,52 @@ int main(int argc, char *argv[])
     }
     #endif
 
-    #if 0
-    for (int i = 0; i < 1000000; ++i) {
-        auto start = grammar();
+    TokenStream tokens;
+    try {
+        tokens = TokenStream(lexer);
+    } catch (const vemalex::LexerError &error) {
+        std::cerr << "ERROR: " << error.what() << std::endl;
+        ::exit(1);
     }
-    printf("\n");
-    ::exit(0);
-    #endif
 
     auto start = grammar();
-    auto ret = start->get_match(lexer.begin(), lexer.end());
-    start->reset();
-    const bool failed = ret->end != lexer.end();
+    Grammar compiled(start);
+    ParseContext ctx(compiled, tokens.size() + 1);
+    auto ret = start->get_match(ctx, tokens.begin(), tokens.end());
+    const bool failed = ret->end != tokens.end();
 
     if (failed) {
-        // Walk the partial parse tree
-        std::shared_ptr<Match> p, m;
-        p = m = ret->children.back();
-        while (!m->children.empty()) {
-            p = m;
-            m = m->children.back();
-        }
-
-        vemalex::Lexer<std::string::iterator>::iterator lex_iter = m->end;
-        // get the line number
-        std::string line_string = get_line(input.begin(), input.end(), lex_iter);
-        std::cerr << "ERROR: failed to parse\n" << line_string << std::endl;
+        // Where the parse got farthest, and what it wanted there.
+        std::size_t offset = input.size();
+        if (ctx.farthest_failure < tokens.size())
+            offset = TokenStream::iterator(&tokens, uint32_t(ctx.farthest_failure), true).source_begin() - input.begin();
+        vemalex::LineIndex<const char *> lines(input.begin(), input.end());
+        const std::size_t line = lines.line(offset);
+        std::cerr << "ERROR: failed to parse\n" << line << ":" << lines.column(offset) << ": " << lines.text(line) << std::endl;
+        std::cerr << "expected";
+        for (auto iter = ctx.expected.begin(); iter != ctx.expected.end(); ++iter)
+            std::cerr << (iter == ctx.expected.begin() ? " " : ", ") << expected_token(compiled, *iter);
+        std::cerr << std::endl;
         std::cerr << "last end token " << *ret->end << std::endl;
     }
 
     {
         Node::node_ptr root = std::make_shared<Node>();
-        create_parse_tree(*ret, root);
+        create_parse_tree(compiled, *ret, root);
         std::ofstream ofs("parse.dot", std::ios::binary | std::ios::trunc);
-        ofs << "digraph html {\n";
-        root->debug(ofs);
-        ofs << "}";
+        ast::Writer out(ofs);
+        ast::write_dot(out, *root);
     }
 
     {
         Node::node_ptr root = std::make_shared<Node>();
         root->name = "root";
-        std::ofstream ofs;
-        ofs.open("ast.dot", std::ios::binary | std::ios::trunc);
-        ofs << "digraph html {\n";
         std::for_each(ret->children.begin(), ret->children.end(),
-                      [&root, failed](Match::match_shared_ptr m) {visit_match(*m, root, failed);});
+                      [&compiled, &root, failed](Match::match_ptr m) {visit_match(compiled, *m, root, failed);});
         // ret.match.action(ret.match, *root);
-        root->debug(ofs);
-        ofs << "}";
+        std::ofstream ofs("ast.dot", std::ios::binary | std::ios::trunc);
+        ast::Writer out(ofs);
+        ast::write_dot(out, *root);
     }
+    start->reset();
 }